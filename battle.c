@@ -7,16 +7,41 @@
  * _or_ for a new connection.
 */
 
+// for sched_setaffinity() and CPU sets
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/random.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
-#include <stdlib.h> // for rand
+#include <stdlib.h>
+#include <time.h>
+#include <signal.h>
+#include <limits.h>
+#include <math.h>
+
+#include "battlerules.h"
+#include "battleproto.h"
+#include "fiber.h"
 
 #ifndef PORT
     #define PORT 56073
@@ -24,94 +49,932 @@
 
 # define SECONDS 10
 
+// Rooms are kept in a fixed hash table keyed by name
+# define ROOM_BUCKETS 4096
+# define ROOM_NAME_MAX 32
+# define DEFAULT_ROOM "lobby"
+
+// Hot upgrade: clients are handed to the new binary this many at a time,
+// which keeps each message (and its fds) well under the socket limits
+# define HANDOFF_MAGIC 0x62617431
+# define HANDOFF_BATCH 16
+
+// Snapshots of the client list, written every SNAPSHOT_SECONDS when -s is given
+# define SNAPSHOT_MAGIC 0x62617432
+# define SNAPSHOT_SECONDS 5
+// How long a client without a socket is kept around waiting to be resumed,
+// after a restart and after losing its socket in a match
+# define RESUME_SECONDS 60
+# define GRACE_SECONDS 30
+
+// Session tokens are handed out with the name and looked up in a hash table
+# define TOKEN_LEN 16
+# define TOKEN_BUCKETS 65536
+// and so are names, which have to be unique
+# define NAME_BUCKETS 65536
+
+// Input rate limits per client: bytes and commands (lines or moves) per
+// second, and how many can arrive at once after a quiet spell
+# define BYTES_PER_SEC 512
+# define BYTES_BURST 2048
+# define COMMANDS_PER_SEC 5
+# define COMMANDS_BURST 10
+
+// Someone who has waited this long for an opponent gets a bot instead,
+// and bots take this long over a move
+# define BOT_WAIT_SECONDS 10
+# define BOT_THINK_MS 700
+
+// Matches seat up to MATCH_MAX players and come out of a pool that grows
+// MATCH_CHUNK at a time, a free-for-all has FFA_PLAYERS unless asked otherwise
+# define MATCH_MAX 8
+# define MATCH_CHUNK 64
+# define FFA_PLAYERS 4
+
+// Gateways (front-ends on the same host) connect to the -u socket and send
+// GATEWAY_MAGIC as their first byte, then carry players' sessions in frames.
+// A session's input is staged GATEWAY_INPUT bytes at a time. Frames for a
+// gateway are queued and written when it has room, one that falls
+// GATEWAY_OUTMAX bytes behind is cut off.
+# define GATEWAY_MAGIC 0xfe
+# define GATEWAY_BUF 65536
+# define GATEWAY_INPUT 1024
+# define GATEWAY_OUTMAX (4 << 20)
+# define SESSION_BUCKETS 65536
+
+// With -U, bots and simulations can play over UDP instead. A datagram
+// carries a UDP_HEADER byte header and at most UDP_PAYLOAD bytes of text.
+// Our text is numbered and resent after UDP_RTO_MS (twice as long each time)
+// until it is acknowledged, a peer is dropped after UDP_RETRIES resends or
+// with UDP_WINDOW datagrams unacknowledged. Datagrams are read and written
+// UDP_BATCH at a time and resends are looked for every UDP_TICK_MS.
+# define UDP_HEADER 13
+# define UDP_PAYLOAD 1200
+# define UDP_WINDOW 64
+# define UDP_BATCH 64
+# define UDP_RTO_MS 200
+# define UDP_RETRIES 6
+# define UDP_TICK_MS 50
+
+// Clients speaking the binary protocol (battleproto.h) have their state
+// and move frames held until their next write, PROTO_PENDING bytes at most
+# define PROTO_PENDING 64
+
+// Servers started with the same -c name share a queue of CLUSTER_SLOTS
+// waiting players and look through it every CLUSTER_MS
+# define CLUSTER_SLOTS 1024
+# define CLUSTER_MS 250
+// A server asking us for a player has CLUSTER_ASK_MS to send its request
+# define CLUSTER_ASK_MS 1000
+# define CLUSTER_MAGIC 0x62746c63
+
+// Messages and history jobs come out of pools that grow POOL_CHUNK blocks
+// at a time. Built with ALLOC_CHECK, ALLOC_TURNS turns after the first
+// ALLOC_WARMUP must not allocate anything.
+# define POOL_CHUNK 64
+# define ALLOC_WARMUP 1000
+# define ALLOC_TURNS 10000
+
+// So do clients' names, lines and output queues, and only while they have
+// any, so an idle connection is just its struct client. A name shorter
+// than NAME_SHORT takes a small block, lines (and longer names) LINE_LEN.
+# define NAME_SHORT 32
+# define LINE_LEN 256
+
+// Spectators are sent shared messages through a queue of SPECT_QUEUE of
+// them, one who falls further behind than that skips ahead to the match's state
+# define SPECT_QUEUE 64
+
+// Ready sockets are handled BATCH_MIN at a time while the server is quiet
+// and up to BATCH_MAX under load, and what a batch produced is written
+// once at the end of it. Turns, syscalls and segments are logged every
+// STATS_SECONDS.
+# define BATCH_MIN 1
+# define BATCH_MAX 64
+# define STATS_SECONDS 10
+
+// TCP clients get a keepalive after KEEPALIVE_IDLE quiet seconds, then every
+// KEEPALIVE_INTERVAL, and the kernel gives up on them after KEEPALIVE_COUNT
+// unanswered (-k changes these). With -p, binary clients that have been
+// silent that long are pinged, and dropped when they stay silent as long
+// again. They wait for it on a wheel of BEAT_SLOTS one second slots.
+# define KEEPALIVE_IDLE 60
+# define KEEPALIVE_INTERVAL 10
+# define KEEPALIVE_COUNT 3
+# define BEAT_SLOTS 64
+
+// -f names a configuration file of "key = value" lines, read at startup and
+// again on SIGHUP. What it leaves out keeps its default (or the command
+// line's value). The keys are in confkeys[].
+# define CONF_LINE 256
+
+// The ladder: everyone starts on RATING_START and one result moves a rating
+// by at most RATING_K. With -l the ratings are saved every LADDER_SECONDS.
+# define RATING_START 1200
+# define RATING_K 32
+# define LADDER_BUCKETS 65536
+# define LADDER_SECONDS 5
+# define TOP_MAX 20
+
+// With -H the match history goes in segment files of about HISTORY_SEGMENT
+// bytes, every player's last HISTORY_KEEP matches are indexed, and every
+// HISTORY_COMPACT_SECONDS segments nobody needs are cleaned up
+# define HISTORY_SEGMENT (1 << 20)
+# define HISTORY_KEEP 32
+# define HISTORY_BUCKETS 65536
+# define HISTORY_COMPACT_SECONDS 10
+
 enum client_state {
     AWAITING_NAME,  // Client has connected but hasn't sent their name
     LOOKING_FOR_MATCH,  // Client has sent their name and is waiting for a match
     IN_MATCH_ATTACK, // Client is currently in a match
-    IN_MATCH_DEFEND,
-    TYPING_CHAT // Client is typing a message
+    IN_MATCH_DEFEND
+};
+
+enum gateway_frame {
+    GW_OPEN = 1, // a new player, the session number is theirs from now on
+    GW_DATA,     // input from the player, or output for them
+    GW_CLOSE     // the player is gone (or, from us, there is no such session)
+};
+
+enum udp_datagram {
+    UDP_OPEN = 1, // a new player, the session number is theirs from this address
+    UDP_DATA,     // numbered input from the player, or output for them
+    UDP_ACK,      // nothing but the acknowledgement in the header
+    UDP_PING,     // asks for an acknowledgement
+    UDP_CLOSE     // the player is gone (or, from us, there is no such session)
+};
+
+enum match_mode {
+    MODE_DUEL,  // one on one
+    MODE_TEAMS, // 2v2, the seats alternate between the two teams
+    MODE_FFA    // everyone for themselves
+};
+
+struct client;
+
+// Token bucket, level is in thousandths of a token so that refilling by the
+// millisecond doesn't lose anything to rounding
+struct bucket {
+    long long level;
+    long long last; // now() at the last refill
+};
+
+struct room {
+    char name[ROOM_NAME_MAX];
+    int nmembers;
+    // Every named client in the room, linked through room_prev/room_next
+    struct client *members;
+    // Clients LOOKING_FOR_MATCH in the room, oldest first
+    struct client *queue_head;
+    struct client *queue_tail;
+    // Next room in the same hash bucket
+    struct room *hnext;
+};
+
+// A request to another server in the cluster for one of its players,
+// our own player stays claimed meanwhile
+struct pull {
+    int fd;
+    int slot;
+    unsigned int seq;
+    int mine;
+    unsigned int mineseq;
+    struct pull *next;
+};
+
+// A server that connected to ask for one of our players, until its
+// request comes in
+struct give {
+    int fd;
+    long long since;
+    struct give *next;
+};
+
+// A connection from a gateway, and the frames read from it that aren't complete yet
+struct gateway {
+    int fd;
+    int nsessions;
+    int inlen;
+    int stalled;  // fell too far behind, dropped after this round
+    char *out;    // frames waiting for room on fd
+    int outlen;
+    int outsize;
+    struct gateway *next;
+    char in[GATEWAY_BUF];
+};
+
+// A player's end of a UDP session: where its datagrams come from, the next
+// sequence number each way and our DATA it hasn't acknowledged, by sequence
+// number modulo UDP_WINDOW
+struct udppeer {
+    struct sockaddr_in addr;
+    unsigned int session;
+    unsigned int nextin;  // the DATA we take from it next
+    unsigned int nextout; // the number our next DATA gets
+    unsigned int acked;   // everything before this has arrived
+    int retries;          // resends since it last acknowledged anything
+    int stalled;          // its window filled up, dropped by udptimer()
+    long long sentat;     // now() when the oldest unacknowledged DATA last went
+    struct spectmsg *unacked[UDP_WINDOW];
+    struct client *client;
+    struct udppeer *hnext;     // next in the same hash bucket
+    struct udppeer *rtx_prev;  // on the unacknowledged list while acked != nextout
+    struct udppeer *rtx_next;
+    int onacks;           // on the list of peers owed an acknowledgement
+    int acking;           // and still owed one
+    struct udppeer *ack_next;
+};
+
+// A match in progress. Players take turns in seat order; a seat is emptied
+// when its player is knocked out or leaves, and the match is over once
+// everyone left is on the same team.
+struct match {
+    enum match_mode mode;
+    int id;    // what /watch calls it
+    int size;  // seats in use when the match started
+    int turn;  // seat whose move it is
+    struct client *players[MATCH_MAX];
+    // For the history: who sat where ("" if not known), moves made, and
+    // a bit per seat whose player left
+    char seatname[MATCH_MAX][256];
+    int moves;
+    unsigned int left;
+    // Clients watching, linked through watch_prev/watch_next
+    struct client *spectators;
+    int nspectators;
+    struct spectmsg *statemsg; // where the match stands, built when a spectator needs it
+    struct match *live_prev;   // every match being played
+    struct match *live_next;
+    struct match *next_free; // in the pool, only valid while unused
+};
+
+// A player's place on the ladder. Standings are kept by name, so they
+// outlive the client, in a hash table for lookups and in a treap ordered
+// best first for ranks. size counts the standings in the treap under this one.
+struct standing {
+    int rating;
+    int wins;
+    int losses;
+    unsigned int prio; // treap priority, parents have higher ones
+    int size;
+    struct standing *left;
+    struct standing *right;
+    struct standing *hnext; // next in the same hash bucket
+    char name[];
+};
+
+// A message for spectators, formatted once and shared by every queue it is on
+struct spectmsg {
+    int refs;
+    int len;
+    int framed; // already a binary protocol frame
+    int pool;   // the msgpools[] it came from, NMSGPOOLS if none
+    char data[];
 };
 
 struct client {
     int fd;
     struct in_addr ipaddr;
     struct client *next;
-    // Buffers for the client to store that name
-    char name[256];
+    struct client *prev;
+    // The client's name, "" until it has one, and the line it is typing.
+    // Both come out of the buffer pools, the line only while there is one.
+    char *name;
     int inputLength;
-    char inputBuffer[256];
-
-    char type[256];
-    int typeLengthBuffer;
-    // Store opponent if in match or NULL if not in match
-    struct client *opponent; 
-    // Store the last played opponent 
-    struct client *lastplayed;
+    char *inputBuffer;
+    // Store the match and the client's seat in it, NULL and -1 if not in match
+    struct match *match;
+    int seat;
+    // The kind of match the client is looking for, and for how many players
+    enum match_mode mode;
+    int nseats;
+    // Handle of the last played opponent, 0 for none
+    unsigned long long lastplayed;
     enum client_state state; // state of the client
-    enum client_state prevState;
     // game_state: 0: no game, 1: attack mode, -1: defend move
     int game_state; 
     int health;
     int power_moves;
     int on_mute; // 0: not muted, 1: muted
-    int in_state_typing_mute; // to handl ebreak if one player is on mute but stil is typign
-    // Buffer to store the input from the client
-    char buf[256];
+    // Room the client is in, NULL until they have sent their name
+    struct room *room;
+    struct client *room_prev;
+    struct client *room_next;
+    // Links in the room's matchmaking queue, only valid while queued is 1
+    struct client *queue_prev;
+    struct client *queue_next;
+    int queued;
+    // Set while the client has no socket and is waiting to be resumed
+    int suspended;
+    long long resume_deadline; // ms on the now() clock
+    struct client *suspend_next;
+    // Token that lets a new connection take this client over, "" until named
+    char token[TOKEN_LEN + 1];
+    struct client *token_next;
+    // Link in the name table, and the hash of the name
+    int named;
+    unsigned int namehash;
+    struct client *name_next;
+    // Input rate limits, and the list of clients whose socket we stopped reading
+    struct bucket bytesin;
+    struct bucket commands;
+    int paused;
+    struct client *paused_next;
+    int npauses;   // times the byte limit stopped us reading
+    int ndropped;  // commands thrown away over the limit
+    long long queued_at; // now() when the client joined its room's queue
+    // Bots have no socket, botmove is the input handleclient() will read next
+    int bot;
+    int botpending;  // a botturn() timer is waiting to fire
+    int botretiring; // on the retiring list, done with its match
+    char botmove;
+    struct client *bot_next;
+    // The match the client is watching, and its place among the spectators
+    struct match *watching;
+    struct client *watch_prev;
+    struct client *watch_next;
+    // Output the socket hasn't taken yet, oldest first. outoff bytes of the
+    // first message have gone already. Clients with any are on the outlist.
+    struct spectmsg **outq; // SPECT_QUEUE of them, NULL while there are none
+    int outhead;
+    int outcount;
+    int outoff;
+    int nskips; // times the client fell too far behind and skipped ahead
+    int outblocked; // its socket had no room the last time, wait for select()
+    struct client *out_next;
+    // A player behind a gateway has no socket: the gateway stages their
+    // input in vin (NULL when there is none), and vclosed is set once the
+    // gateway says they are gone. A text client's socket is read into vin
+    // as well, all it has at once, and the lines are split off from there.
+    struct gateway *gateway;
+    unsigned int session;
+    struct client *session_next;
+    char *vin;
+    int vinlen;
+    int vclosed;
+    // A UDP session has no socket either, its datagrams are staged the same way
+    struct udppeer *udp;
+    int local; // connected to the unix socket, so it may be a gateway
+    // Set once the client asked for the binary protocol. What its socket
+    // delivers waits in fin until whole frames are there and vin has room
+    // for them, they are decoded into vin like a session's input. The state
+    // and move frames meant for it wait in frames until its next write.
+    int binary;
+    unsigned char *fin;
+    int finlen;
+    unsigned char frames[PROTO_PENDING];
+    int nframes;
+    // 1 + the client's slot in the cluster's queue, 0 if it isn't in it
+    int clusterslot;
+    unsigned int clusterseq;
+    // Where handleclient() left off, NULL when it isn't waiting on anything
+    struct fiber *fiber;
+    // What other clients remember this one by, see deref()
+    unsigned long long ref;
+    // Heartbeats: now() when anything last came in, whether it has been
+    // pinged since, and its slot on the wheel while beating is set
+    long long lastheard;
+    int pinged;
+    int beating;
+    int beatslot;
+    struct client *beat_prev;
+    struct client *beat_next;
+};
+
+// Everything that can be changed without a restart. A configuration is
+// never changed once it is published, a reload publishes a new one.
+struct config {
+    unsigned int gen;       // which reload made it, counting from 1
+    struct in_addr listenaddr;
+    int port;
+    int idle_seconds;       // quiet this long and the loop logs its totals
+    int grace_seconds;      // a match waits this long for a player who lost their socket
+    int resume_seconds;     // and a client waits this long after a restart
+    int bot_wait_seconds;
+    int bot_think_ms;
+    int bytes_per_sec;
+    int bytes_burst;
+    int commands_per_sec;
+    int commands_burst;
+    int gateway_outmax;
+    int keepidle;           // TCP keepalive timing in seconds, no keepalives with idle 0
+    int keepintvl;
+    int keepcnt;
+    int heartbeat;          // the -p heartbeat in seconds, 0 for none
+    struct battle_rules rules;
+    struct config *retired_next;
+};
+
+struct timer {
+    long long when; // ms on the now() clock
+    void (*fn)(void *arg);
+    void *arg;
 };
 
 static struct client *addclient(struct client *top, int fd, struct in_addr addr);
-static struct client *removeclient(struct client *top, int fd);
-static void broadcast(struct client *top, char *s, int size);
+static struct client *removeclient(struct client *top, struct client *c);
+static void broadcastroom(struct room *r, char *s, int size);
+static struct room *findroom(const char *name, int create);
+static void joinroom(struct client *p, struct room *r);
+static void leaveroom(struct client *p);
+static void enterlobby(struct client *p);
+static void dequeue(struct client *p);
+static int findmatch(struct client *p);
+static void handlelobbyline(struct client *p);
+static long long now(void);
+static void addtimer(long long delay, void (*fn)(void *arg), void *arg);
+static long long runtimers(void);
+static int gamerand(void);
+static void suspend(struct client *p, long long deadline);
+static void unsuspend(struct client *p);
+static void issuetoken(struct client *p);
+static struct client *findtoken(const char *token);
+static void droptoken(struct client *p);
+static void addname(struct client *p);
+static struct client *findname(const char *name);
+static void dropname(struct client *p);
+static void tell(struct client *p, char *line);
+static void addref(struct client *p);
+static void dropref(struct client *p);
+static struct client *deref(unsigned long long ref);
+static void holdmatch(struct client *p);
+static void initlimits(struct client *p);
+static int stageinput(struct client *p);
+static void takeinput(struct client *p, int len);
+static int readclient(struct client *p, char *buf, int size);
+static int overbytes(struct client *p);
+static int takecommand(struct client *p);
+static void pauseclient(struct client *p);
+static void unpauseclient(struct client *p);
+static int sendclient(struct client *p, const char *s, int len);
+static void enqueue(struct client *p);
+static struct match *newmatch(void);
+static void freematch(struct match *m);
+static int turnupdate(struct client *p, char *buf);
+static int pickenemy(struct client *p, const char *arg);
+static void playmove(struct client *p, char move, int target);
+static void leavematch(struct client *p, const char *why);
+static struct client *matchheld(struct match *m);
+static const char *othersname(struct client *p);
+static int namelist(char *buf, struct client *p, int allies);
+static void listmatches(struct client *p);
+static void watch(struct client *p, struct match *m);
+static void unwatch(struct client *p);
+static void spectate(struct match *m, const char *s, int len);
+static void queueoutput(struct client *p, struct spectmsg *msg);
+static void dropoutput(struct client *p);
+static void flushoutput(fd_set *ready);
+static int flushclient(struct client *p);
+static void flushall(void);
+static void statstimer(void *arg);
+static void setkeepalive(int fd);
+static void heard(struct client *p);
+static void wheeloff(struct client *p);
+static void beattimer(void *arg);
+static void startbeats(void);
+static int relisten(int *listenfd);
+static int checkrules(const struct battle_rules *r, const char *path);
+static struct config *readconfig(const char *path);
+static void *configloader(void *arg);
+static long long outsegs(void);
+static struct spectmsg *newmsg(const char *s, int len);
+static void unrefmsg(struct spectmsg *msg);
+static void setname(struct client *p, const char *name);
+static void takeline(struct client *p);
+static void dropline(struct client *p);
+static void takevin(struct client *p);
+static void dropvin(struct client *p);
+static void takefin(struct client *p);
+static void dropfin(struct client *p);
+static void startturn(struct match *m);
+static struct client *unlinkclient(struct client *top, struct client *c);
+static void schedulebot(struct client *p);
+static void retirebot(struct client *p);
+static void bottimer(void *arg);
+static void reattach(struct client *old, struct client *p);
+static void expiretimer(void *arg);
+static void forfeit(struct client *p);
+static void sendmatch(struct client *p, const char *s, int len);
+static void snapshottimer(void *arg);
+static struct client *loadsnapshot(void);
+static void recordloss(struct match *m, struct client *l, struct client *by);
+static void recordwin(struct client *w);
+static void listtop(struct client *p, int n);
+static void showrank(struct client *p, const char *name);
+static void laddertimer(void *arg);
+static int saveladder(void);
+static void loadladder(void);
+static void recordmatch(struct match *m);
+static void showhistory(struct client *p, const char *name, int n);
+static void historyflush(void);
+static void loadhistory(void);
+static int sendsession(struct client *p, const char *s, int len);
+static void dropsession(struct client *p);
+static void movesession(struct client *old, struct client *new);
+static void runsession(struct client *p);
+static int readgateway(struct gateway *g);
+static int gatewayframes(struct gateway *g);
+static struct gateway *addgateway(int fd);
+static void removegateway(struct gateway *g);
+static void flushgateways(fd_set *ready);
+static int sendudp(struct client *p, const char *s, int len);
+static void dropudp(struct client *p);
+static void moveudp(struct client *old, struct client *new);
+static void queueudp(const struct sockaddr_in *addr, unsigned int session, int type,
+                     unsigned int seq, unsigned int ack, struct spectmsg *msg);
+static void lostudp(struct client *p);
+static int readudp(void);
+static void flushudp(void);
+static void udptimer(void *arg);
+static void closesockets(void);
+static void settleclient(struct client *p, int result);
+static int readtext(struct client *p);
+static int readbinary(struct client *p);
+static int stageframes(struct client *p);
+static int runbinary(struct client *p);
+static int stagestate(struct client *p);
+static int stagemove(struct client *q, struct client *p, int target, char move, int dmg);
+static int sendbinary(struct client *p, const char *s, int len);
+static void clusterjoin(void);
+static void clustertimer(void *arg);
+static void retract(struct client *p);
+static void endpull(struct pull *pl, int drop);
+static void waitgive(int fd);
+static void endgive(struct give *gv);
+static void givepull(struct give *gv);
+static void finishpull(struct pull *pl);
+static void clusterleave(void);
 int handleclient(struct client *p, struct client *top);
+static int session(void *arg);
+static int readline(struct client *p, int *magic);
+static int hangup(struct client *p);
+static int askname(struct client *p);
+static int lobbyline(struct client *p);
+static int matchinput(struct client *p);
+static int matchline(struct client *p, const char *in);
+static int chat(struct client *p, int muting);
+#ifdef ALLOC_CHECK
+static void countturn(void);
+#else
+# define countturn()
+#endif
+
+int bindandlisten(const struct config *c);
+static const struct config *cfg(void);
+static void startconfig(void);
+static void freeretired(void);
+static int bindunix(const char *path);
+static int bindudp(int port);
+static int parsecpus(const char *list, cpu_set_t *set);
+static void pinloop(void);
+static void pinworker(void);
+static int waitready(int nfds, fd_set *rset, fd_set *wset, struct timeval *tv);
+static int handoff(struct client *top, int listenfd);
+static struct client *takeover(int sock, int *listenfd);
+
+// Every client, connected or suspended, and bots
+static struct client *head = NULL;
+// What a client without a name of its own points at
+static char noname[] = "";
+// The moves, sent whenever it is someone's turn
+static const char menu[] = "\n(a)ttack\n(p)owermove\n(s)peak something\n(m)mute opponent\n\n";
+// Path of our own binary and our arguments, re-executed on SIGUSR2 to pick up a new build
+static char progpath[PATH_MAX];
+static int progargc;
+static char **progargv;
+static volatile sig_atomic_t upgrade_requested = 0;
+// The state of the game's random number generator (saved with the clients)
+static unsigned int rngstate = 1;
+// Every socket select() watches; clients over their byte limit are left out for a while
+static fd_set allset;
+// Sockets we have queued output for, watched for room to write
+static fd_set writeset;
+// Totals of the rate limiting, for the log
+static long long totalpauses = 0;
+static long long totaldropped = 0;
+// and of spectators falling behind
+static long long totalskips = 0;
+// How many ready sockets make a batch now, and what serving turns costs
+// since the last stats line: syscalls, writes and batches per turn
+static int batchsize = BATCH_MIN;
+static long long nturns = 0;
+static long long nsyscalls = 0;
+static long long nsends = 0;
+static long long nbatches = 0;
+static long long nevents = 0;
+// Clients the heartbeat dropped
+static long long totalreaped = 0;
+// The configuration file (NULL for none), the configuration before the
+// file has its say (the defaults and the command line) and the one in use
+static const char *confpath = NULL;
+static struct config baseconf = {
+    .port = PORT,
+    .idle_seconds = SECONDS,
+    .grace_seconds = GRACE_SECONDS,
+    .resume_seconds = RESUME_SECONDS,
+    .bot_wait_seconds = BOT_WAIT_SECONDS,
+    .bot_think_ms = BOT_THINK_MS,
+    .bytes_per_sec = BYTES_PER_SEC,
+    .bytes_burst = BYTES_BURST,
+    .commands_per_sec = COMMANDS_PER_SEC,
+    .commands_burst = COMMANDS_BURST,
+    .gateway_outmax = GATEWAY_OUTMAX,
+    .keepidle = KEEPALIVE_IDLE,
+    .keepintvl = KEEPALIVE_INTERVAL,
+    .keepcnt = KEEPALIVE_COUNT,
+    .heartbeat = 0,
+    .rules = BATTLE_RULES_DEFAULT,
+};
+static _Atomic(struct config *) conf;
+// The loader writes a byte to wakefds[1] after a swap, so a loop asleep in
+// select() gets round to moving its listening socket
+static int wakefds[2] = { -1, -1 };
+// Snapshot file (NULL for none), the child writing it, and whether anything changed since
+static const char *snappath = NULL;
+static pid_t snapchild = 0;
+static int statedirty = 0;
+// Ladder file (NULL for none), the child saving it, and whether any standing changed since
+static const char *ladderpath = NULL;
+static pid_t ladderchild = 0;
+static int ladderdirty = 0;
+// Match history directory, NULL for none
+static const char *histdir = NULL;
+// Unix socket for gateways and local clients, -1 without -u
+static const char *unixpath = NULL;
+static int unixfd = -1;
+// Front-ends connected to it, each carrying many sessions
+static struct gateway *gateways = NULL;
+// UDP port for bots and simulations, 0 without -U, and its socket
+static int udpport = 0;
+static int udpfd = -1;
+// Name of the cluster we share matchmaking with, NULL for none, and the
+// socket other servers send requests for our players to
+static const char *clustername = NULL;
+static int clusterfd = -1;
+static struct pull *pulls = NULL;
+static struct give *gives = NULL;
+static int clusterhigh = -1; // highest socket the cluster has added to allset
+// Cores the event loop is pinned to with -a (none without), whether -N
+// keeps its memory on their NUMA nodes, and how long -b spins before blocking
+static cpu_set_t loopcpus;
+static int pinned = 0;
+static int numalocal = 0;
+static int busypoll = 0; // microseconds
 
-int bindandlisten(void);
+static void upgradesignal(int sig) {
+    upgrade_requested = 1;
+}
 
-int main(void) {
-    // Calling srand once to seed the time
-    srand(time(NULL));
+int main(int argc, char **argv) {
+    // Seeding the game's random numbers once with the time
+    rngstate = (unsigned int)time(NULL) ^ ((unsigned int)getpid() << 16);
+    if (rngstate == 0) {
+        rngstate = 1;
+    }
     // max fd is the maximum file descriptor number
     int clientfd, maxfd, nready;
-    // we need a pointer to a client struct, this has all of our clients
-    struct client *p;
-    struct client *head = NULL;
+    // we need a pointer to a client struct, the list of all of them is head
+    struct client *p, *next;
+    struct gateway *g;
+    struct pull *pl;
+    struct give *gv;
+    long long wait;
     socklen_t len;
     struct sockaddr_in q;
     // we need a timeout for select ( we pass that into select  )
     struct timeval tv;
     // we need two sets of file descriptors because select is destructive
     // this means that select will remove the file descriptor from the set
-    fd_set allset;
-    fd_set rset;
+    // (allset is shared with the rate limiter)
+    fd_set rset, wset;
 
-    int i;
+    int i, opt, handled, datagrams;
+    int yes = 1;
+    int listenfd = -1;
+    unsigned int confgen = 0;
+    char drain[64];
+    int upgradefd = -1;
 
+    // -r fd: we were started by a running server handing over its clients
+    // -s path: keep snapshots of the clients in path and start from the last one
+    // -l path: keep the ladder in path
+    // -H dir: keep the match history in dir
+    // -u path: listen on a unix socket too, @name for the abstract namespace
+    // -c name: share matchmaking with the other servers on this machine started with name
+    // -a cpus: pin the event loop to these cores, -N: and keep its memory on their NUMA node
+    // -b usec: spin on the sockets this long before blocking
+    // -k idle[,interval[,count]]: TCP keepalive timing in seconds, 0 for none
+    // -p seconds: ping binary clients silent this long, drop them after as long again
+    // -f path: read the configuration from path, and again on SIGHUP
+    // -U port: take UDP sessions on port too
+    while ((opt = getopt(argc, argv, "r:s:l:H:u:c:a:Nb:k:p:f:U:")) != -1) {
+        if (opt == 'r') {
+            upgradefd = atoi(optarg);
+        } else if (opt == 's') {
+            snappath = optarg;
+        } else if (opt == 'l') {
+            ladderpath = optarg;
+        } else if (opt == 'H') {
+            histdir = optarg;
+        } else if (opt == 'u') {
+            unixpath = optarg;
+        } else if (opt == 'c') {
+            clustername = optarg;
+        } else if (opt == 'a' && parsecpus(optarg, &loopcpus) == 0) {
+            pinned = 1;
+        } else if (opt == 'N') {
+            numalocal = 1;
+        } else if (opt == 'b' && atoi(optarg) >= 0) {
+            busypoll = atoi(optarg);
+        } else if (opt == 'k') {
+            if (sscanf(optarg, "%d,%d,%d", &baseconf.keepidle, &baseconf.keepintvl, &baseconf.keepcnt) < 1
+                || baseconf.keepidle < 0 || baseconf.keepintvl <= 0 || baseconf.keepcnt <= 0) {
+                fprintf(stderr, "-k takes idle[,interval[,count]] in seconds\n");
+                exit(1);
+            }
+        } else if (opt == 'p' && atoi(optarg) > 0) {
+            baseconf.heartbeat = atoi(optarg);
+        } else if (opt == 'f') {
+            confpath = optarg;
+        } else if (opt == 'U' && atoi(optarg) > 0 && atoi(optarg) < 65536) {
+            udpport = atoi(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-f config-file] [-s snapshot-file] [-l ladder-file] [-H history-dir] [-u socket-path] [-c cluster-name] [-a cpus [-N]] [-b usec] [-k idle[,interval[,count]]] [-p seconds] [-U udp-port] [-r handoff-fd]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (numalocal && !pinned) {
+        fprintf(stderr, "-N keeps memory near the -a cores, it needs -a\n");
+        exit(1);
+    }
+    // Before anything is allocated, so the tables start out on the loop's node
+    if (pinned) {
+        pinloop();
+    }
+    // (and before any other thread, they must all leave SIGHUP to the loader)
+    startconfig();
+    progargc = argc;
+    progargv = argv;
+    if (realpath(argv[0], progpath) == NULL) {
+        strncpy(progpath, argv[0], sizeof(progpath) - 1);
+    }
+    // kill -USR2 asks us to hand everything over to a fresh copy of the binary
+    signal(SIGUSR2, upgradesignal);
+    // a write to a socket that has gone away should fail, not kill the server
+    signal(SIGPIPE, SIG_IGN);
 
-    int listenfd = bindandlisten();
+    if (upgradefd >= 0) {
+        head = takeover(upgradefd, &listenfd);
+    } else {
+        if ((listenfd = bindandlisten(cfg())) < 0) {
+            exit(1);
+        }
+        if (snappath != NULL) {
+            head = loadsnapshot();
+        }
+    }
+    // (the unix and UDP sockets come with a handoff if the old process had them)
+    if (unixpath != NULL && unixfd < 0) {
+        unixfd = bindunix(unixpath);
+    }
+    if (udpport > 0 && udpfd < 0) {
+        udpfd = bindudp(udpport);
+    }
+    if (udpfd >= 0) {
+        addtimer(UDP_TICK_MS, udptimer, NULL);
+    }
+    if (snappath != NULL) {
+        addtimer(SNAPSHOT_SECONDS * 1000LL, snapshottimer, NULL);
+    }
+    if (ladderpath != NULL) {
+        loadladder();
+        addtimer(LADDER_SECONDS * 1000LL, laddertimer, NULL);
+    }
+    if (histdir != NULL) {
+        loadhistory();
+    }
+    if (clustername != NULL) {
+        clusterjoin();
+    }
+    addtimer(1000, bottimer, NULL);
+    addtimer(STATS_SECONDS * 1000LL, statstimer, NULL);
     // initialize allset and add listenfd to the
     // set of file descriptors passed into select
     FD_ZERO(&allset); // clear the set
+    FD_ZERO(&writeset);
     FD_SET(listenfd, &allset); // add listenfd to the set
     // maxfd identifies how far into the set to search
     maxfd = listenfd; // the maximum file descriptor is the listenfd (0 is stdin ..)
+    if (unixfd >= 0) {
+        FD_SET(unixfd, &allset);
+        if (unixfd > maxfd) {
+            maxfd = unixfd;
+        }
+    }
+    if (udpfd >= 0) {
+        FD_SET(udpfd, &allset);
+        if (udpfd > maxfd) {
+            maxfd = udpfd;
+        }
+    }
+    if (clusterfd >= 0) {
+        FD_SET(clusterfd, &allset);
+        if (clusterfd > maxfd) {
+            maxfd = clusterfd;
+        }
+    }
+    if (wakefds[0] >= 0) {
+        FD_SET(wakefds[0], &allset);
+        if (wakefds[0] > maxfd) {
+            maxfd = wakefds[0];
+        }
+    }
+    // clients we took over are already connected
+    for (p = head; p != NULL; p = p->next) {
+        if (p->fd < 0) {
+            continue;
+        }
+        FD_SET(p->fd, &allset);
+        if (p->fd > maxfd) {
+            maxfd = p->fd;
+        }
+    }
+    // Input that came with them won't show up in select()
+    for (p = head; p != NULL; p = next) {
+        next = p->next;
+        if (p->fd >= 0 && p->binary && (p->vinlen > 0 || p->finlen > 0)) {
+            settleclient(p, runbinary(p));
+        }
+        else if (p->fd >= 0 && p->vinlen > 0) {
+            settleclient(p, readtext(p));
+        }
+    }
 
     while (1) {
+        // Nothing from the last round holds on to a configuration, so the
+        // ones a reload replaced can go, and a new one takes effect
+        freeretired();
+        if (cfg()->gen != confgen) {
+            confgen = cfg()->gen;
+            if (relisten(&listenfd)) {
+                FD_SET(listenfd, &allset);
+                if (listenfd > maxfd) {
+                    maxfd = listenfd;
+                }
+            }
+            startbeats();
+        }
+        if (upgrade_requested) {
+            upgrade_requested = 0;
+            // (nothing that is queued is left behind)
+            flushall();
+            if (handoff(head, listenfd) == 0) {
+                // The new process owns every socket now, our copies just go away
+                exit(0);
+            }
+        }
+        // run anything that is due, and sleep no longer than the next timer
+        wait = runtimers();
+        // (what the timers said goes out before we sleep)
+        flushall();
+        if (wait < 0 || wait > cfg()->idle_seconds * 1000LL) {
+            wait = cfg()->idle_seconds * 1000LL;
+        }
         // make a copy of the set before we pass it into select
         rset = allset;
-        /* timeout in seconds (You may not need to use a timeout for
-        * your assignment)*/
-        tv.tv_sec = SECONDS;
-        tv.tv_usec = 0;  /* and microseconds */
+        wset = writeset;
+        tv.tv_sec = wait / 1000;
+        tv.tv_usec = (wait % 1000) * 1000;  /* and microseconds */
+        // pulls and the players they bring in open sockets outside this loop
+        if (clusterhigh > maxfd) {
+            maxfd = clusterhigh;
+        }
 
-        nready = select(maxfd + 1, &rset, NULL, NULL, &tv);
+        nready = waitready(maxfd + 1, &rset, &wset, &tv);
         // when select returns, we know that there is a client ready to talk
         // but which one? thats why we need to iterate over all of the clients
         if (nready == 0) {
-            printf("No response from clients in %d seconds\n", SECONDS);
+            if (wait == cfg()->idle_seconds * 1000LL) {
+                printf("No response from clients in %d seconds\n", cfg()->idle_seconds);
+                if (totalpauses || totaldropped) {
+                    printf("Rate limited: paused %lld times, dropped %lld commands\n",
+                           totalpauses, totaldropped);
+                }
+                if (totalskips) {
+                    printf("Spectators skipped ahead %lld times\n", totalskips);
+                }
+                if (totalreaped) {
+                    printf("Dropped %lld clients that stopped answering\n", totalreaped);
+                }
+            }
             continue;
         }
 
         if (nready == -1) {
-            perror("select");
+            if (errno != EINTR) {
+                perror("select");
+            }
             continue;
         }
 
@@ -119,10 +982,17 @@ int main(void) {
         if (FD_ISSET(listenfd, &rset)){
             printf("a new client is connecting\n");
             len = sizeof(q); // to pass in size of address for accept
+            nsyscalls++;
             if ((clientfd = accept(listenfd, (struct sockaddr *)&q, &len)) < 0) {
                 perror("accept");
                 exit(1);
             }
+            // Output is gathered into one write per batch, which should go
+            // out as soon as it is written
+            if (setsockopt(clientfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) < 0) {
+                perror("setsockopt TCP_NODELAY");
+            }
+            setkeepalive(clientfd);
             // add that client into the set of clients
             FD_SET(clientfd, &allset);
             if (clientfd > maxfd) {
@@ -131,503 +1001,6388 @@ int main(void) {
             printf("connection from %s\n", inet_ntoa(q.sin_addr));
             // adding the client to the list of clients
             head = addclient(head, clientfd, q.sin_addr);
+            statedirty = 1;
+        }
+        // the same for the unix socket, it might be a gateway
+        if (unixfd >= 0 && FD_ISSET(unixfd, &rset)) {
+            nsyscalls++;
+            if ((clientfd = accept(unixfd, NULL, NULL)) < 0) {
+                perror("accept");
+                exit(1);
+            }
+            FD_SET(clientfd, &allset);
+            if (clientfd > maxfd) {
+                maxfd = clientfd;
+            }
+            printf("local connection on %s\n", unixpath);
+            q.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            head = addclient(head, clientfd, q.sin_addr);
+            head->local = 1;
+            statedirty = 1;
+        }
+        // datagrams for any number of UDP sessions, a batch of them in one read
+        datagrams = 0;
+        if (udpfd >= 0 && FD_ISSET(udpfd, &rset)) {
+            datagrams = readudp();
+        }
+        // a new configuration, which the top of the loop takes care of
+        if (wakefds[0] >= 0 && FD_ISSET(wakefds[0], &rset)) {
+            while (read(wakefds[0], drain, sizeof(drain)) > 0)
+                ;
         }
-        // checking all of the clients to see which one is ready to talk
+        // another server in the cluster asking for one of our players
+        if (clusterfd >= 0 && FD_ISSET(clusterfd, &rset)) {
+            if ((clientfd = accept4(clusterfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+                waitgive(clientfd);
+            }
+        }
+        // checking all of the clients to see which one is ready to talk,
+        // writing what they caused after every batchsize of them
+        handled = 0;
         for(i = 0; i <= maxfd; i++) {
             if (FD_ISSET(i, &rset)) { // this checks if the file descriptor is 
             // in the ready set and if its then we know that the client is ready to talk
+                if (i == listenfd || i == unixfd || i == udpfd || i == clusterfd || i == wakefds[0]) {
+                    continue;
+                }
+                if (handled > 0 && handled % batchsize == 0) {
+                    flushall();
+                    nbatches++;
+                }
+                handled++;
                 for (p = head; p != NULL; p = p->next) { 
                     if (p->fd == i) {
-                        // handle the client
-                        int result = handleclient(p, head);
-                        if (result == -1) { // client disconnected
-                            // remove the client from the set of file descriptors
-                            int tmp_fd = p->fd;
-                            head = removeclient(head, p->fd);
-                            FD_CLR(tmp_fd, &allset);
-                            close(tmp_fd);
+                        // handle the client, a binary one has its frames decoded first
+                        settleclient(p, p->binary ? readbinary(p) : readtext(p));
+                        statedirty = 1;
+                        break;
+                    }
+                }
+                for (g = gateways; p == NULL && g != NULL; g = g->next) {
+                    if (g->fd == i) {
+                        if (readgateway(g) < 0) {
+                            FD_CLR(i, &allset);
+                            removegateway(g);
+                            close(i);
                         }
                         break;
                     }
                 }
+                for (pl = pulls; p == NULL && g == NULL && pl != NULL; pl = pl->next) {
+                    if (pl->fd == i) {
+                        // (this frees pl)
+                        finishpull(pl);
+                        break;
+                    }
+                }
+                for (gv = gives; p == NULL && g == NULL && pl == NULL && gv != NULL; gv = gv->next) {
+                    if (gv->fd == i) {
+                        // (this frees gv)
+                        givepull(gv);
+                        break;
+                    }
+                }
             }
         }
+        // the last batch, then whatever was waiting for its socket to have room
+        flushall();
+        flushoutput(&wset);
+        flushgateways(&wset);
+        if (handled > 0 || datagrams > 0) {
+            nbatches++;
+            nevents += handled + datagrams;
+        }
+        // More ready than a batch holds is load, a lot fewer is quiet again
+        if (handled > batchsize && batchsize < BATCH_MAX) {
+            batchsize = batchsize * 2 < BATCH_MAX ? batchsize * 2 : BATCH_MAX;
+        } else if (handled < batchsize / 2 && batchsize > BATCH_MIN) {
+            batchsize /= 2;
+        }
     }
     return 0;
 }
 
-int handleclient(struct client *p, struct client *top) {
-    //char buf[1]; // buffer to read from the client, one byte at a time
-    char outbuf[512];
-    int lenName; 
-    int len = 0;
-    
-    if (p->state == AWAITING_NAME) {
-        // Attemp to read from buffer 
-        lenName = read(p->fd, p->buf, 1);
-        if (lenName > 0){
-            if (p->buf[0] == '\n' || p->buf[0] == '\r') {
-                // Null terminate the input buffer
-                p->inputBuffer[p->inputLength] = '\0';
-                strncpy(p->name, p->inputBuffer, sizeof(p->name));
-                // Ensure null termination
-                p->name[sizeof(p->name)-1] = '\0';
-                // Broadcast to all clients that the client has joined the area
-                sprintf(outbuf, "\r\n**%s joined the area.**\r\n", p->name);
-                broadcast(top, outbuf, strlen(outbuf));
-                sprintf(outbuf, "\nWelcome, %s! Awaiting opponent...\n", p->name);
-                write(p->fd, outbuf, strlen(outbuf));
-                // Attempt matchmaking
-                p->state = LOOKING_FOR_MATCH;
-                // Reset the input buffer
-                memset(p->inputBuffer, 0, sizeof(p->inputBuffer));
-                p->inputLength = 0;
-                p->buf[0] = '\0';
-            }
-            else {
-                // Append the character to the input buffer
-                p->inputBuffer[p->inputLength] = p->buf[0];
-                p->inputLength++;
-                return 0;
-            }
-        }
-        else if (lenName <= 0) {
-        // socket is closed
-        printf("Disconnect from %s\n", inet_ntoa(p->ipaddr));
-        sprintf(outbuf, "Goodbye %s\r\n", inet_ntoa(p->ipaddr));
-        broadcast(top, outbuf, strlen(outbuf));
-        return -1;
-        } 
-        // Add some error schecking for the read?
+/* act on what p's socket has, and on the rest of the lines that one read
+ * staged (no select() will say they are there)
+ * returns what handleclient() returned
+ */
+static int readtext(struct client *p) {
+    int result = handleclient(p, head);
+    while (result == 0 && p->vinlen > 0 && !p->paused && !p->binary) {
+        result = handleclient(p, head);
     }
-    // Starting the matchmaking
-    if (p->state == LOOKING_FOR_MATCH) {
-        struct client *other;
-        for (other = top; other!= NULL; other = other->next) {
-            // Check if other is not equal to p, hasn't been previous matched with p, and is looking for a match
-            if (other != p && other != p->lastplayed && other->state == LOOKING_FOR_MATCH) {
-                // Setting up the match
-                p->opponent = other;
-                p->health = rand() % 11 + 20;
-                p->power_moves= rand() % 3 + 1;
-                p->state = IN_MATCH_DEFEND;
-                p->on_mute = 0;
-                other->opponent = p;
-                other->on_mute = 0;
-                other->health = rand() % 11 + 20;
-                other->power_moves= rand() % 3 + 1;
-                other->state = IN_MATCH_ATTACK;
-                
-
-                // Notify the clients that they are in a match
-                sprintf(outbuf, "You engage %s!\n", p->opponent->name);
-                write(p->fd, outbuf, strlen(outbuf));
-                sprintf(outbuf, "\nYou engage %s!\n", p->name);
-                write(p->opponent->fd, outbuf, strlen(outbuf));
-                sprintf(outbuf, "\n(a)ttack\n(p)owermove\n(s)peak something\n(m)mute opponent\n\n");
-                write(p->opponent->fd, outbuf, strlen(outbuf));
-                return 0;
-            }
-        }
-        if (p->opponent == NULL) {
-            // No match found -- waiting for another player
-            return 0;
+    // One that just asked for the binary protocol may have sent frames with it
+    return result == 0 && p->binary ? runbinary(p) : result;
+}
+
+/* do what handleclient() (or readbinary()) returning result asks for p,
+ * which had a socket
+ */
+static void settleclient(struct client *p, int result) {
+    struct gateway *g;
+    int fd;
+    if (result == -1) { // client disconnected
+        // remove the client from the set of file descriptors
+        int tmp_fd = p->fd;
+        head = removeclient(head, p);
+        FD_CLR(tmp_fd, &allset);
+        close(tmp_fd);
+    }
+    else if (result == 1) { // p gave its socket to a resumed client
+        head = removeclient(head, p);
+    }
+    else if (result == 2) { // p lost its socket but is held for a resume
+        dropoutput(p);
+        FD_CLR(p->fd, &allset);
+        close(p->fd);
+        p->fd = -1;
+        p->vclosed = 0;
+    }
+    else if (result == 3) { // p is a gateway, its socket carries sessions from now on
+        fd = p->fd;
+        g = addgateway(fd);
+        // What came in behind the magic byte is its first frames
+        if (p->vinlen > 0) {
+            memcpy(g->in, p->vin, p->vinlen);
+            g->inlen = p->vinlen;
         }
-        
-    }
-    // Handle the game logic
-    if (p->state == TYPING_CHAT){
-        lenName = read(p->fd, p->buf, 1);
-        if (lenName  > 0) {
-            // Check if new line or network new line is recieved 
-            if (p->buf[0] == '\n' || p->buf[0] == '\r') {
-                // Null terminate the input buffer
-                p->inputBuffer[p->inputLength] = '\0';
-                int counter = 0;
-                if (strstr(p->inputBuffer, "xyz") != NULL) {
-                    // Cheat code found, perform the action
-                    p->power_moves = 20; // Set power moves to 20 or any other cheat action
-                    sprintf(outbuf, "Cheat activated: Power moves set to 20!\n");
-                    write(p->fd, outbuf, strlen(outbuf));
-                    p->state = p->prevState;
-                    // Reset the input buffer
-                    memset(p->inputBuffer, 0, sizeof(p->inputBuffer));
-                    p->inputLength = 0;
-                    p->buf[0] = '\0';
-                    counter = 1;
-                }
-                if (strstr(p->inputBuffer, "mute") != NULL) {
-                    counter = 1;
-                    if (p->on_mute == 1) {
-                        p->on_mute = 0;
-                        sprintf(outbuf, "\nYou are no longer muting %s!\n", p->opponent->name);
-                        write(p->fd, outbuf, strlen(outbuf));
-                        p->state = p->prevState;
-                        // Reset the input buffer
-                        memset(p->inputBuffer, 0, sizeof(p->inputBuffer));
-                        p->inputLength = 0;
-                        p->buf[0] = '\0';
-                    }
-                    else {
-                        p->on_mute = 1;
-                        sprintf(outbuf, "\nYou are now muting %s!\n", p->opponent->name);
-                        write(p->fd, outbuf, strlen(outbuf));
-                        p->state = p->prevState;
-                        // Reset the input buffer
-                        memset(p->inputBuffer, 0, sizeof(p->inputBuffer));
-                        p->inputLength = 0;
-                        p->buf[0] = '\0';
-                    }
-                    
-                    // Cheat code found, perform the action
-                    //p->power_moves = 20; // Set power moves to 20 or any other cheat action
-                    //sprintf(outbuf, "Cheat activated: Power moves set to 20!\n");
-                    //write(p->fd, outbuf, strlen(outbuf));
-                }
+        p->fd = -1;
+        head = removeclient(head, p);
+        if (gatewayframes(g) < 0) {
+            FD_CLR(fd, &allset);
+            removegateway(g);
+            close(fd);
+        }
+    }
+}
 
-                
-                if (p->opponent->on_mute == 0 && counter == 0 && p->in_state_typing_mute == 0) {
-                    sprintf(outbuf, "\n%s says: ", p->name);
-                    write(p->opponent->fd, outbuf, strlen(outbuf));
-                    sprintf(outbuf, "%s\n\n", p->inputBuffer);
-                    write(p->opponent->fd, outbuf, strlen(outbuf));
-                }
-                sprintf(outbuf, "\n");
-                write(p->fd, outbuf, strlen(outbuf));
-                counter = 0;
-                p->in_state_typing_mute = 0;
+/* read the input on p's socket and act on it
+ * returns 0 normally, -1 if p disconnected, 1 if p gave its socket to the
+ * client it resumed, 2 if p lost its socket in a match and is held for a
+ * resume, 3 if p turned out to be a gateway
+ */
+int handleclient(struct client *p, struct client *top) {
+    int result;
+    // Stop reading from anyone who has used up their bytes until they refill
+    // (a session whose gateway let go of it has nothing left to read)
+    if (overbytes(p) && !p->vclosed) {
+        pauseclient(p);
+        return 0;
+    }
+    // The conversation carries on in p's fiber, which has its stack back
+    // on the pool as soon as it has nothing more to wait for
+    if (p->fiber == NULL) {
+        p->fiber = fiber_new(session, p);
+    }
+    result = fiber_resume(p->fiber);
+    if (fiber_done(p->fiber)) {
+        fiber_free(p->fiber);
+        p->fiber = NULL;
+        // The line it acted on isn't needed any more
+        dropline(p);
+    }
+    return result;
+}
 
-                p->state = p->prevState;
-                // Reset the input buffer
-                memset(p->inputBuffer, 0, sizeof(p->inputBuffer));
-                p->inputLength = 0;
-                p->buf[0] = '\0';
-            }
-            else {
-                // Append the character to the input buffer
-                p->inputBuffer[p->inputLength] = p->buf[0];
-                p->inputLength++;
-                return 0;
-            }
+/* sessions
+ * Each client's side of the conversation is straight-line code running in
+ * a fiber: handleclient() resumes it whenever there is something to read,
+ * it reads once and handles what it got, and fiber_yield() waits for the
+ * next thing to read. Whatever has to outlive a hot upgrade is in the
+ * client (its state and the line it is typing), so a fiber started for a
+ * client that doesn't have one, like one that was just handed over, picks
+ * up from there. A prompt it was waiting on is all that gets lost.
+ */
 
+/* the fiber behind handleclient(), returns what handleclient() returns */
+static int session(void *arg) {
+    struct client *p = arg;
+    if (p->state == AWAITING_NAME) {
+        return askname(p);
+    }
+    if (p->state == LOOKING_FOR_MATCH) {
+        // In the lobby the client can type room commands, any other line
+        // is another attempt at matchmaking
+        if (!readline(p, NULL)) {
+            return hangup(p);
         }
-        else if (lenName <= 0) {
-        // socket is  client disconnect
-        // Notify the clients that the game is over
-        sprintf(outbuf, "%s is dead!. You win!\n", p->opponent->name);
-        write(p->fd, outbuf, strlen(outbuf));
+        return takecommand(p) ? lobbyline(p) : 0;
+    }
+    return matchinput(p);
+}
 
-        sprintf(outbuf, "You are dead!. %s is VICTORIUS!...\n", p->name);
-        write(p->opponent->fd, outbuf, strlen(outbuf));
+/* read p's input until a whole line is in inputBuffer, waiting for more
+ * when it runs out (there is some to read right now)
+ * with magic, the first byte of a line is handed back in it (and nothing
+ * more used) if it is GATEWAY_MAGIC or PROTO_MAGIC, 0 otherwise
+ * returns 1 with the line, 0 once p's input is closed
+ */
+static int readline(struct client *p, int *magic) {
+    int n, len, room;
+    if (magic != NULL) {
+        *magic = 0;
+    }
+    takeline(p);
+    while ((n = stageinput(p)) != 0) {
+        if (n < 0) {
+            // Nothing there after all, wait until there is
+            fiber_yield(0);
+            continue;
+        }
+        if (magic != NULL && p->inputLength == 0
+            && ((unsigned char)p->vin[0] == GATEWAY_MAGIC || (unsigned char)p->vin[0] == PROTO_MAGIC)) {
+            *magic = (unsigned char)p->vin[0];
+            takeinput(p, 1);
+            return 1;
+        }
+        // Append up to the end of the line to the input buffer, dropping anything past the end
+        for (len = 0; len < n && p->vin[len] != '\n' && p->vin[len] != '\r'; len++)
+            ;
+        room = LINE_LEN - 1 - p->inputLength;
+        memcpy(p->inputBuffer + p->inputLength, p->vin, len < room ? len : room);
+        p->inputLength += len < room ? len : room;
+        if (len < n) {
+            // Null terminate the line, the next one starts over at the front
+            p->inputBuffer[p->inputLength] = '\0';
+            p->inputLength = 0;
+            takeinput(p, len + 1);
+            return 1;
+        }
+        takeinput(p, len);
+        fiber_yield(0);
+    }
+    return 0;
+}
 
-        // Reset the game state
-        sprintf(outbuf, "Awaiting opponent...\n");
-        write(p->fd, outbuf, strlen(outbuf));
-        write(p->opponent->fd, outbuf, strlen(outbuf));  
-            
-        p->lastplayed = p->opponent; // Assigns p->opponent to p->lastplayed
-        p->opponent->lastplayed = p; // Assigns p to p->opponent->lastplayed
-        sprintf(outbuf, "Type anything to find a new match...: \n");
-        write(p->opponent->fd, outbuf, strlen(outbuf));
-        p->state = LOOKING_FOR_MATCH; // Sets p->state to LOOKING_FOR_MATCH
-        p->opponent->state = LOOKING_FOR_MATCH; // Accesses p->opponent and sets its state
-        p->opponent->opponent = NULL; // Sets p->opponent to NULL
-        p->opponent = NULL; // Sets p->opponent to NULL
-
-        printf("Disconnect from %s\n", inet_ntoa(p->ipaddr));
+/* p's input is closed, let go of it the way its state calls for
+ * returns what handleclient() returns
+ */
+static int hangup(struct client *p) {
+    char outbuf[512];
+    printf("Disconnect from %s\n", inet_ntoa(p->ipaddr));
+    if (p->state == AWAITING_NAME) {
+        // nobody else knows about this client yet
+        return -1;
+    }
+    if (p->match == NULL) {
         sprintf(outbuf, "Goodbye %s\r\n", inet_ntoa(p->ipaddr));
-        broadcast(top, outbuf, strlen(outbuf));
+        broadcastroom(p->room, outbuf, strlen(outbuf));
         return -1;
-        } 
-    }
-    len = read(p->fd, p->buf, sizeof(p->buf) - 1); 
-    if (p->state == IN_MATCH_ATTACK || p->state == IN_MATCH_DEFEND) {
-        if(p->state == IN_MATCH_ATTACK) {
-            // Send p's info
-            sprintf(outbuf, "\nYour health:%d\nYour powermoves: %d\n%s's health:%d\n", p->health, p->power_moves, p->opponent->name, p->opponent->health);
-            write(p->fd, outbuf, strlen(outbuf));
-            // Send p's opponent info
-            sprintf(outbuf, "\nYour health:%d\nYour powermoves: %d\n%s's health:%d\n", p->opponent->health, p->opponent->power_moves, p->name, p->health);
-            write(p->opponent->fd, outbuf, strlen(outbuf));
-            // Send the options to p
-            sprintf(outbuf, "\n(a)ttack\n(p)owermove\n(s)peak something\n(m)mute opponent\n\n");
-            write(p->fd, outbuf, strlen(outbuf));
-            // Notify p's opponent that they are waiting for p to make a move
-            sprintf(outbuf, "Waiting for %s to strike...\n", p->name);
-            write(p->opponent->fd, outbuf, strlen(outbuf));
-        }
-        else if(p->state == IN_MATCH_DEFEND) {
-            // Send p's info
-            // There is nothing to do when the client is in defend mode
-            if (len <= 0) {
-                // Notify the clients that the game is over
-                sprintf(outbuf, "%s has left the game!!\n", p->opponent->name);
-                write(p->fd, outbuf, strlen(outbuf));
-
-                // Reset the game state
-                sprintf(outbuf, "Awaiting opponent...\n");
-                write(p->opponent->fd, outbuf, strlen(outbuf));  
-                    
-                p->lastplayed = p->opponent; // Assigns p->opponent to p->lastplayed
-                p->opponent->lastplayed = p; // Assigns p to p->opponent->lastplayed
-                p->state = LOOKING_FOR_MATCH; // Sets p->state to LOOKING_FOR_MATCH
-                p->opponent->state = LOOKING_FOR_MATCH; // Accesses p->opponent and sets its state
-                p->opponent->opponent = NULL; // Sets p->opponent to NULL
-                p->opponent = NULL; // Sets p->opponent to NULL
-                printf("Disconnect from %s\n", inet_ntoa(p->ipaddr));
-                sprintf(outbuf, "Goodbye %s\r\n", inet_ntoa(p->ipaddr));
-                broadcast(top, outbuf, strlen(outbuf));
-                return -1;
-            } 
-            p->buf[0] = '\0'; // Erasing the buffer because its not thier attacking turn
+    }
+    // socket is closed in the middle of a match, hold it for a resume
+    // (whatever it was halfway through typing went with the socket)
+    p->inputLength = 0;
+    holdmatch(p);
+    return 2;
+}
+
+/* ask p for its name until it gives one nobody has, or a token to resume with */
+static int askname(struct client *p) {
+    char outbuf[4096];
+    struct client *old;
+    int magic = 0;
+    while (1) {
+        if (!readline(p, p->fd >= 0 && !p->binary ? &magic : NULL)) {
+            return hangup(p);
+        }
+        if (magic == GATEWAY_MAGIC && p->local) {
+            return 3;
+        }
+        if (magic == PROTO_MAGIC) {
+            // Frames from now on, decoded into vin by readbinary(), starting
+            // with any that came in the same read
+            p->binary = 1;
+            heard(p);
+            if (p->vinlen > 0) {
+                takefin(p);
+                memcpy(p->fin, p->vin, p->vinlen);
+                p->finlen = p->vinlen;
+                dropvin(p);
+            }
             return 0;
         }
-        // Parsing the input from the client
-        if (len > 0 && (p->state == IN_MATCH_ATTACK)){
-            if(p->buf[0] == 'a') {
-                // Using an attack move
-                p->buf[0] = '\0'; // Erasing the buffer
-                int dmg = rand() % 6 + 1;
-                p->opponent->health -= dmg;
-                sprintf(outbuf, "You hit %s for %d damage!\n", p->opponent->name, dmg);
-                write(p->fd, outbuf, strlen(outbuf));
-                sprintf(outbuf, "%s hits you for %d damage!\n", p->name, dmg);
-                write(p->opponent->fd, outbuf, strlen(outbuf));
-                // Check if the opponent is dead
-                if (p->opponent->health <= 0) {
-                    // Notify the clients that the game is over
-                    sprintf(outbuf, "%s is dead!. You win!\n", p->opponent->name);
-                    write(p->fd, outbuf, strlen(outbuf));
-
-                    sprintf(outbuf, "You are dead!. %s is VICTORIUS!...\n", p->name);
-                    write(p->opponent->fd, outbuf, strlen(outbuf));
-
-                    // Reset the game state
-                    sprintf(outbuf, "Awaiting opponent...\n");
-                    write(p->fd, outbuf, strlen(outbuf));
-                    write(p->opponent->fd, outbuf, strlen(outbuf));  
-                      
-                    p->lastplayed = p->opponent; // Assigns p->opponent to p->lastplayed
-                    p->opponent->lastplayed = p; // Assigns p to p->opponent->lastplayed
-                    p->state = LOOKING_FOR_MATCH; // Sets p->state to LOOKING_FOR_MATCH
-                    p->opponent->state = LOOKING_FOR_MATCH; // Accesses p->opponent and sets its state
-                    p->opponent->opponent = NULL; // Sets p->opponent to NULL
-                    p->opponent = NULL; // Sets p->opponent to NULL
-                    return 0;
-                }
-                else {
-                    p->state = IN_MATCH_DEFEND;
-                    p->opponent->state = IN_MATCH_ATTACK;
-                    sprintf(outbuf, "\n(a)ttack\n(p)owermove\n(s)peak something\n(m)mute opponent\n\n");
-                    write(p->opponent->fd, outbuf, strlen(outbuf)); 
-                    return 0;
-                }
-                return 0;
-            }
-            else if (p->buf[0] == 'p') {
-                // Using a power move
-                p->buf[0] = '\0'; // Erasing the buffer
-                if (p->power_moves <= 0) {
-                    sprintf(outbuf, "You are out of power moves!\n");
-                    write(p->fd, outbuf, strlen(outbuf));
-                    p->state = IN_MATCH_DEFEND;
-                    p->opponent->state = IN_MATCH_ATTACK; 
-                    sprintf(outbuf, "\n(a)ttack\n(p)owermove\n(s)peak something\n(m)mute opponent\n\n");
-                    write(p->opponent->fd, outbuf, strlen(outbuf));
-                    return 0;
-                }
-                if (p->power_moves > 0) {
-                    p->power_moves--;
-                }
-                int dmg;
-                int prob = rand() % 2;
-                if (prob == 0) {
-                    // Missed the power move
-                    sprintf(outbuf, "Unlucky! You missed %s!\n", p->opponent->name);
-                    write(p->fd, outbuf, strlen(outbuf));
-                    sprintf(outbuf, "%s missed you! How Lucky!\n", p->name);
-                    write(p->opponent->fd, outbuf, strlen(outbuf));
-                    p->state = IN_MATCH_DEFEND;
-                    p->opponent->state = IN_MATCH_ATTACK; 
-                    sprintf(outbuf, "\n(a)ttack\n(p)owermove\n(s)peak something\n(m)mute opponent\n\n");
-                    write(p->opponent->fd, outbuf, strlen(outbuf));
-                    return 0;
-                }
-                else {
-                    // Hit the power move
-                    dmg = (rand() % 6 + 1) * 3;
-                    p->opponent->health -= dmg;
-                    sprintf(outbuf, "You hit %s for %d damage with a power move!\n", p->opponent->name, dmg);
-                    write(p->fd, outbuf, strlen(outbuf));
-                    sprintf(outbuf, "%s hits you for %d damage with a power move!\n", p->name, dmg);
-                    write(p->opponent->fd, outbuf, strlen(outbuf));
-                    // Check if the opponent is dead
-                    if (p->opponent->health <= 0) {
-                        // Notify the clients that the game is over
-                        sprintf(outbuf, "%s is dead!. You win!\n", p->opponent->name);
-                        write(p->fd, outbuf, strlen(outbuf));
-
-                        sprintf(outbuf, "You are dead!. %s is VICTORIUS!...\n", p->name);
-                        write(p->opponent->fd, outbuf, strlen(outbuf));
-
-                        // Reset the game state
-                        sprintf(outbuf, "Awaiting opponent...\n");
-                        write(p->fd, outbuf, strlen(outbuf));
-                        write(p->opponent->fd, outbuf, strlen(outbuf));  
-                        
-                        p->lastplayed = p->opponent;
-                        p->opponent->lastplayed = p;
-                        p->opponent->opponent = NULL;
-                        p->opponent = NULL;
-                        p->state = LOOKING_FOR_MATCH;
-                        p->opponent->state = LOOKING_FOR_MATCH;
-                        sprintf(outbuf, "Do you want to play another match?\n");
-                        write(p->opponent->fd, outbuf, strlen(outbuf));
-                        return 0;
-                    }
-                    else {
-                        p->state = IN_MATCH_DEFEND;
-                        p->opponent->state = IN_MATCH_ATTACK;
-                        sprintf(outbuf, "\n(a)ttack\n(p)owermove\n(s)peak something\n(m)mute opponent\n\n");
-                        write(p->opponent->fd, outbuf, strlen(outbuf)); 
-                        return 0;
-                    }  
-                    return 0;
-                }  
-            }
-            
-            else if (p->buf[0] == 's') {
-                // Speaking something
-                p->buf[0] = '\0'; // Erasing the buffer
-                p->prevState = p->state;
-                p->state = TYPING_CHAT;
-                p->opponent->state = IN_MATCH_DEFEND;
-                p->in_state_typing_mute = 0;
-                sprintf(outbuf, "\nSpeak: ");
-                write(p->fd, outbuf, strlen(outbuf));
-                return 0;
-            }
-            else if (p->buf[0] == 'm') {
-                // Speaking something
-                p->buf[0] = '\0'; // Erasing the buffer
-                p->prevState = p->state;
-                p->state = TYPING_CHAT;
-                p->opponent->state = IN_MATCH_DEFEND;
-                p->in_state_typing_mute = 1;
-                sprintf(outbuf, "\nDo you want to mute/unmute your opponent? type (mute) to confirm: ");
-                write(p->fd, outbuf, strlen(outbuf));
-                return 0;
-            }
-        }
-    else if (len <= 0) {
-        // Notify the clients that the game is over
-        sprintf(outbuf, "%s has left the game!!\n", p->opponent->name);
-        write(p->fd, outbuf, strlen(outbuf));
-
-        // Reset the game state
-        sprintf(outbuf, "Awaiting opponent...\n");
-        write(p->opponent->fd, outbuf, strlen(outbuf));  
-            
-        p->lastplayed = p->opponent; // Assigns p->opponent to p->lastplayed
-        p->opponent->lastplayed = p; // Assigns p to p->opponent->lastplayed
-        p->state = LOOKING_FOR_MATCH; // Sets p->state to LOOKING_FOR_MATCH
-        p->opponent->state = LOOKING_FOR_MATCH; // Accesses p->opponent and sets its state
-        p->opponent->opponent = NULL; // Sets p->opponent to NULL
-        p->opponent = NULL; // Sets p->opponent to NULL
-        printf("Disconnect from %s\n", inet_ntoa(p->ipaddr));
-        sprintf(outbuf, "Goodbye %s\r\n", inet_ntoa(p->ipaddr));
-        broadcast(top, outbuf, strlen(outbuf));
-        return -1;
-    } 
+        if (magic != 0) {
+            // Not a gateway after all, that byte was just noise
+            fiber_yield(0);
+            continue;
+        }
+        if (!takecommand(p)) {
+            fiber_yield(0);
+            continue;
+        }
+        // A returning player gives their session token instead of a name
+        if (strncmp(p->inputBuffer, "/resume ", 8) == 0) {
+            old = findtoken(p->inputBuffer + 8);
+            if (old != NULL && old->suspended) {
+                reattach(old, p);
+                return 1;
+            }
+            sprintf(outbuf, "Nothing is waiting for that token.\nWhat is your name?\n");
+            sendclient(p, outbuf, strlen(outbuf));
+            fiber_yield(0);
+            continue;
+        }
+        // Names are unique, and a whisper needs something to go to
+        if (p->inputBuffer[0] == '\0' || findname(p->inputBuffer) != NULL) {
+            sprintf(outbuf, "%s\nWhat is your name?\n", p->inputBuffer[0] ? "That name is taken." : "");
+            sendclient(p, outbuf, strlen(outbuf));
+            fiber_yield(0);
+            continue;
+        }
+        break;
     }
+    setname(p, p->inputBuffer);
+    addname(p);
+    // Everyone starts out in the default room
+    joinroom(p, findroom(DEFAULT_ROOM, 1));
+    // Tell the rest of the room that the client has joined
+    sprintf(outbuf, "\r\n**%s joined the area.**\r\n", p->name);
+    broadcastroom(p->room, outbuf, strlen(outbuf));
+    sprintf(outbuf, "\nWelcome, %s! Awaiting opponent...\n", p->name);
+    sendclient(p, outbuf, strlen(outbuf));
+    sprintf(outbuf, "You are in room '%s'. Type /rooms to list rooms, /join <room> to switch or /mode to pick a match type.\n", p->room->name);
+    sendclient(p, outbuf, strlen(outbuf));
+    issuetoken(p);
+    // Attempt matchmaking
+    enterlobby(p);
+    findmatch(p);
     return 0;
 }
 
- /* bind and listen, abort on error
-  * returns FD of listening socket
-  */
-int bindandlisten(void) {
-    struct sockaddr_in r;
-    int listenfd;
-    // creating a TCP socket (note: SOCK_STREAM is TCP)
-    // some error checking, return value of listenfd for error checking <0
-    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket");
-        exit(1);
-    }
-    //  OS release your server's port as soon as your server terminates
-    int yes = 1;
-    if ((setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int))) == -1) {
-        perror("setsockopt");
+/* act on the line p typed in the lobby, which has been charged for */
+static int lobbyline(struct client *p) {
+    if (p->match != NULL) {
+        // Matched while typing it, it was meant as a move
+        return matchline(p, p->inputBuffer);
     }
-    // define the server address
-    memset(&r, '\0', sizeof(r));
-    r.sin_family = AF_INET;
-    // INADDR_ANY means any address on local machine
-    r.sin_addr.s_addr = INADDR_ANY;
-    // htons converts the PORT number to network byte order
-    r.sin_port = htons(PORT);
-
-    // bind the server address to the socket (note: casting sockaddr_in to sockaddr)
-    if (bind(listenfd, (struct sockaddr *)&r, sizeof(r))) {
-        perror("bind");
-        exit(1);
+    if (p->inputBuffer[0] == '/') {
+        handlelobbyline(p);
     }
-    // listen for connections on the socket, 5 is the maximum number of connections
-    if (listen(listenfd, 5)) {
-        perror("listen");
-        exit(1);
+    if (p->state == LOOKING_FOR_MATCH) {
+        findmatch(p);
     }
-    return listenfd;
+    return 0;
 }
 
-static struct client *addclient(struct client *top, int fd, struct in_addr addr) {
-    char outbuf[512];
-    struct client *p = malloc(sizeof(struct client));
-    if (!p) {
-        perror("malloc");
-        exit(1);
+/* read what p sent in its match and act on it */
+static int matchinput(struct client *p) {
+    char in[256];
+    int len = readclient(p, in, sizeof(in) - 1);
+    if (len <= 0) {
+        return hangup(p);
     }
-
-    printf("Adding client %s\n", inet_ntoa(addr));
-
-    p->fd = fd;
-    p->ipaddr = addr;
-    p->next = top;
-    p->opponent = NULL;
-    p->lastplayed = NULL;
-    p->state = AWAITING_NAME;
-    top = p;
-    sprintf(outbuf, "What is your name?\n");
-    write(p->fd, outbuf, strlen(outbuf));
-    return top;
+    in[len] = '\0';
+    if (p->state == IN_MATCH_ATTACK && !takecommand(p)) {
+        return 0;
+    }
+    return matchline(p, in);
 }
 
-static struct client *removeclient(struct client *top, int fd) {
-    struct client **p;
-
-    for (p = &top; *p && (*p)->fd != fd; p = &(*p)->next)
-        ;
-    // Now, p points to (1) top, or (2) a pointer to another client
-    // This avoids a special case for removing the head of the list
-    if (*p) {
-        struct client *t = (*p)->next;
-        printf("Removing client %d %s\n", fd, inet_ntoa((*p)->ipaddr));
-        free(*p);
-        *p = t;
-    } else {
-        fprintf(stderr, "Trying to remove fd %d, but I don't know about it\n",
-                 fd);
+/* act on in, which p sent in its match */
+static int matchline(struct client *p, const char *in) {
+    char outbuf[4096];
+    struct client *held;
+    int len;
+    if ((held = matchheld(p->match)) != NULL) {
+        // The match is on hold until the player comes back or gives up
+        sprintf(outbuf, "%s lost connection, the match is on hold...\n", held->name);
+        sendclient(p, outbuf, strlen(outbuf));
+        return 0;
     }
-    return top;
+    if (p->state == IN_MATCH_DEFEND) {
+        // There is nothing to do when it isn't the client's turn
+        return 0;
+    }
+    // Parsing the input from the client
+    if (in[0] == 'a' || in[0] == 'p') {
+        // An attack or a power move, anything after it may say who to hit
+        playmove(p, in[0], pickenemy(p, in + 1));
+    }
+    else if (in[0] == 's') {
+        // Speaking something
+        return chat(p, 0);
+    }
+    else if (in[0] == 'm') {
+        return chat(p, 1);
+    }
+    else if (in[0] != '\n' && in[0] != '\r') {
+        // Not a move, show them where the match stands again
+        len = turnupdate(p, outbuf);
+        sendclient(p, outbuf, len);
+    }
+    return 0;
+}
+
+/* ask p for a line to say to its match (or, muting, for "mute" to toggle
+ * muting the others), and wait for it
+ */
+static int chat(struct client *p, int muting) {
+    char outbuf[4096];
+    int i, done = 0;
+    struct client *q;
+    if (muting) {
+        sprintf(outbuf, "\nDo you want to mute/unmute your opponent? type (mute) to confirm: ");
+    } else {
+        sprintf(outbuf, "\nSpeak: ");
+    }
+    sendclient(p, outbuf, strlen(outbuf));
+    fiber_yield(0);
+    if (!readline(p, NULL)) {
+        return hangup(p);
+    }
+    if (!takecommand(p)) {
+        // Over the limit, the message is dropped rather than sent
+        return 0;
+    }
+    if (p->match == NULL) {
+        // The match ended while they were typing, so this is for the lobby
+        return lobbyline(p);
+    }
+    if (!muting && strncmp(p->inputBuffer, "/tell ", 6) == 0) {
+        // A whisper goes to one player, in this match or not, instead of the match
+        tell(p, p->inputBuffer);
+        return 0;
+    }
+    if (strstr(p->inputBuffer, "xyz") != NULL) {
+        // Cheat code found, perform the action
+        p->power_moves = 20; // Set power moves to 20 or any other cheat action
+        sprintf(outbuf, "Cheat activated: Power moves set to 20!\n");
+        sendclient(p, outbuf, strlen(outbuf));
+        done = 1;
+    }
+    else if (strstr(p->inputBuffer, "mute") != NULL) {
+        p->on_mute = !p->on_mute;
+        sprintf(outbuf, p->on_mute ? "\nYou are now muting %s!\n" : "\nYou are no longer muting %s!\n",
+                othersname(p));
+        sendclient(p, outbuf, strlen(outbuf));
+        done = 1;
+    }
+    if (!done && !muting) {
+        // Everyone else in the match hears it, unless they muted the chat
+        sprintf(outbuf, "\n%s says: %s\n\n", p->name, p->inputBuffer);
+        for (i = 0; i < p->match->size; i++) {
+            q = p->match->players[i];
+            if (q != NULL && q != p && q->on_mute == 0) {
+                sendclient(q, outbuf, strlen(outbuf));
+            }
+        }
+        sprintf(outbuf, "[#%d] %s says: %s\n", p->match->id, p->name, p->inputBuffer);
+        spectate(p->match, outbuf, strlen(outbuf));
+    }
+    sprintf(outbuf, "\n");
+    sendclient(p, outbuf, strlen(outbuf));
+    return 0;
+}
+
+/* configuration
+ * The configuration in use is behind one atomic pointer. With -f a loader
+ * thread waits for SIGHUP, reads the file into a new configuration and
+ * swaps it in, so the loop never waits for the file or takes a lock: it
+ * just sees the new one from its next load of the pointer. The loop loads
+ * it afresh wherever it needs it and holds on to nothing past one round,
+ * so the configurations that were swapped out are freed at the top of the
+ * next round.
+ */
+struct confkey {
+    const char *name;
+    size_t off;   // of the int in struct config
+    int min;
+    int max;
+};
+
+#define CONFKEY(name, field, min, max) { name, offsetof(struct config, field), min, max }
+
+static const struct confkey confkeys[] = {
+    CONFKEY("port", port, 1, 65535),
+    CONFKEY("idle_seconds", idle_seconds, 1, 86400),
+    CONFKEY("grace_seconds", grace_seconds, 0, 86400),
+    CONFKEY("resume_seconds", resume_seconds, 0, 86400),
+    CONFKEY("bot_wait_seconds", bot_wait_seconds, 0, 86400),
+    CONFKEY("bot_think_ms", bot_think_ms, 0, 60000),
+    CONFKEY("bytes_per_sec", bytes_per_sec, 1, INT_MAX / 1000),
+    CONFKEY("bytes_burst", bytes_burst, 1, INT_MAX / 1000),
+    CONFKEY("commands_per_sec", commands_per_sec, 1, INT_MAX / 1000),
+    CONFKEY("commands_burst", commands_burst, 1, INT_MAX / 1000),
+    CONFKEY("gateway_outmax", gateway_outmax, GATEWAY_BUF, INT_MAX / 2),
+    CONFKEY("keepalive_idle", keepidle, 0, 86400),
+    CONFKEY("keepalive_interval", keepintvl, 1, 3600),
+    CONFKEY("keepalive_count", keepcnt, 1, 100),
+    CONFKEY("heartbeat", heartbeat, 0, 86400),
+    CONFKEY("health_min", rules.health_min, 1, 0xfffe),
+    CONFKEY("health_range", rules.health_range, 1, 0xfffe),
+    CONFKEY("powermoves_min", rules.powermoves_min, 0, 255),
+    CONFKEY("powermoves_range", rules.powermoves_range, 1, 255),
+    CONFKEY("damage_min", rules.damage_min, 0, 255),
+    CONFKEY("damage_range", rules.damage_range, 1, 256),
+    CONFKEY("powermove_hit", rules.powermove_hit, 0, 100),
+    CONFKEY("powermove_mult", rules.powermove_mult, 1, 100),
+};
+
+static _Atomic(struct config *) retired; // swapped out, linked through retired_next
+static unsigned int confgens = 0;
+
+/* the configuration in use, don't keep it past this round of the loop */
+static const struct config *cfg(void) {
+    return atomic_load_explicit(&conf, memory_order_acquire);
+}
+
+/* set key to value in c, at says where in which file it comes from
+ * returns 0, -1 (and says why) if there is no such key or the value won't do
+ */
+static int setconf(struct config *c, const char *key, const char *value, const char *at) {
+    const struct confkey *k;
+    char *end;
+    long v;
+    if (strcmp(key, "listen") == 0) {
+        if (inet_aton(value, &c->listenaddr) == 0) {
+            fprintf(stderr, "%s: %s isn't an IPv4 address\n", at, value);
+            return -1;
+        }
+        return 0;
+    }
+    for (k = confkeys; k < confkeys + sizeof(confkeys) / sizeof(confkeys[0]); k++) {
+        if (strcmp(key, k->name) != 0) {
+            continue;
+        }
+        v = strtol(value, &end, 10);
+        if (*end != '\0' || v < k->min || v > k->max) {
+            fprintf(stderr, "%s: %s must be a number from %d to %d\n", at, key, k->min, k->max);
+            return -1;
+        }
+        *(int *)((char *)c + k->off) = (int)v;
+        return 0;
+    }
+    fprintf(stderr, "%s: no such setting as %s\n", at, key);
+    return -1;
+}
+
+/* the rules have to fit the binary protocol: health goes out in 2 bytes
+ * (0xffff is an empty seat), damage and power moves in one
+ * returns 0, -1 (and says why) if they don't
+ */
+static int checkrules(const struct battle_rules *r, const char *path) {
+    if ((long)r->health_min + r->health_range - 1 > 0xfffe) {
+        fprintf(stderr, "%s: health_min + health_range - 1 must be at most %d\n", path, 0xfffe);
+        return -1;
+    }
+    if ((long)r->powermoves_min + r->powermoves_range - 1 > 255) {
+        fprintf(stderr, "%s: powermoves_min + powermoves_range - 1 must be at most 255\n", path);
+        return -1;
+    }
+    // A power move that lands is the biggest hit there is
+    if (((long)r->damage_min + r->damage_range - 1) * r->powermove_mult > 255) {
+        fprintf(stderr, "%s: (damage_min + damage_range - 1) * powermove_mult must be at most 255\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/* a new configuration: baseconf with whatever the file at path says
+ * returns NULL (and says why) if the file can't be read or has a mistake
+ */
+static struct config *readconfig(const char *path) {
+    char line[CONF_LINE], key[64], value[64], at[PATH_MAX + 16], *hash;
+    struct config *c;
+    int n, lineno = 0, bad = 0;
+    FILE *f;
+    if ((f = fopen(path, "r")) == NULL) {
+        perror(path);
+        return NULL;
+    }
+    if ((c = malloc(sizeof(struct config))) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    *c = baseconf;
+    while (!bad && fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+        snprintf(at, sizeof(at), "%s:%d", path, lineno);
+        if ((hash = strchr(line, '#')) != NULL) {
+            *hash = '\0';
+        }
+        if ((n = sscanf(line, " %63[a-z_] = %63s", key, value)) <= 0) {
+            continue; // blank
+        }
+        if (n != 2) {
+            fprintf(stderr, "%s: expected key = value\n", at);
+            bad = 1;
+        } else {
+            bad = setconf(c, key, value, at) < 0;
+        }
+    }
+    fclose(f);
+    if (bad || checkrules(&c->rules, path) < 0) {
+        free(c);
+        return NULL;
+    }
+    c->gen = ++confgens;
+    c->retired_next = NULL;
+    return c;
+}
+
+/* free every configuration swapped out before this round of the loop */
+static void freeretired(void) {
+    struct config *c = atomic_exchange(&retired, NULL), *next;
+    for (; c != NULL; c = next) {
+        next = c->retired_next;
+        free(c);
+    }
+}
+
+/* the loader thread: a new configuration for every SIGHUP */
+static void *configloader(void *arg) {
+    struct config *c, *old;
+    sigset_t hup;
+    int sig;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    while (1) {
+        if (sigwait(&hup, &sig) != 0) {
+            continue;
+        }
+        if ((c = readconfig(confpath)) == NULL) {
+            printf("Kept the configuration as it was\n");
+            continue;
+        }
+        old = atomic_exchange_explicit(&conf, c, memory_order_acq_rel);
+        // The loop may be using old right now, it goes at the top of its next round
+        do {
+            old->retired_next = atomic_load(&retired);
+        } while (!atomic_compare_exchange_weak(&retired, &old->retired_next, old));
+        printf("Reloaded the configuration from %s\n", confpath);
+        if (write(wakefds[1], "", 1) < 0 && errno != EAGAIN) {
+            perror("write");
+        }
+    }
+    return NULL;
+}
+
+/* the first configuration, and with -f the loader for the next ones */
+static void startconfig(void) {
+    struct config *c;
+    pthread_t tid;
+    sigset_t hup;
+    if (confpath == NULL) {
+        if ((c = malloc(sizeof(struct config))) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        *c = baseconf;
+        c->gen = ++confgens;
+        atomic_store(&conf, c);
+        return;
+    }
+    if ((c = readconfig(confpath)) == NULL) {
+        exit(1);
+    }
+    atomic_store(&conf, c);
+    if (pipe2(wakefds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        perror("pipe2");
+        exit(1);
+    }
+    // Only the loader takes SIGHUP, every thread started after this leaves it alone
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hup, NULL);
+    if (pthread_create(&tid, NULL, configloader, NULL) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+    pthread_detach(tid);
+}
+
+/* move the listening socket *listenfd to where the configuration says, if
+ * it has moved (connected clients stay where they are)
+ * returns 1 if *listenfd is a new socket, 0 if it is the same
+ */
+static int relisten(int *listenfd) {
+    const struct config *c = cfg();
+    struct sockaddr_in r;
+    socklen_t len = sizeof(r);
+    int fd;
+    if (getsockname(*listenfd, (struct sockaddr *)&r, &len) == 0
+        && r.sin_addr.s_addr == c->listenaddr.s_addr && ntohs(r.sin_port) == c->port) {
+        return 0;
+    }
+    if ((fd = bindandlisten(c)) < 0) {
+        printf("Still listening on the old port, %s:%d is no good\n", inet_ntoa(c->listenaddr), c->port);
+        return 0;
+    }
+    printf("Now listening on %s:%d\n", inet_ntoa(c->listenaddr), c->port);
+    FD_CLR(*listenfd, &allset);
+    close(*listenfd);
+    *listenfd = fd;
+    return 1;
+}
+
+/* affinity and busy polling
+ * With -a the event loop runs on the cores it is given, first thing in
+ * main(), and the history writer on whatever the server was allowed
+ * besides them, so the two never fight over a core. The best cores are
+ * the ones the NIC's receive interrupts are steered to
+ * (/proc/irq/N/smp_affinity_list), then a player's bytes are still in
+ * that core's cache when the loop reads them. -N also binds the server's
+ * memory to those cores' NUMA node(s). Since that happens before any of
+ * the client tables are touched, the tables are local to the loop too.
+ *
+ * With -b the loop checks its sockets without blocking for up to that many
+ * microseconds before it sleeps in select(), which burns a core to skip
+ * the wakeup when the next byte is about to arrive anyway.
+ */
+static cpu_set_t workercpus; // where the history writer goes with -a, empty to stay put
+
+/* parse a list of cores like "2,3" or "2-5,8" into set
+ * returns 0, -1 if the list isn't one
+ */
+static int parsecpus(const char *list, cpu_set_t *set) {
+    char *end;
+    long a, b;
+    CPU_ZERO(set);
+    while (*list) {
+        a = b = strtol(list, &end, 10);
+        if (end == list || a < 0) {
+            return -1;
+        }
+        if (*end == '-') {
+            list = end + 1;
+            b = strtol(list, &end, 10);
+            if (end == list || b < a) {
+                return -1;
+            }
+        }
+        for (; a <= b && a < CPU_SETSIZE; a++) {
+            CPU_SET(a, set);
+        }
+        if (*end != ',' && *end != '\0') {
+            return -1;
+        }
+        list = *end ? end + 1 : end;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+/* bind our memory to the NUMA nodes of the loop's cores */
+static void bindnodes(void) {
+    unsigned long nodes = 0;
+    char path[64];
+    struct dirent *e;
+    DIR *d;
+    int cpu, node;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &loopcpus)) {
+            continue;
+        }
+        sprintf(path, "/sys/devices/system/cpu/cpu%d", cpu);
+        if ((d = opendir(path)) == NULL) {
+            continue;
+        }
+        while ((e = readdir(d)) != NULL) {
+            if (strncmp(e->d_name, "node", 4) == 0 && e->d_name[4] >= '0' && e->d_name[4] <= '9'
+                && (node = atoi(e->d_name + 4)) < (int)sizeof(nodes) * 8) {
+                nodes |= 1UL << node;
+            }
+        }
+        closedir(d);
+    }
+    if (nodes == 0) {
+        fprintf(stderr, "No NUMA node found for the -a cores, memory goes anywhere\n");
+        return;
+    }
+    // MPOL_BIND (2), numaif.h isn't always installed
+    if (syscall(SYS_set_mempolicy, 2, &nodes, sizeof(nodes) * 8) < 0) {
+        perror("set_mempolicy");
+    }
+}
+
+/* pin the event loop (the thread calling this) to loopcpus */
+static void pinloop(void) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        CPU_ZERO(&allowed);
+    }
+    CPU_XOR(&workercpus, &allowed, &loopcpus);
+    CPU_AND(&workercpus, &workercpus, &allowed);
+    if (sched_setaffinity(0, sizeof(loopcpus), &loopcpus) < 0) {
+        perror("sched_setaffinity");
+        exit(1);
+    }
+    if (numalocal) {
+        bindnodes();
+    }
+    printf("Event loop pinned to %d core(s)%s\n", CPU_COUNT(&loopcpus), numalocal ? ", memory on their node" : "");
+}
+
+/* move a worker thread (the caller) off the loop's cores, if there are others */
+static void pinworker(void) {
+    if (pinned && CPU_COUNT(&workercpus) > 0) {
+        pthread_setaffinity_np(pthread_self(), sizeof(workercpus), &workercpus);
+    }
+}
+
+/* select(), after spinning for up to busypoll microseconds (never longer
+ * than tv) on checks that don't block
+ */
+static int waitready(int nfds, fd_set *rset, fd_set *wset, struct timeval *tv) {
+    struct timespec start, t;
+    struct timeval zero;
+    fd_set r, w;
+    long long limit, spun = 0;
+    int n;
+    if (busypoll > 0) {
+        limit = tv->tv_sec * 1000000LL + tv->tv_usec;
+        if (limit > busypoll) {
+            limit = busypoll;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do {
+            r = *rset;
+            w = *wset;
+            zero.tv_sec = zero.tv_usec = 0;
+            nsyscalls++;
+            if ((n = select(nfds, &r, &w, NULL, &zero)) != 0) {
+                if (n > 0) {
+                    *rset = r;
+                    *wset = w;
+                }
+                return n;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &t);
+            spun = (t.tv_sec - start.tv_sec) * 1000000LL + (t.tv_nsec - start.tv_nsec) / 1000;
+        } while (spun < limit);
+        // The rest of the wait is spent asleep
+        limit = tv->tv_sec * 1000000LL + tv->tv_usec - spun;
+        if (limit < 0) {
+            limit = 0;
+        }
+        tv->tv_sec = limit / 1000000;
+        tv->tv_usec = limit % 1000000;
+    }
+    nsyscalls++;
+    return select(nfds, rset, wset, NULL, tv);
+}
+
+/* listen where c says
+ * returns the socket, -1 if that didn't work
+ */
+int bindandlisten(const struct config *c) {
+    struct sockaddr_in r;
+    int listenfd;
+    // creating a TCP socket (note: SOCK_STREAM is TCP)
+    // some error checking, return value of listenfd for error checking <0
+    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+    //  OS release your server's port as soon as your server terminates
+    int yes = 1;
+    if ((setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int))) == -1) {
+        perror("setsockopt");
+    }
+#ifdef SO_BUSY_POLL
+    // With -b the kernel polls the device for a read instead of waiting on
+    // its interrupt, accepted sockets inherit it (raising it past
+    // net.core.busy_read takes CAP_NET_ADMIN)
+    if (busypoll > 0 && setsockopt(listenfd, SOL_SOCKET, SO_BUSY_POLL, &busypoll, sizeof(int)) == -1) {
+        perror("setsockopt SO_BUSY_POLL");
+    }
+#endif
+    // define the server address
+    memset(&r, '\0', sizeof(r));
+    r.sin_family = AF_INET;
+    // INADDR_ANY (the default) means any address on local machine
+    r.sin_addr = c->listenaddr;
+    // htons converts the port number to network byte order
+    r.sin_port = htons(c->port);
+
+    // bind the server address to the socket (note: casting sockaddr_in to sockaddr)
+    if (bind(listenfd, (struct sockaddr *)&r, sizeof(r))) {
+        perror("bind");
+        close(listenfd);
+        return -1;
+    }
+    // listen for connections on the socket, 5 is the maximum number of connections
+    if (listen(listenfd, 5)) {
+        perror("listen");
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+/* listen on the unix socket at path, or in the abstract namespace for "@name" */
+static int bindunix(const char *path) {
+    struct sockaddr_un u;
+    socklen_t len;
+    int fd;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        exit(1);
+    }
+    memset(&u, 0, sizeof(u));
+    u.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(u.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        exit(1);
+    }
+    strcpy(u.sun_path, path);
+    len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+    if (path[0] == '@') {
+        // Abstract names start with a NUL and aren't NUL terminated
+        u.sun_path[0] = '\0';
+    } else {
+        // A socket file left over from an earlier run would stop the bind
+        unlink(path);
+        len++;
+    }
+    if (bind(fd, (struct sockaddr *)&u, len) < 0) {
+        perror(path);
+        exit(1);
+    }
+    if (listen(fd, 5)) {
+        perror("listen");
+        exit(1);
+    }
+    return fd;
+}
+
+/* take UDP sessions on port, at the address we listen on */
+static int bindudp(int port) {
+    struct sockaddr_in r;
+    int fd, size = 1 << 20;
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        perror("socket");
+        exit(1);
+    }
+    // Room for a burst from a lot of bots between two reads
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(int)) < 0
+        || setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(int)) < 0) {
+        perror("setsockopt");
+    }
+    memset(&r, '\0', sizeof(r));
+    r.sin_family = AF_INET;
+    r.sin_addr = cfg()->listenaddr;
+    r.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&r, sizeof(r))) {
+        perror("bind");
+        exit(1);
+    }
+    return fd;
+}
+
+static struct client *addclient(struct client *top, int fd, struct in_addr addr) {
+    char outbuf[512];
+    struct client *p = malloc(sizeof(struct client));
+    if (!p) {
+        perror("malloc");
+        exit(1);
+    }
+
+    printf("Adding client %s\n", inet_ntoa(addr));
+
+    p->fd = fd;
+    p->ipaddr = addr;
+    p->next = top;
+    p->prev = NULL;
+    if (top) {
+        top->prev = p;
+    }
+    p->match = NULL;
+    p->seat = -1;
+    p->mode = MODE_DUEL;
+    p->nseats = 2;
+    p->lastplayed = 0;
+    p->state = AWAITING_NAME;
+    p->name = noname;
+    p->inputLength = 0;
+    p->inputBuffer = NULL;
+    p->room = NULL;
+    p->room_prev = p->room_next = NULL;
+    p->queue_prev = p->queue_next = NULL;
+    p->queued = 0;
+    p->suspended = 0;
+    p->suspend_next = NULL;
+    p->token[0] = '\0';
+    p->token_next = NULL;
+    p->named = 0;
+    p->name_next = NULL;
+    initlimits(p);
+    p->bot = 0;
+    p->botpending = 0;
+    p->botretiring = 0;
+    p->bot_next = NULL;
+    p->watching = NULL;
+    p->watch_prev = p->watch_next = NULL;
+    p->outq = NULL;
+    p->outhead = p->outcount = p->outoff = 0;
+    p->nskips = 0;
+    p->outblocked = 0;
+    p->out_next = NULL;
+    p->gateway = NULL;
+    p->session_next = NULL;
+    p->vin = NULL;
+    p->vinlen = 0;
+    p->vclosed = 0;
+    p->udp = NULL;
+    p->local = 0;
+    p->binary = 0;
+    p->fin = NULL;
+    p->finlen = 0;
+    p->nframes = 0;
+    p->clusterslot = 0;
+    p->fiber = NULL;
+    p->pinged = 0;
+    p->beating = 0;
+    p->beat_prev = p->beat_next = NULL;
+    addref(p);
+    top = p;
+    sprintf(outbuf, "What is your name?\n");
+    sendclient(p, outbuf, strlen(outbuf));
+    return top;
+}
+
+/* take c off the client list, returns the new top */
+static struct client *unlinkclient(struct client *top, struct client *c) {
+    // The list is doubly linked so this doesn't have to walk it
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        top = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    }
+    c->next = c->prev = NULL;
+    return top;
+}
+
+static struct client *removeclient(struct client *top, struct client *c) {
+    printf("Removing client %d %s\n", c->fd, inet_ntoa(c->ipaddr));
+    top = unlinkclient(top, c);
+    unwatch(c);
+    dropoutput(c);
+    leaveroom(c);
+    unsuspend(c);
+    droptoken(c);
+    dropname(c);
+    unpauseclient(c);
+    dropsession(c);
+    dropudp(c);
+    wheeloff(c);
+    dropref(c);
+    if (c->fiber != NULL) {
+        fiber_free(c->fiber);
+    }
+    c->inputLength = 0;
+    dropline(c);
+    dropvin(c);
+    dropfin(c);
+    setname(c, "");
+    free(c);
+    return top;
+}
+
+/* send to a client, nothing is sent to clients without a socket (bots and suspended clients) */
+static int sendclient(struct client *p, const char *s, int len) {
+    struct spectmsg *msg;
+    if (p->gateway != NULL) {
+        return sendsession(p, s, len);
+    }
+    if (p->udp != NULL) {
+        return sendudp(p, s, len);
+    }
+    if (p->fd < 0) {
+        p->nframes = 0;
+        return len;
+    }
+    if (p->binary) {
+        return sendbinary(p, s, len);
+    }
+    // Nothing is written right away: it goes out with the rest of what p
+    // gets in this batch at the next flush point, in one write
+    msg = newmsg(s, len);
+    queueoutput(p, msg);
+    unrefmsg(msg);
+    return len;
 }
 
 
-static void broadcast(struct client *top, char *s, int size) {
+static void broadcastroom(struct room *r, char *s, int size) {
     struct client *p;
-    for (p = top; p; p = p->next) {
-        write(p->fd, s, size);
+    if (r == NULL) {
+        return;
+    }
+    // Only the room's members hear it, and players in a match are left alone
+    for (p = r->members; p; p = p->room_next) {
+        if (p->state == LOOKING_FOR_MATCH) {
+            sendclient(p, s, size);
+        }
+    }
+}
+
+static struct room *roomtable[ROOM_BUCKETS];
+static int nrooms;
+
+static unsigned int hashname(const char *s) {
+    unsigned int h = 5381;
+    while (*s) {
+        h = h * 33 + (unsigned char)*s++;
+    }
+    return h;
+}
+
+/* look a room up by name, creating it if create is set
+ * returns NULL if the room doesn't exist (or the name is no good)
+ */
+static struct room *findroom(const char *name, int create) {
+    unsigned int b = hashname(name) % ROOM_BUCKETS;
+    struct room *r;
+    for (r = roomtable[b]; r; r = r->hnext) {
+        if (strcmp(r->name, name) == 0) {
+            return r;
+        }
+    }
+    if (!create || name[0] == '\0' || strlen(name) >= ROOM_NAME_MAX) {
+        return NULL;
+    }
+    r = calloc(1, sizeof(struct room));
+    if (!r) {
+        perror("calloc");
+        exit(1);
+    }
+    strcpy(r->name, name);
+    r->hnext = roomtable[b];
+    roomtable[b] = r;
+    nrooms++;
+    return r;
+}
+
+static void joinroom(struct client *p, struct room *r) {
+    p->room = r;
+    p->room_prev = NULL;
+    p->room_next = r->members;
+    if (r->members) {
+        r->members->room_prev = p;
+    }
+    r->members = p;
+    r->nmembers++;
+}
+
+static void leaveroom(struct client *p) {
+    struct room *r = p->room;
+    struct room **rp;
+    if (r == NULL) {
+        return;
+    }
+    dequeue(p);
+    if (p->room_prev) {
+        p->room_prev->room_next = p->room_next;
+    } else {
+        r->members = p->room_next;
+    }
+    if (p->room_next) {
+        p->room_next->room_prev = p->room_prev;
+    }
+    p->room = NULL;
+    p->room_prev = p->room_next = NULL;
+    r->nmembers--;
+    // Empty rooms are freed, apart from the default one
+    if (r->nmembers == 0 && strcmp(r->name, DEFAULT_ROOM) != 0) {
+        for (rp = &roomtable[hashname(r->name) % ROOM_BUCKETS]; *rp != r; rp = &(*rp)->hnext)
+            ;
+        *rp = r->hnext;
+        free(r);
+        nrooms--;
+    }
+}
+
+/* put p back in the lobby, at the back of its room's matchmaking queue */
+static void enterlobby(struct client *p) {
+    p->state = LOOKING_FOR_MATCH;
+    if (p->bot) {
+        // Bots only play the one match
+        retirebot(p);
+        return;
+    }
+    enqueue(p);
+}
+
+/* add p to the back of its room's matchmaking queue */
+static void enqueue(struct client *p) {
+    struct room *r = p->room;
+    if (r == NULL || p->queued) {
+        return;
+    }
+    p->queue_next = NULL;
+    p->queue_prev = r->queue_tail;
+    if (r->queue_tail) {
+        r->queue_tail->queue_next = p;
+    } else {
+        r->queue_head = p;
     }
-    /* should probably check write() return value and perhaps remove client */
+    r->queue_tail = p;
+    p->queued = 1;
+    p->queued_at = now();
 }
 
+static void dequeue(struct client *p) {
+    struct room *r = p->room;
+    retract(p);
+    if (!p->queued) {
+        return;
+    }
+    if (p->queue_prev) {
+        p->queue_prev->queue_next = p->queue_next;
+    } else {
+        r->queue_head = p->queue_next;
+    }
+    if (p->queue_next) {
+        p->queue_next->queue_prev = p->queue_prev;
+    } else {
+        r->queue_tail = p->queue_prev;
+    }
+    p->queue_prev = p->queue_next = NULL;
+    p->queued = 0;
+}
+
+/* start a match for p with the longest waiting players in its room who
+ * want the same kind of match
+ * returns 1 if a match was started
+ */
+static int findmatch(struct client *p) {
+    char outbuf[4096];
+    struct client *seats[MATCH_MAX];
+    struct client *other;
+    struct match *m;
+    int n = 0, i, len;
+    // Only players in the queue, not spectators
+    if (p->room == NULL || !p->queued) {
+        return 0;
+    }
+    for (other = p->room->queue_head; other != NULL && n < p->nseats - 1; other = other->queue_next) {
+        // Check if other wants the same match, is connected and (in a duel) wasn't p's last opponent
+        if (other != p && other->mode == p->mode && other->nseats == p->nseats && !other->suspended
+            && (p->mode != MODE_DUEL || other->ref != p->lastplayed)) {
+            seats[n++] = other;
+        }
+    }
+    if (n < p->nseats - 1) {
+        // No match found -- waiting for more players
+        return 0;
+    }
+    seats[n++] = p;
+    // Setting up the match, the longest waiting player goes first
+    m = newmatch();
+    m->mode = p->mode;
+    m->size = n;
+    m->turn = 0;
+    for (i = 0; i < n; i++) {
+        other = seats[i];
+        dequeue(other);
+        m->players[i] = other;
+        strcpy(m->seatname[i], other->name);
+        other->match = m;
+        other->seat = i;
+        other->health = rules_health(&cfg()->rules, &rngstate);
+        other->power_moves = rules_powermoves(&cfg()->rules, &rngstate);
+        other->on_mute = 0;
+    }
+    // Notify the clients that they are in a match, and who is up
+    for (i = 0; i < n; i++) {
+        other = seats[i];
+        len = sprintf(outbuf, "\nYou");
+        if (m->mode == MODE_TEAMS) {
+            len += sprintf(outbuf + len, " and ");
+            len += namelist(outbuf + len, other, 1);
+        }
+        len += sprintf(outbuf + len, " engage ");
+        len += namelist(outbuf + len, other, 0);
+        len += sprintf(outbuf + len, "!\n");
+        len += turnupdate(other, outbuf + len);
+        sendclient(other, outbuf, len);
+    }
+    startturn(m);
+    return 1;
+}
+
+/* matches
+ * Matches come out of a pool: they are allocated MATCH_CHUNK at a time and
+ * never freed, so starting and ending matches costs a couple of pointer
+ * moves however often it happens.
+ */
+static struct match *freematches = NULL;
+static struct match *livematches = NULL; // linked through live_prev/live_next
+static int nmatches = 0;
+static int matchserial = 0;
+
+static struct match *newmatch(void) {
+    struct match *m;
+    int i;
+    if (freematches == NULL) {
+        if ((m = calloc(MATCH_CHUNK, sizeof(struct match))) == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        for (i = 0; i < MATCH_CHUNK; i++) {
+            m[i].next_free = freematches;
+            freematches = &m[i];
+        }
+    }
+    m = freematches;
+    freematches = m->next_free;
+    memset(m, 0, sizeof(struct match));
+    m->id = ++matchserial;
+    m->live_next = livematches;
+    if (livematches) {
+        livematches->live_prev = m;
+    }
+    livematches = m;
+    nmatches++;
+    return m;
+}
+
+static void freematch(struct match *m) {
+    if (m->statemsg != NULL) {
+        unrefmsg(m->statemsg);
+    }
+    if (m->live_prev) {
+        m->live_prev->live_next = m->live_next;
+    } else {
+        livematches = m->live_next;
+    }
+    if (m->live_next) {
+        m->live_next->live_prev = m->live_prev;
+    }
+    m->next_free = freematches;
+    freematches = m;
+    nmatches--;
+}
+
+static int teamof(struct match *m, int seat) {
+    return m->mode == MODE_TEAMS ? seat % 2 : seat;
+}
+
+/* the next occupied seat after seat, in turn order */
+static int nextseat(struct match *m, int seat) {
+    int i, s;
+    for (i = 1; i <= m->size; i++) {
+        s = (seat + i) % m->size;
+        if (m->players[s] != NULL) {
+            return s;
+        }
+    }
+    return seat;
+}
+
+/* how many teams still have someone in the match */
+static int liveteams(struct match *m) {
+    unsigned int seen = 0;
+    int i, n = 0;
+    for (i = 0; i < m->size; i++) {
+        if (m->players[i] != NULL && !(seen & (1u << teamof(m, i)))) {
+            seen |= 1u << teamof(m, i);
+            n++;
+        }
+    }
+    return n;
+}
+
+/* the first player in m without a socket, NULL if everyone is there */
+static struct client *matchheld(struct match *m) {
+    int i;
+    for (i = 0; i < m->size; i++) {
+        if (m->players[i] != NULL && m->players[i]->suspended) {
+            return m->players[i];
+        }
+    }
+    return NULL;
+}
+
+/* write the names of p's allies (or enemies) into buf as "A, B and C"
+ * returns the length
+ */
+static int namelist(char *buf, struct client *p, int allies) {
+    struct match *m = p->match;
+    int i, len = 0, n = 0, total = 0;
+    for (i = 0; i < m->size; i++) {
+        if (m->players[i] != NULL && i != p->seat && (teamof(m, i) == teamof(m, p->seat)) == allies) {
+            total++;
+        }
+    }
+    for (i = 0; i < m->size; i++) {
+        if (m->players[i] == NULL || i == p->seat || (teamof(m, i) == teamof(m, p->seat)) != allies) {
+            continue;
+        }
+        if (n > 0) {
+            len += sprintf(buf + len, n == total - 1 ? " and " : ", ");
+        }
+        len += sprintf(buf + len, "%s", m->players[i]->name);
+        n++;
+    }
+    return len;
+}
+
+/* what p calls the rest of its match */
+static const char *othersname(struct client *p) {
+    struct match *m = p->match;
+    if (m->mode == MODE_DUEL && m->players[1 - p->seat] != NULL) {
+        return m->players[1 - p->seat]->name;
+    }
+    return "the other players";
+}
+
+/* write the state of p's match as p sees it, and whose turn it is, into buf
+ * returns the length
+ */
+static int turnupdate(struct client *p, char *buf) {
+    struct match *m = p->match;
+    struct client *o;
+    int i, len;
+    if (p->binary) {
+        // A binary client gets the numbers, in a frame with its next write
+        return stagestate(p);
+    }
+    len = sprintf(buf, "\nYour health:%d\nYour powermoves: %d\n", p->health, p->power_moves);
+    for (i = 0; i < m->size; i++) {
+        if ((o = m->players[i]) == NULL || o == p) {
+            continue;
+        }
+        if (m->mode == MODE_DUEL) {
+            len += sprintf(buf + len, "%s's health:%d\n", o->name, o->health);
+        } else {
+            // Players are numbered by seat, that is how attacks pick a target
+            len += sprintf(buf + len, "%d) %s's health:%d%s\n", i + 1, o->name, o->health,
+                           teamof(m, i) == teamof(m, p->seat) ? " (ally)" : "");
+        }
+    }
+    if (m->turn == p->seat) {
+        if (m->mode != MODE_DUEL) {
+            len += sprintf(buf + len, "\nAdd a number to pick your target, like a%d\n",
+                           pickenemy(p, "") + 1);
+        }
+        len += sprintf(buf + len, "%s", menu);
+    } else {
+        len += sprintf(buf + len, "Waiting for %s to strike...\n", m->players[m->turn]->name);
+    }
+    return len;
+}
+
+/* set everyone's state for the turn in m->turn, a bot whose turn it is starts thinking */
+static void startturn(struct match *m) {
+    struct client *q;
+    int i;
+    for (i = 0; i < m->size; i++) {
+        if ((q = m->players[i]) != NULL) {
+            q->state = i == m->turn ? IN_MATCH_ATTACK : IN_MATCH_DEFEND;
+        }
+    }
+    if (m->players[m->turn]->bot) {
+        schedulebot(m->players[m->turn]);
+    }
+}
+
+/* the seat p attacks: the number in arg if it is an enemy's, otherwise
+ * the next enemy in turn order
+ */
+static int pickenemy(struct client *p, const char *arg) {
+    struct match *m = p->match;
+    int i, s;
+    while (*arg != '\0' && (*arg < '0' || *arg > '9')) {
+        arg++;
+    }
+    if (*arg != '\0') {
+        s = atoi(arg) - 1;
+        if (s >= 0 && s < m->size && m->players[s] != NULL && teamof(m, s) != teamof(m, p->seat)) {
+            return s;
+        }
+    }
+    for (i = 1; i < m->size; i++) {
+        s = (p->seat + i) % m->size;
+        if (m->players[s] != NULL && teamof(m, s) != teamof(m, p->seat)) {
+            return s;
+        }
+    }
+    return p->seat;
+}
+
+/* take p out of its seat, the match carries on without it */
+static void unseat(struct client *p) {
+    p->match->players[p->seat] = NULL;
+    p->match = NULL;
+    p->seat = -1;
+}
+
+/* the match is over, everyone still in it goes back to the lobby */
+static void endmatch(struct match *m) {
+    struct client *q;
+    int i;
+    recordmatch(m);
+    for (i = 0; i < m->size; i++) {
+        if ((q = m->players[i]) != NULL) {
+            // Whoever is left won
+            recordwin(q);
+            unseat(q);
+            enterlobby(q);
+        }
+    }
+    // and so does whoever was watching
+    while ((q = m->spectators) != NULL) {
+        unwatch(q);
+        sendclient(q, "Awaiting opponent...\n", 21);
+        enterlobby(q);
+    }
+    freematch(m);
+}
+
+/* write what p's move (with damage dmg) on t looked like to q into buf
+ * returns the length
+ */
+static int describemove(char *buf, struct client *p, struct client *t, char move, int dmg, struct client *q) {
+    const char *how = move == 'p' ? " with a power move" : "";
+    if (move == 'x') {
+        return q == p ? sprintf(buf, "You are out of power moves!\n")
+                      : sprintf(buf, "%s is out of power moves!\n", p->name);
+    }
+    if (dmg == 0) {
+        // Missed the power move
+        if (q == p) {
+            return sprintf(buf, "Unlucky! You missed %s!\n", t->name);
+        }
+        if (q == t) {
+            return sprintf(buf, "%s missed you! How Lucky!\n", p->name);
+        }
+        return sprintf(buf, "%s missed %s!\n", p->name, t->name);
+    }
+    if (q == p) {
+        return sprintf(buf, "You hit %s for %d damage%s!\n", t->name, dmg, how);
+    }
+    if (q == t) {
+        return sprintf(buf, "%s hits you for %d damage%s!\n", p->name, dmg, how);
+    }
+    return sprintf(buf, "%s hits %s for %d damage%s!\n", p->name, t->name, dmg, how);
+}
+
+/* p attacks (move 'a') or uses a power move (move 'p') on the player in
+ * seat target, then the turn moves on. Everyone in the match, and whoever
+ * got knocked out of it, gets one write with all of it.
+ */
+static void playmove(struct client *p, char move, int target) {
+    char outbuf[4096];
+    struct match *m = p->match;
+    struct client *t = m->players[target];
+    struct client *q;
+    int dmg = 0, out, over, i, len;
+
+    if (move == 'p' && p->power_moves <= 0) {
+        // Trying a power move without any left loses the turn
+        move = 'x';
+    } else if (move == 'p') {
+        p->power_moves--;
+        dmg = rules_powermove(&cfg()->rules, &rngstate);
+    } else {
+        dmg = rules_attack(&cfg()->rules, &rngstate);
+    }
+    t->health -= dmg;
+    m->moves++;
+    // Check if the target is dead, and if that was the last of its side
+    if ((out = t->health <= 0)) {
+        recordloss(m, t, p);
+        unseat(t);
+    }
+    if (!(over = liveteams(m) <= 1)) {
+        m->turn = nextseat(m, p->seat);
+    }
+    for (i = 0; i <= m->size; i++) {
+        q = i < m->size ? m->players[i] : (out ? t : NULL);
+        if (q == NULL) {
+            continue;
+        }
+        len = q->binary ? stagemove(q, p, target, move, dmg) : describemove(outbuf, p, t, move, dmg, q);
+        if (out && q == t) {
+            len += sprintf(outbuf + len, over ? "You are dead!. %s is VICTORIUS!...\n"
+                                              : "You are dead!. %s knocked you out...\n", p->name);
+        } else if (out) {
+            len += sprintf(outbuf + len, over ? "%s is dead!. You win!\n" : "%s is out!\n", t->name);
+        }
+        if (over || (out && q == t)) {
+            len += sprintf(outbuf + len, "Awaiting opponent...\n");
+        } else {
+            len += turnupdate(q, outbuf + len);
+        }
+        sendclient(q, outbuf, len);
+    }
+    // Spectators get it told once, from the side
+    len = sprintf(outbuf, "[#%d] ", m->id);
+    len += describemove(outbuf + len, p, t, move, dmg, NULL);
+    if (out) {
+        len += sprintf(outbuf + len, "%s is out!\n", t->name);
+    }
+    if (over) {
+        len += sprintf(outbuf + len, m->mode == MODE_TEAMS ? "%s's team won the match.\n"
+                                                           : "%s won the match.\n", p->name);
+    }
+    spectate(m, outbuf, len);
+    if (out) {
+        if (m->mode == MODE_DUEL) {
+            p->lastplayed = t->ref; // Assigns the opponent to p->lastplayed
+            t->lastplayed = p->ref;
+        }
+        enterlobby(t); // Puts t back in its room's queue
+    }
+    if (over) {
+        endmatch(m);
+    } else {
+        startturn(m);
+    }
+    countturn();
+    nturns++;
+}
+
+/* take p out of its match for good, why is sent to everyone left in it */
+static void leavematch(struct client *p, const char *why) {
+    char outbuf[4096];
+    struct match *m = p->match;
+    struct client *q;
+    int hadturn = m->turn == p->seat;
+    int over, i, len;
+
+    recordloss(m, p, NULL);
+    m->left |= 1u << p->seat;
+    unseat(p);
+    if (!(over = liveteams(m) <= 1) && hadturn) {
+        m->turn = nextseat(m, m->turn);
+    }
+    for (i = 0; i < m->size; i++) {
+        if ((q = m->players[i]) == NULL) {
+            continue;
+        }
+        len = sprintf(outbuf, "%s", why);
+        if (over) {
+            len += sprintf(outbuf + len, "Awaiting opponent...\n");
+        } else if (hadturn) {
+            len += turnupdate(q, outbuf + len);
+        }
+        sendclient(q, outbuf, len);
+    }
+    len = sprintf(outbuf, "[#%d] %s%s", m->id, why, over ? "The match is over.\n" : "");
+    spectate(m, outbuf, len);
+    if (over) {
+        endmatch(m);
+    } else if (hadturn) {
+        startturn(m);
+    }
+}
+
+#ifdef ALLOC_CHECK
+/* allocation check
+ * Built with -DALLOC_CHECK (make alloccheck) the server counts turns, and
+ * once ALLOC_WARMUP of them have been played the main thread must not
+ * allocate or free anything any more: the first malloc(), calloc(),
+ * realloc() or free() says what it was and aborts, so the core shows who
+ * did it. ALLOC_TURNS turns later it says the run was clean and exits 0.
+ * Drive it with players who keep playing (no one new connecting, no -s
+ * or -l). Children forked for saving are left alone.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static _Thread_local int allocwatch = 0; // set on the main thread once warm
+static long long allocturns = 0;
+
+static void allocfail(const char *what, size_t size) {
+    char msg[128];
+    int len = snprintf(msg, sizeof(msg), "alloc check: %s(%zu) after %lld turns\n", what, size, allocturns);
+    allocwatch = 0;
+    write(STDERR_FILENO, msg, len);
+    abort();
+}
+
+void *malloc(size_t size) {
+    if (allocwatch) {
+        allocfail("malloc", size);
+    }
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    if (allocwatch) {
+        allocfail("calloc", n * size);
+    }
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (allocwatch) {
+        allocfail("realloc", size);
+    }
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    if (allocwatch && ptr != NULL) {
+        allocfail("free", 0);
+    }
+    __libc_free(ptr);
+}
+
+static void allocforked(void) {
+    allocwatch = 0;
+}
+
+/* a turn was played */
+static void countturn(void) {
+    if (++allocturns == 1) {
+        pthread_atfork(NULL, NULL, allocforked);
+    }
+    if (allocturns == ALLOC_WARMUP) {
+        printf("alloc check: warm after %d turns, watching the next %d\n", ALLOC_WARMUP, ALLOC_TURNS);
+        fflush(stdout);
+        allocwatch = 1;
+    }
+    if (allocturns == ALLOC_WARMUP + ALLOC_TURNS) {
+        allocwatch = 0;
+        printf("alloc check: %d turns without an allocation\n", ALLOC_TURNS);
+        exit(0);
+    }
+}
+#endif
+
+/* pools
+ * Whatever is made per event (messages, history jobs) comes out of a pool
+ * of fixed-size blocks, allocated POOL_CHUNK at a time and never freed.
+ * Once the pools have grown to what the load needs, serving it doesn't
+ * call malloc() at all. A free block holds the link to the next one.
+ */
+struct pool {
+    int size;   // of a block
+    void *free;
+};
+
+// Messages come in three sizes, a bigger one is malloc()ed
+static const int msgsizes[] = { 128, 512, 4096 };
+static struct pool msgpools[] = {
+    { sizeof(struct spectmsg) + 128, NULL },
+    { sizeof(struct spectmsg) + 512, NULL },
+    { sizeof(struct spectmsg) + 4096, NULL },
+};
+# define NMSGPOOLS (int)(sizeof(msgpools) / sizeof(msgpools[0]))
+
+static void *poolget(struct pool *pl) {
+    char *chunk;
+    void *b;
+    int i;
+    if (pl->free == NULL) {
+        if ((chunk = malloc((size_t)POOL_CHUNK * pl->size)) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (i = POOL_CHUNK - 1; i >= 0; i--) {
+            *(void **)(chunk + (size_t)i * pl->size) = pl->free;
+            pl->free = chunk + (size_t)i * pl->size;
+        }
+    }
+    b = pl->free;
+    pl->free = *(void **)b;
+    return b;
+}
+
+static void poolput(struct pool *pl, void *b) {
+    *(void **)b = pl->free;
+    pl->free = b;
+}
+
+/* client buffers
+ * A client only holds a buffer while it has something in it: the line it
+ * is halfway through typing (or that its session is acting on), output its
+ * socket hasn't taken yet, input its gateway or its frames have staged.
+ * Each goes back to its pool as soon as it is empty, so the buffers of a
+ * million idle connections are the handful in use at any moment.
+ */
+static struct pool namepool = { NAME_SHORT, NULL };
+static struct pool linepool = { LINE_LEN, NULL }; // lines, and names that don't fit namepool
+static struct pool outqpool = { SPECT_QUEUE * sizeof(struct spectmsg *), NULL };
+static struct pool vinpool = { GATEWAY_INPUT, NULL };
+static struct pool finpool = { PROTO_MAXIN, NULL };
+
+/* give p a copy of name (cut to LINE_LEN - 1 bytes), "" lets go of p's */
+static void setname(struct client *p, const char *name) {
+    size_t len = strnlen(name, LINE_LEN - 1);
+    // The length says which pool a name came from
+    if (p->name != NULL && p->name != noname) {
+        poolput(strlen(p->name) < NAME_SHORT ? &namepool : &linepool, p->name);
+    }
+    if (len == 0) {
+        p->name = noname;
+        return;
+    }
+    p->name = poolget(len < NAME_SHORT ? &namepool : &linepool);
+    memcpy(p->name, name, len);
+    p->name[len] = '\0';
+}
+
+/* p is about to type a line */
+static void takeline(struct client *p) {
+    if (p->inputBuffer == NULL) {
+        p->inputBuffer = poolget(&linepool);
+        p->inputBuffer[0] = '\0';
+    }
+}
+
+/* p is done with its last line, unless it has started on the next */
+static void dropline(struct client *p) {
+    if (p->inputBuffer != NULL && p->inputLength == 0) {
+        poolput(&linepool, p->inputBuffer);
+        p->inputBuffer = NULL;
+    }
+}
+
+/* input is about to be staged for p */
+static void takevin(struct client *p) {
+    if (p->vin == NULL) {
+        p->vin = poolget(&vinpool);
+        p->vinlen = 0;
+    }
+}
+
+/* throw away p's staged input */
+static void dropvin(struct client *p) {
+    if (p->vin != NULL) {
+        poolput(&vinpool, p->vin);
+        p->vin = NULL;
+    }
+    p->vinlen = 0;
+}
+
+/* frames are about to be read off p's socket */
+static void takefin(struct client *p) {
+    if (p->fin == NULL) {
+        p->fin = poolget(&finpool);
+        p->finlen = 0;
+    }
+}
+
+/* throw away the frames p's socket delivered that haven't been decoded */
+static void dropfin(struct client *p) {
+    if (p->fin != NULL) {
+        poolput(&finpool, p->fin);
+        p->fin = NULL;
+    }
+    p->finlen = 0;
+}
+
+/* spectators
+ * Anything a spectator should see is formatted once into a refcounted
+ * message and a pointer to it goes on every spectator's queue. Queues are
+ * written with non-blocking sends whenever select() says there is room, so a
+ * slow spectator never holds up the players. One whose queue fills up drops
+ * what it had and gets the match's current state instead.
+ */
+static struct client *outlist = NULL; // clients with queued output
+
+static struct spectmsg *newmsg(const char *s, int len) {
+    struct spectmsg *msg;
+    int i;
+    for (i = 0; i < NMSGPOOLS && msgsizes[i] < len; i++)
+        ;
+    if (i < NMSGPOOLS) {
+        msg = poolget(&msgpools[i]);
+    } else if ((msg = malloc(sizeof(struct spectmsg) + len)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    msg->pool = i;
+    msg->refs = 1;
+    msg->len = len;
+    msg->framed = 0;
+    // Without s the caller fills it in
+    if (s != NULL) {
+        memcpy(msg->data, s, len);
+    }
+    return msg;
+}
+
+static void unrefmsg(struct spectmsg *msg) {
+    if (--msg->refs > 0) {
+        return;
+    }
+    if (msg->pool < NMSGPOOLS) {
+        poolput(&msgpools[msg->pool], msg);
+    } else {
+        free(msg);
+    }
+}
+
+/* the state of m in one line, shared until the next thing happens in it */
+static struct spectmsg *statemsg(struct match *m) {
+    char outbuf[4096];
+    int i, len, n = 0;
+    if (m->statemsg == NULL) {
+        len = sprintf(outbuf, "\n[#%d] ", m->id);
+        for (i = 0; i < m->size; i++) {
+            if (m->players[i] != NULL) {
+                len += sprintf(outbuf + len, "%s%s %dhp", n++ ? ", " : "",
+                               m->players[i]->name, m->players[i]->health);
+            }
+        }
+        len += sprintf(outbuf + len, " -- %s to move\n", m->players[m->turn]->name);
+        m->statemsg = newmsg(outbuf, len);
+    }
+    return m->statemsg;
+}
+
+/* let go of everything on p's queue */
+static void clearoutput(struct client *p) {
+    while (p->outcount > 0) {
+        unrefmsg(p->outq[p->outhead]);
+        p->outhead = (p->outhead + 1) % SPECT_QUEUE;
+        p->outcount--;
+    }
+    p->outoff = 0;
+    p->outblocked = 0;
+    if (p->outq != NULL) {
+        poolput(&outqpool, p->outq);
+        p->outq = NULL;
+    }
+}
+
+/* throw away everything on p's queue that hasn't started going out, a
+ * message that went partly has to be finished or the stream breaks in the
+ * middle of a line (or a frame)
+ */
+static void skipoutput(struct client *p) {
+    while (p->outcount > (p->outoff > 0 ? 1 : 0)) {
+        p->outcount--;
+        unrefmsg(p->outq[(p->outhead + p->outcount) % SPECT_QUEUE]);
+    }
+}
+
+static void pushmsg(struct client *p, struct spectmsg *msg) {
+    struct spectmsg *text = msg;
+    if (p->binary && !msg->framed) {
+        // A binary client gets its own copy, in a text frame
+        msg = newmsg(NULL, PROTO_HEADER + text->len);
+        proto_header((unsigned char *)msg->data, PROTO_TEXT, text->len);
+        memcpy(msg->data + PROTO_HEADER, text->data, text->len);
+        msg->framed = 1;
+    } else {
+        msg->refs++;
+    }
+    if (p->outq == NULL) {
+        p->outq = poolget(&outqpool);
+        p->outhead = 0;
+    }
+    p->outq[(p->outhead + p->outcount) % SPECT_QUEUE] = msg;
+    p->outcount++;
+}
+
+/* put msg at the back of p's queue */
+static void queueoutput(struct client *p, struct spectmsg *msg) {
+    if (p->fd < 0) {
+        // The gateway does any queueing for its sessions, and a UDP
+        // session keeps its own until it is acknowledged
+        if (p->gateway != NULL) {
+            sendsession(p, msg->data, msg->len);
+        } else if (p->udp != NULL) {
+            sendudp(p, msg->data, msg->len);
+        }
+        return;
+    }
+    if (p->outcount == 0) {
+        p->out_next = outlist;
+        outlist = p;
+        FD_SET(p->fd, &writeset);
+    }
+    else if (p->outcount == SPECT_QUEUE) {
+        // A player's queue can fill up within one batch, that much goes out now
+        if (p->watching == NULL && !p->outblocked) {
+            flushclient(p);
+        }
+    }
+    if (p->outcount == SPECT_QUEUE && p->watching == NULL) {
+        // A player can't skip any of their own game, one whose socket has
+        // taken none of this much isn't reading. They go as if the socket
+        // had closed, the match is held and a resume brings it all back.
+        printf("%s isn't reading, dropping them\n", p->named ? p->name : inet_ntoa(p->ipaddr));
+        dropoutput(p);
+        shutdown(p->fd, SHUT_RDWR);
+        return;
+    }
+    if (p->outcount == SPECT_QUEUE) {
+        // Too far behind, forget the backlog and catch up with where the match is now
+        skipoutput(p);
+        p->nskips++;
+        totalskips++;
+        if (p->watching != NULL && msg != p->watching->statemsg) {
+            pushmsg(p, statemsg(p->watching));
+        }
+    }
+    pushmsg(p, msg);
+}
+
+/* throw away p's queued output */
+static void dropoutput(struct client *p) {
+    struct client **c;
+    if (p->outcount == 0) {
+        return;
+    }
+    for (c = &outlist; *c != p; c = &(*c)->out_next)
+        ;
+    *c = p->out_next;
+    p->out_next = NULL;
+    if (p->fd >= 0) {
+        FD_CLR(p->fd, &writeset);
+    }
+    clearoutput(p);
+}
+
+/* write as much of p's queue as its socket takes without blocking
+ * returns 1 once the queue is empty
+ */
+static int flushclient(struct client *p) {
+    struct iovec iov[SPECT_QUEUE];
+    struct msghdr msg;
+    struct spectmsg *m;
+    int i, n, done;
+    // Everything queued goes out in one call
+    for (i = 0; i < p->outcount; i++) {
+        m = p->outq[(p->outhead + i) % SPECT_QUEUE];
+        iov[i].iov_base = m->data + (i == 0 ? p->outoff : 0);
+        iov[i].iov_len = m->len - (i == 0 ? p->outoff : 0);
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = p->outcount;
+    n = sendmsg(p->fd, &msg, MSG_DONTWAIT);
+    nsyscalls++;
+    nsends++;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        p->outblocked = 1;
+        return 0;
+    }
+    if (n < 0) {
+        // The socket is gone, reading it will say so and remove the client
+        n = 0x7fffffff;
+    }
+    // Drop whatever went out completely
+    while (p->outcount > 0) {
+        m = p->outq[p->outhead];
+        done = m->len - p->outoff;
+        if (n < done) {
+            p->outoff += n;
+            break;
+        }
+        n -= done;
+        unrefmsg(m);
+        p->outhead = (p->outhead + 1) % SPECT_QUEUE;
+        p->outcount--;
+        p->outoff = 0;
+    }
+    // Whatever is left waits for select() to say there is room
+    p->outblocked = p->outcount > 0;
+    if (p->outcount == 0) {
+        clearoutput(p);
+        return 1;
+    }
+    return 0;
+}
+
+/* write everyone's queue whose socket is in ready, or without ready,
+ * everyone's that isn't waiting for room
+ */
+static void flushoutput(fd_set *ready) {
+    struct client **c, *p;
+    for (c = &outlist; (p = *c) != NULL; ) {
+        if (ready != NULL ? !FD_ISSET(p->fd, ready) : p->outblocked) {
+            c = &p->out_next;
+            continue;
+        }
+        if (flushclient(p)) {
+            *c = p->out_next;
+            p->out_next = NULL;
+            FD_CLR(p->fd, &writeset);
+        } else {
+            c = &p->out_next;
+        }
+    }
+}
+
+/* a flush point: write what the last batch of events produced */
+static void flushall(void) {
+    flushoutput(NULL);
+    flushgateways(NULL);
+    flushudp();
+}
+
+/* TCP segments sent so far by the whole host, from /proc, -1 if unknown */
+static long long outsegs(void) {
+    char buf[4096], *names, *values, *s, *t, *end;
+    int fd, n;
+    // (read by hand, stdio would allocate in the middle of the game)
+    if ((fd = open("/proc/net/snmp", O_RDONLY)) < 0) {
+        return -1;
+    }
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+    // A line of names, then one of numbers, OutSegs is a column of the Tcp pair
+    if ((names = strstr(buf, "\nTcp:")) == NULL || (values = strstr(names + 1, "\nTcp:")) == NULL) {
+        return -1;
+    }
+    for (s = names + 5, t = values + 5; *s != '\n'; ) {
+        while (*s == ' ') {
+            s++;
+        }
+        while (*t == ' ') {
+            t++;
+        }
+        if (strncmp(s, "OutSegs", 7) == 0 && (s[7] == ' ' || s[7] == '\n')) {
+            return strtoll(t, NULL, 10);
+        }
+        s += strcspn(s, " \n");
+        strtoll(t, &end, 10);
+        t = end;
+    }
+    return -1;
+}
+
+/* every STATS_SECONDS, what a turn cost in system calls, writes and
+ * segments, and how many events made up a batch
+ */
+static void statstimer(void *arg) {
+    static long long lastsegs = -1;
+    long long segs = outsegs();
+    addtimer(STATS_SECONDS * 1000LL, statstimer, NULL);
+    if (nturns > 0) {
+        printf("Per turn: %.1f syscalls, %.1f sends", (double)nsyscalls / nturns,
+               (double)nsends / nturns);
+        // (segments are counted for the whole host)
+        if (segs >= 0 && lastsegs >= 0) {
+            printf(", %.1f TCP segments", (double)(segs - lastsegs) / nturns);
+        }
+        printf("; %.1f events per batch, batches of up to %d\n",
+               nbatches ? (double)nevents / nbatches : 0.0, batchsize);
+    }
+    lastsegs = segs;
+    nturns = nsyscalls = nsends = nbatches = nevents = 0;
+}
+
+/* tell everyone watching m about s, the message is built once for all of them */
+static void spectate(struct match *m, const char *s, int len) {
+    struct spectmsg *msg;
+    struct client *p;
+    // Whatever happened changed the state too
+    if (m->statemsg != NULL) {
+        unrefmsg(m->statemsg);
+        m->statemsg = NULL;
+    }
+    if (m->spectators == NULL) {
+        return;
+    }
+    msg = newmsg(s, len);
+    for (p = m->spectators; p; p = p->watch_next) {
+        queueoutput(p, msg);
+    }
+    unrefmsg(msg);
+}
+
+/* p starts watching m, beginning with where it stands
+ * (spectators are out of the matchmaking queue until they stop)
+ */
+static void watch(struct client *p, struct match *m) {
+    unwatch(p);
+    dequeue(p);
+    p->watching = m;
+    p->watch_prev = NULL;
+    p->watch_next = m->spectators;
+    if (m->spectators) {
+        m->spectators->watch_prev = p;
+    }
+    m->spectators = p;
+    m->nspectators++;
+    queueoutput(p, statemsg(m));
+}
+
+static void unwatch(struct client *p) {
+    struct match *m = p->watching;
+    if (m == NULL) {
+        return;
+    }
+    if (p->watch_prev) {
+        p->watch_prev->watch_next = p->watch_next;
+    } else {
+        m->spectators = p->watch_next;
+    }
+    if (p->watch_next) {
+        p->watch_next->watch_prev = p->watch_prev;
+    }
+    p->watching = NULL;
+    p->watch_prev = p->watch_next = NULL;
+    m->nspectators--;
+}
+
+/* send p the matches it could watch */
+static void listmatches(struct client *p) {
+    char outbuf[4096];
+    struct match *m;
+    int i, len = 0, n;
+    len += sprintf(outbuf + len, "\n%d match(es):\n", nmatches);
+    for (m = livematches; m; m = m->live_next) {
+        if (len > (int)sizeof(outbuf) - 512) {
+            sendclient(p, outbuf, len);
+            len = 0;
+        }
+        len += sprintf(outbuf + len, "  #%d", m->id);
+        for (i = 0, n = 0; i < m->size; i++) {
+            // Long names are cut short, this is just a list
+            if (m->players[i] != NULL) {
+                len += sprintf(outbuf + len, "%s%.32s", n++ ? ", " : " ", m->players[i]->name);
+            }
+        }
+        len += sprintf(outbuf + len, " (%d watching)\n", m->nspectators);
+    }
+    len += sprintf(outbuf + len, "Type /watch <number> to watch one.\n");
+    sendclient(p, outbuf, len);
+}
+
+/* ladder
+ * Every result updates the players' Elo ratings on the spot. The standings
+ * are in a treap ordered by rating (then name), where each node knows the
+ * size of its subtree, so moving a player, finding their rank and finding
+ * whoever holds a rank all take O(log n) however many players are ranked.
+ * Bots aren't ranked, they count as a player on RATING_START.
+ */
+static struct standing *laddertable[LADDER_BUCKETS];
+static struct standing *ladder = NULL; // the root of the treap
+static int nranked = 0;
+
+static int treesize(struct standing *t) {
+    return t ? t->size : 0;
+}
+
+static void resize(struct standing *t) {
+    t->size = treesize(t->left) + 1 + treesize(t->right);
+}
+
+/* returns 1 if a ranks above b */
+static int ranksabove(struct standing *a, struct standing *b) {
+    if (a->rating != b->rating) {
+        return a->rating > b->rating;
+    }
+    return strcmp(a->name, b->name) < 0;
+}
+
+/* split t into the standings ranked above s (*above) and the rest (*below) */
+static void splitladder(struct standing *t, struct standing *s, struct standing **above, struct standing **below) {
+    if (t == NULL) {
+        *above = *below = NULL;
+    } else if (ranksabove(t, s)) {
+        splitladder(t->right, s, &t->right, below);
+        resize(t);
+        *above = t;
+    } else {
+        splitladder(t->left, s, above, &t->left);
+        resize(t);
+        *below = t;
+    }
+}
+
+/* join two treaps, everything in above ranks above everything in below */
+static struct standing *joinladder(struct standing *above, struct standing *below) {
+    if (above == NULL || below == NULL) {
+        return above ? above : below;
+    }
+    if (above->prio > below->prio) {
+        above->right = joinladder(above->right, below);
+        resize(above);
+        return above;
+    }
+    below->left = joinladder(above, below->left);
+    resize(below);
+    return below;
+}
+
+static struct standing *insertladder(struct standing *t, struct standing *s) {
+    if (t == NULL || s->prio > t->prio) {
+        splitladder(t, s, &s->left, &s->right);
+        resize(s);
+        return s;
+    }
+    if (ranksabove(s, t)) {
+        t->left = insertladder(t->left, s);
+    } else {
+        t->right = insertladder(t->right, s);
+    }
+    resize(t);
+    return t;
+}
+
+static struct standing *removeladder(struct standing *t, struct standing *s) {
+    if (t == s) {
+        return joinladder(t->left, t->right);
+    }
+    if (ranksabove(s, t)) {
+        t->left = removeladder(t->left, s);
+    } else {
+        t->right = removeladder(t->right, s);
+    }
+    resize(t);
+    return t;
+}
+
+/* put name on the ladder with rating, it mustn't be on it already */
+static struct standing *newstanding(const char *name, int rating) {
+    unsigned int h = hashname(name);
+    struct standing *s;
+    if ((s = calloc(1, sizeof(struct standing) + strlen(name) + 1)) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    strcpy(s->name, name);
+    s->rating = rating;
+    // Any well mixed number will do for the priority, the name's hash is one
+    s->prio = h * 2654435761u;
+    s->hnext = laddertable[h % LADDER_BUCKETS];
+    laddertable[h % LADDER_BUCKETS] = s;
+    ladder = insertladder(ladder, s);
+    nranked++;
+    return s;
+}
+
+/* returns name's standing, made on RATING_START if create is set and there isn't one */
+static struct standing *findstanding(const char *name, int create) {
+    struct standing *s;
+    for (s = laddertable[hashname(name) % LADDER_BUCKETS]; s; s = s->hnext) {
+        if (strcmp(s->name, name) == 0) {
+            return s;
+        }
+    }
+    return create ? newstanding(name, RATING_START) : NULL;
+}
+
+/* move s to its place for rating */
+static void rerate(struct standing *s, int rating) {
+    ladder = removeladder(ladder, s);
+    s->rating = rating;
+    s->left = s->right = NULL;
+    ladder = insertladder(ladder, s);
+    ladderdirty = 1;
+}
+
+/* 1 for the best player, 0 if s isn't on the ladder */
+static int rankof(struct standing *s) {
+    struct standing *t = ladder;
+    int rank = 0;
+    while (t != NULL) {
+        if (t == s) {
+            return rank + treesize(t->left) + 1;
+        }
+        if (ranksabove(s, t)) {
+            t = t->left;
+        } else {
+            rank += treesize(t->left) + 1;
+            t = t->right;
+        }
+    }
+    return 0;
+}
+
+/* the standing ranked rank, NULL if there are fewer players */
+static struct standing *ranked(int rank) {
+    struct standing *t = ladder;
+    while (t != NULL) {
+        if (rank == treesize(t->left) + 1) {
+            return t;
+        }
+        if (rank <= treesize(t->left)) {
+            t = t->left;
+        } else {
+            rank -= treesize(t->left) + 1;
+            t = t->right;
+        }
+    }
+    return NULL;
+}
+
+/* the Elo points a player on rating w takes from one on rating l by beating them */
+static int elopoints(int w, int l, int k) {
+    double expected = 1.0 / (1.0 + pow(10.0, (l - w) / 400.0));
+    return (int)(k * (1.0 - expected) + 0.5);
+}
+
+/* w beat l, the result is worth up to k points */
+static void rate(struct client *w, struct client *l, int k) {
+    struct standing *sw = w->bot ? NULL : findstanding(w->name, 1);
+    struct standing *sl = l->bot ? NULL : findstanding(l->name, 1);
+    int d = elopoints(sw ? sw->rating : RATING_START, sl ? sl->rating : RATING_START, k);
+    if (sw) {
+        rerate(sw, sw->rating + d);
+    }
+    if (sl) {
+        rerate(sl, sl->rating - d);
+    }
+}
+
+/* l is out of m, knocked out by by, or (by is NULL) l left and the enemies
+ * still in m share the win. l has to be seated still.
+ */
+static void recordloss(struct match *m, struct client *l, struct client *by) {
+    struct client *q;
+    int i, n = 0;
+    if (by != NULL) {
+        rate(by, l, RATING_K);
+    } else {
+        for (i = 0; i < m->size; i++) {
+            if (m->players[i] != NULL && teamof(m, i) != teamof(m, l->seat)) {
+                n++;
+            }
+        }
+        for (i = 0; i < m->size; i++) {
+            q = m->players[i];
+            if (q != NULL && teamof(m, i) != teamof(m, l->seat)) {
+                rate(q, l, RATING_K / n);
+            }
+        }
+    }
+    if (!l->bot) {
+        findstanding(l->name, 1)->losses++;
+        ladderdirty = 1;
+    }
+}
+
+static void recordwin(struct client *w) {
+    if (!w->bot) {
+        findstanding(w->name, 1)->wins++;
+        ladderdirty = 1;
+    }
+}
+
+/* send p the best n players */
+static void listtop(struct client *p, int n) {
+    char outbuf[4096];
+    struct standing *s;
+    int i, len;
+    len = sprintf(outbuf, "\nTop %d of %d:\n", n < nranked ? n : nranked, nranked);
+    for (i = 1; i <= n && (s = ranked(i)) != NULL; i++) {
+        // Long names are cut short, this is just a list
+        len += sprintf(outbuf + len, "%3d. %.64s %d (%d-%d)\n", i, s->name, s->rating, s->wins, s->losses);
+    }
+    sendclient(p, outbuf, len);
+}
+
+/* send p where name stands */
+static void showrank(struct client *p, const char *name) {
+    char outbuf[512];
+    struct standing *s = findstanding(name, 0);
+    if (s == NULL) {
+        sprintf(outbuf, "%.255s hasn't played a rated match.\n", name);
+    } else {
+        sprintf(outbuf, "%.255s is #%d of %d, rated %d (%d wins, %d losses)\n",
+                s->name, rankof(s), nranked, s->rating, s->wins, s->losses);
+    }
+    sendclient(p, outbuf, strlen(outbuf));
+}
+
+/* send p the list of rooms, batching the lines into as few writes as possible */
+static void listrooms(struct client *p) {
+    char outbuf[4096];
+    int len = 0;
+    int i;
+    struct room *r;
+    len += sprintf(outbuf + len, "\n%d room(s):\n", nrooms);
+    for (i = 0; i < ROOM_BUCKETS; i++) {
+        for (r = roomtable[i]; r; r = r->hnext) {
+            if (len > (int)sizeof(outbuf) - ROOM_NAME_MAX - 32) {
+                sendclient(p, outbuf, len);
+                len = 0;
+            }
+            len += sprintf(outbuf + len, "  %s (%d)%s\n", r->name, r->nmembers,
+                           r == p->room ? " <- you are here" : "");
+        }
+    }
+    sendclient(p, outbuf, len);
+}
+
+/* handle a '/' command typed in the lobby, the line is in p->inputBuffer */
+static void handlelobbyline(struct client *p) {
+    char outbuf[512];
+    char oldroom[ROOM_NAME_MAX];
+    char *arg;
+    struct room *r;
+    struct match *m;
+    int n;
+    if (strcmp(p->inputBuffer, "/rooms") == 0) {
+        listrooms(p);
+    }
+    else if (strncmp(p->inputBuffer, "/join ", 6) == 0) {
+        arg = p->inputBuffer + 6;
+        arg[strcspn(arg, " \t")] = '\0';
+        if (strcmp(arg, p->room->name) == 0) {
+            sprintf(outbuf, "You are already in %s.\n", arg);
+            sendclient(p, outbuf, strlen(outbuf));
+            return;
+        }
+        if ((r = findroom(arg, 1)) == NULL) {
+            sprintf(outbuf, "Room names must be 1-%d characters.\n", ROOM_NAME_MAX - 1);
+            sendclient(p, outbuf, strlen(outbuf));
+            return;
+        }
+        strcpy(oldroom, p->room->name);
+        unwatch(p);
+        leaveroom(p);
+        // The old room is gone if p was the last one in it
+        sprintf(outbuf, "\r\n**%s left for %s.**\r\n", p->name, r->name);
+        broadcastroom(findroom(oldroom, 0), outbuf, strlen(outbuf));
+        joinroom(p, r);
+        sprintf(outbuf, "\r\n**%s joined the area.**\r\n", p->name);
+        broadcastroom(p->room, outbuf, strlen(outbuf));
+        enterlobby(p);
+        sprintf(outbuf, "You are now in room '%s'. Awaiting opponent...\n", r->name);
+        sendclient(p, outbuf, strlen(outbuf));
+    }
+    else if (strncmp(p->inputBuffer, "/tell ", 6) == 0) {
+        tell(p, p->inputBuffer);
+    }
+    else if (strcmp(p->inputBuffer, "/top") == 0 || strncmp(p->inputBuffer, "/top ", 5) == 0) {
+        n = p->inputBuffer[4] ? atoi(p->inputBuffer + 5) : 10;
+        listtop(p, n < 1 ? 1 : n > TOP_MAX ? TOP_MAX : n);
+    }
+    else if (strcmp(p->inputBuffer, "/rank") == 0) {
+        showrank(p, p->name);
+    }
+    else if (strncmp(p->inputBuffer, "/rank ", 6) == 0) {
+        showrank(p, p->inputBuffer + 6);
+    }
+    else if (strcmp(p->inputBuffer, "/history") == 0) {
+        showhistory(p, p->name, 10);
+    }
+    else if (strncmp(p->inputBuffer, "/history ", 9) == 0) {
+        arg = p->inputBuffer + 9;
+        // "/history [n] [name]"
+        n = atoi(arg) > 0 ? atoi(arg) : 10;
+        arg += strspn(arg, "0123456789");
+        arg += strspn(arg, " ");
+        showhistory(p, *arg ? arg : p->name, n > HISTORY_KEEP ? HISTORY_KEEP : n);
+    }
+    else if (strcmp(p->inputBuffer, "/matches") == 0) {
+        listmatches(p);
+    }
+    else if (strncmp(p->inputBuffer, "/watch ", 7) == 0) {
+        n = atoi(p->inputBuffer + 7);
+        for (m = livematches; m && m->id != n; m = m->live_next)
+            ;
+        if (m == NULL) {
+            sprintf(outbuf, "There is no match #%d, type /matches to see them.\n", n);
+            sendclient(p, outbuf, strlen(outbuf));
+            return;
+        }
+        sprintf(outbuf, "Watching match #%d, type /unwatch to stop.\n", m->id);
+        sendclient(p, outbuf, strlen(outbuf));
+        watch(p, m);
+    }
+    else if (strcmp(p->inputBuffer, "/unwatch") == 0 && p->watching != NULL) {
+        unwatch(p);
+        enterlobby(p);
+        sprintf(outbuf, "Awaiting opponent...\n");
+        sendclient(p, outbuf, strlen(outbuf));
+    }
+    else if (strncmp(p->inputBuffer, "/mode ", 6) == 0) {
+        arg = p->inputBuffer + 6;
+        if (strcmp(arg, "duel") == 0) {
+            p->mode = MODE_DUEL;
+            p->nseats = 2;
+        } else if (strcmp(arg, "2v2") == 0) {
+            p->mode = MODE_TEAMS;
+            p->nseats = 4;
+        } else if (strncmp(arg, "ffa", 3) == 0 && (arg[3] == '\0' || arg[3] == ' ')) {
+            n = arg[3] ? atoi(arg + 4) : FFA_PLAYERS;
+            if (n < 3 || n > MATCH_MAX) {
+                sprintf(outbuf, "A free-for-all takes 3-%d players.\n", MATCH_MAX);
+                sendclient(p, outbuf, strlen(outbuf));
+                return;
+            }
+            p->mode = MODE_FFA;
+            p->nseats = n;
+        } else {
+            sprintf(outbuf, "Modes: /mode duel, /mode 2v2, /mode ffa [players]\n");
+            sendclient(p, outbuf, strlen(outbuf));
+            return;
+        }
+        sprintf(outbuf, "Looking for a %d player %s match. Awaiting opponent...\n", p->nseats,
+                p->mode == MODE_DUEL ? "duel" : p->mode == MODE_TEAMS ? "team" : "free-for-all");
+        sendclient(p, outbuf, strlen(outbuf));
+    }
+    else {
+        sprintf(outbuf, "Commands: /rooms, /join <room>, /mode duel|2v2|ffa [players], /matches, /watch <match>, /unwatch, /tell <name> <message>, /top [n], /rank [name], /history [n] [name]\n");
+        sendclient(p, outbuf, strlen(outbuf));
+    }
+}
+
+/* timers
+ * A binary heap ordered on when the timer is due. Timers fire once, a
+ * periodic job just adds itself again.
+ */
+static struct timer *timers;
+static int ntimers;
+static int maxtimers;
+
+/* milliseconds on the monotonic clock */
+static long long now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* call fn(arg) in delay milliseconds */
+static void addtimer(long long delay, void (*fn)(void *arg), void *arg) {
+    struct timer t;
+    int i;
+    if (ntimers == maxtimers) {
+        maxtimers = maxtimers ? maxtimers * 2 : 64;
+        timers = realloc(timers, maxtimers * sizeof(struct timer));
+        if (!timers) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    t.when = now() + delay;
+    t.fn = fn;
+    t.arg = arg;
+    // sift up
+    for (i = ntimers++; i > 0 && timers[(i - 1) / 2].when > t.when; i = (i - 1) / 2) {
+        timers[i] = timers[(i - 1) / 2];
+    }
+    timers[i] = t;
+}
+
+/* run every timer that is due
+ * returns the milliseconds until the next one, -1 if there are none
+ */
+static long long runtimers(void) {
+    struct timer t, last;
+    long long t_now = now();
+    int i, child;
+
+    while (ntimers > 0 && timers[0].when <= t_now) {
+        t = timers[0];
+        // sift the last timer down from the top
+        last = timers[--ntimers];
+        for (i = 0; (child = 2 * i + 1) < ntimers; i = child) {
+            if (child + 1 < ntimers && timers[child + 1].when < timers[child].when) {
+                child++;
+            }
+            if (last.when <= timers[child].when) {
+                break;
+            }
+            timers[i] = timers[child];
+        }
+        timers[i] = last;
+        // the callback may add timers of its own
+        t.fn(t.arg);
+    }
+    if (ntimers == 0) {
+        return -1;
+    }
+    return timers[0].when > t_now ? timers[0].when - t_now : 0;
+}
+
+/* the game's random numbers, the state lives in rngstate so it can be saved and restored */
+static int gamerand(void) {
+    return rules_rand(&rngstate);
+}
+
+/* suspended clients
+ * A client without a socket keeps its place in its room and its match until
+ * someone resumes it or its deadline passes. The suspended ones are also
+ * kept on their own list so that nothing has to walk every client for them.
+ */
+static struct client *suspendedlist = NULL;
+
+static void suspend(struct client *p, long long deadline) {
+    if (p->suspended) {
+        return;
+    }
+    p->suspended = 1;
+    p->resume_deadline = deadline;
+    p->suspend_next = suspendedlist;
+    suspendedlist = p;
+    addtimer(deadline - now(), expiretimer, NULL);
+}
+
+static void unsuspend(struct client *p) {
+    struct client **s;
+    if (!p->suspended) {
+        return;
+    }
+    for (s = &suspendedlist; *s != p; s = &(*s)->suspend_next)
+        ;
+    *s = p->suspend_next;
+    p->suspend_next = NULL;
+    p->suspended = 0;
+}
+
+/* move the socket of the new client p into the suspended client old */
+static void reattach(struct client *old, struct client *p) {
+    char outbuf[4096];
+    int len;
+    old->fd = p->fd;
+    old->ipaddr = p->ipaddr;
+    p->fd = -1;
+    if (p->gateway != NULL) {
+        movesession(old, p);
+    } else if (p->udp != NULL) {
+        moveudp(old, p);
+    } else {
+        // The protocol goes with the socket, and so does anything staged after the /resume
+        dropvin(old);
+        dropfin(old);
+        old->vin = p->vin;
+        old->vinlen = p->vinlen;
+        old->fin = p->fin;
+        old->finlen = p->finlen;
+        old->binary = p->binary;
+        p->vin = NULL;
+        p->vinlen = 0;
+        p->fin = NULL;
+        p->finlen = 0;
+        heard(old);
+    }
+    unsuspend(old);
+    printf("Resumed %s on fd %d\n", old->name, old->fd);
+
+    sprintf(outbuf, "\nWelcome back, %s!\n", old->name);
+    sendclient(old, outbuf, strlen(outbuf));
+    if (old->match != NULL) {
+        sprintf(outbuf, "\n%s is back!\n", old->name);
+        sendmatch(old, outbuf, strlen(outbuf));
+    }
+    if (old->state == IN_MATCH_ATTACK || old->state == IN_MATCH_DEFEND) {
+        len = turnupdate(old, outbuf);
+        sendclient(old, outbuf, len);
+    }
+    else {
+        sprintf(outbuf, "Awaiting opponent...\n");
+        sendclient(old, outbuf, strlen(outbuf));
+    }
+}
+
+/* p's socket closed in the middle of a match, hold the match for the grace period */
+static void holdmatch(struct client *p) {
+    char outbuf[512];
+    int grace = cfg()->grace_seconds;
+    printf("Disconnect from %s, holding %s's match\n", inet_ntoa(p->ipaddr), p->name);
+    sprintf(outbuf, "\n%s lost connection. Waiting up to %d seconds for them to come back...\n",
+            p->name, grace);
+    sendmatch(p, outbuf, strlen(outbuf));
+    suspend(p, now() + grace * 1000LL);
+}
+
+/* p is gone for good, the rest of its match (if any) carries on without it */
+static void forfeit(struct client *p) {
+    char outbuf[512];
+    if (p->match == NULL) {
+        return;
+    }
+    sprintf(outbuf, "%s has left the game!!\n", p->name);
+    leavematch(p, outbuf);
+}
+
+/* send s to everyone in p's match but p (nothing reaches players without a socket) */
+static void sendmatch(struct client *p, const char *s, int len) {
+    struct client *q;
+    int i;
+    for (i = 0; i < p->match->size; i++) {
+        if ((q = p->match->players[i]) != NULL && q != p) {
+            sendclient(q, s, len);
+        }
+    }
+}
+
+/* handles
+ * A client that remembers another one (lastplayed) keeps a handle to it
+ * rather than a pointer: the other client's slot in clienttab and the
+ * slot's generation, which goes up whenever its client goes away. A handle
+ * to a client that is gone finds nothing instead of whoever got the slot
+ * (or the memory) next, and free slots are reused straight off a list.
+ */
+struct clientslot {
+    struct client *client; // NULL while the slot is free
+    unsigned int gen;
+    int next_free;
+};
+
+static struct clientslot *clienttab = NULL;
+static int nslots = 0;
+static int slotcap = 0;
+static int freeslot = -1;
+
+/* give p a slot, and with it a handle */
+static void addref(struct client *p) {
+    int i;
+    if (freeslot >= 0) {
+        i = freeslot;
+        freeslot = clienttab[i].next_free;
+    } else {
+        if (nslots == slotcap) {
+            slotcap = slotcap ? slotcap * 2 : 1024;
+            if ((clienttab = realloc(clienttab, slotcap * sizeof(struct clientslot))) == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        i = nslots++;
+        clienttab[i].gen = 1;
+    }
+    clienttab[i].client = p;
+    p->ref = (unsigned long long)clienttab[i].gen << 32 | (unsigned int)i;
+}
+
+/* p is going away, every handle to it goes stale */
+static void dropref(struct client *p) {
+    int i = p->ref & 0xffffffff;
+    if (p->ref == 0) {
+        return;
+    }
+    clienttab[i].client = NULL;
+    // Generation 0 is never handed out, so a handle of 0 finds nobody
+    if (++clienttab[i].gen == 0) {
+        clienttab[i].gen = 1;
+    }
+    clienttab[i].next_free = freeslot;
+    freeslot = i;
+    p->ref = 0;
+}
+
+/* returns the client ref is a handle to, NULL if it is gone */
+static struct client *deref(unsigned long long ref) {
+    unsigned int i = ref & 0xffffffff;
+    if (i >= (unsigned int)nslots || clienttab[i].gen != ref >> 32) {
+        return NULL;
+    }
+    return clienttab[i].client;
+}
+
+/* session tokens
+ * Chained hash table on the token. Tokens are random, so any hash will do.
+ */
+static struct client *tokentable[TOKEN_BUCKETS];
+
+static void addtoken(struct client *p) {
+    unsigned int b = hashname(p->token) % TOKEN_BUCKETS;
+    p->token_next = tokentable[b];
+    tokentable[b] = p;
+}
+
+/* give p a fresh token and tell them about it */
+static void issuetoken(struct client *p) {
+    char outbuf[512];
+    unsigned char bytes[TOKEN_LEN / 2];
+    int i;
+    if (getrandom(bytes, sizeof(bytes), 0) != sizeof(bytes)) {
+        // no kernel randomness, fall back on the game's generator
+        for (i = 0; i < (int)sizeof(bytes); i++) {
+            bytes[i] = gamerand() ^ now();
+        }
+    }
+    for (i = 0; i < (int)sizeof(bytes); i++) {
+        sprintf(p->token + 2 * i, "%02x", bytes[i]);
+    }
+    addtoken(p);
+    sprintf(outbuf, "Your session token is %s. If you lose connection in a match, type /resume %s as your name.\n",
+            p->token, p->token);
+    sendclient(p, outbuf, strlen(outbuf));
+}
+
+/* returns the client holding token, NULL if there isn't one */
+static struct client *findtoken(const char *token) {
+    struct client *t;
+    if (strlen(token) != TOKEN_LEN) {
+        return NULL;
+    }
+    for (t = tokentable[hashname(token) % TOKEN_BUCKETS]; t; t = t->token_next) {
+        if (strcmp(t->token, token) == 0) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+static void droptoken(struct client *p) {
+    struct client **t;
+    if (p->token[0] == '\0') {
+        return;
+    }
+    for (t = &tokentable[hashname(p->token) % TOKEN_BUCKETS]; *t && *t != p; t = &(*t)->token_next)
+        ;
+    if (*t) {
+        *t = p->token_next;
+    }
+    p->token[0] = '\0';
+    p->token_next = NULL;
+}
+
+/* names
+ * Every named client (bots included) is in a chained hash table on its
+ * name, which keeps names unique and finds anyone by name without walking
+ * the client list. The hash is kept with the client so a lookup only
+ * compares strings whose hashes already match.
+ */
+static struct client *nametable[NAME_BUCKETS];
+
+static void addname(struct client *p) {
+    unsigned int b;
+    p->namehash = hashname(p->name);
+    b = p->namehash % NAME_BUCKETS;
+    p->name_next = nametable[b];
+    nametable[b] = p;
+    p->named = 1;
+}
+
+/* returns the client called name, NULL if there isn't one */
+static struct client *findname(const char *name) {
+    unsigned int h = hashname(name);
+    struct client *t;
+    for (t = nametable[h % NAME_BUCKETS]; t; t = t->name_next) {
+        if (t->namehash == h && strcmp(t->name, name) == 0) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+static void dropname(struct client *p) {
+    struct client **t;
+    if (!p->named) {
+        return;
+    }
+    for (t = &nametable[p->namehash % NAME_BUCKETS]; *t && *t != p; t = &(*t)->name_next)
+        ;
+    if (*t) {
+        *t = p->name_next;
+    }
+    p->name_next = NULL;
+    p->named = 0;
+}
+
+/* handle "/tell <name> <message>" from p, line is the whole command */
+static void tell(struct client *p, char *line) {
+    char outbuf[1024];
+    char *name = line + 6;
+    char *msg;
+    struct client *to;
+    name += strspn(name, " ");
+    msg = name + strcspn(name, " ");
+    if (*msg != '\0') {
+        *msg++ = '\0';
+    }
+    if (*msg == '\0') {
+        sprintf(outbuf, "Usage: /tell <name> <message>\n");
+        sendclient(p, outbuf, strlen(outbuf));
+        return;
+    }
+    if ((to = findname(name)) == NULL || (to->fd < 0 && to->gateway == NULL && to->udp == NULL)) {
+        sprintf(outbuf, "%.255s isn't here.\n", name);
+        sendclient(p, outbuf, strlen(outbuf));
+        return;
+    }
+    sprintf(outbuf, "\n%s whispers: %s\n", p->name, msg);
+    sendclient(to, outbuf, strlen(outbuf));
+    sprintf(outbuf, "(to %s) %s\n", to->name, msg);
+    sendclient(p, outbuf, strlen(outbuf));
+}
+
+/* gateways
+ * A gateway is a front-end on this host (TLS, websockets) that connects to
+ * the -u socket, sends GATEWAY_MAGIC and then carries any number of player
+ * sessions over that one connection. It is greeted like any other client,
+ * so the frames start after the first newline it gets. Every frame, both
+ * ways, starts with an 8 byte header: the session number (4 bytes), the
+ * frame type, a zero byte and the length of what follows (2 bytes), all in
+ * network order.
+ *
+ * A session is an ordinary client without a socket, like a bot: what the
+ * gateway sends for it is staged in vin and handleclient() reads it from
+ * there, and whatever is sent to it goes back in a GW_DATA frame.
+ */
+static struct client *sessiontable[SESSION_BUCKETS];
+
+static unsigned int sessionbucket(struct gateway *g, unsigned int session) {
+    return (session * 2654435761u ^ (unsigned int)((unsigned long)g >> 4)) % SESSION_BUCKETS;
+}
+
+static struct client *findsession(struct gateway *g, unsigned int session) {
+    struct client *p;
+    for (p = sessiontable[sessionbucket(g, session)]; p; p = p->session_next) {
+        if (p->gateway == g && p->session == session) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static void addsession(struct client *p) {
+    unsigned int b = sessionbucket(p->gateway, p->session);
+    p->session_next = sessiontable[b];
+    sessiontable[b] = p;
+    p->gateway->nsessions++;
+}
+
+/* p isn't behind its gateway any more */
+static void dropsession(struct client *p) {
+    struct client **c;
+    if (p->gateway == NULL) {
+        return;
+    }
+    for (c = &sessiontable[sessionbucket(p->gateway, p->session)]; *c != p; c = &(*c)->session_next)
+        ;
+    *c = p->session_next;
+    p->session_next = NULL;
+    p->gateway->nsessions--;
+    p->gateway = NULL;
+    dropvin(p);
+    p->vclosed = 0;
+}
+
+/* the session of new takes over old, which has been waiting for a resume */
+static void movesession(struct client *old, struct client *new) {
+    struct gateway *g = new->gateway;
+    dropvin(old);
+    old->binary = 0;
+    old->session = new->session;
+    old->vin = new->vin;
+    old->vinlen = new->vinlen;
+    new->vin = NULL;
+    dropsession(new);
+    old->gateway = g;
+    addsession(old);
+}
+
+/* queue a frame of type for session on g, it goes out with the rest of
+ * g's frames once select() says there is room
+ * returns -1 if g is too far behind to take it
+ */
+static int sendframe(struct gateway *g, unsigned int session, int type, const char *s, int len) {
+    unsigned char *hdr;
+    if (g->stalled || g->outlen + 8 + len > cfg()->gateway_outmax) {
+        g->stalled = 1;
+        return -1;
+    }
+    if (g->outlen + 8 + len > g->outsize) {
+        g->outsize = g->outsize ? g->outsize * 2 : GATEWAY_BUF;
+        while (g->outsize < g->outlen + 8 + len) {
+            g->outsize *= 2;
+        }
+        if ((g->out = realloc(g->out, g->outsize)) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    if (g->outlen == 0) {
+        FD_SET(g->fd, &writeset);
+    }
+    hdr = (unsigned char *)g->out + g->outlen;
+    hdr[0] = session >> 24;
+    hdr[1] = session >> 16;
+    hdr[2] = session >> 8;
+    hdr[3] = session;
+    hdr[4] = type;
+    hdr[5] = 0;
+    hdr[6] = len >> 8;
+    hdr[7] = len;
+    if (len > 0) {
+        memcpy(hdr + 8, s, len);
+    }
+    g->outlen += 8 + len;
+    return len;
+}
+
+/* sendclient() for a client behind a gateway */
+static int sendsession(struct client *p, const char *s, int len) {
+    int n, sent;
+    for (sent = 0; sent < len; sent += n) {
+        n = len - sent > 0xffff ? 0xffff : len - sent;
+        if (sendframe(p->gateway, p->session, GW_DATA, s + sent, n) < 0) {
+            return -1;
+        }
+    }
+    return len;
+}
+
+/* feed p's staged input to handleclient() until it is used up, p is paused or p is gone */
+static void runsession(struct client *p) {
+    int result;
+    while ((p->vinlen > 0 || p->vclosed) && !p->paused) {
+        result = handleclient(p, head);
+        statedirty = 1;
+        if (result == -1 || result == 1) {
+            // Gone, or its session moved to the client it resumed
+            head = removeclient(head, p);
+            return;
+        }
+        if (result == 2) {
+            // Held for a resume like anyone else who drops out of a match
+            dropsession(p);
+            dropudp(p);
+            return;
+        }
+    }
+}
+
+/* a gateway's first frame for session */
+static void opensession(struct gateway *g, unsigned int session) {
+    struct in_addr addr;
+    struct client *p;
+    if (findsession(g, session) != NULL) {
+        return;
+    }
+    addr.s_addr = htonl(INADDR_LOOPBACK);
+    head = addclient(head, -1, addr);
+    p = head;
+    p->gateway = g;
+    p->session = session;
+    addsession(p);
+    // addclient() couldn't ask without a way to reach p
+    sendclient(p, "What is your name?\n", 19);
+    statedirty = 1;
+}
+
+/* read what g sent and hand it to its sessions
+ * returns -1 once g is gone, 0 otherwise
+ */
+static int readgateway(struct gateway *g) {
+    int n = read(g->fd, g->in + g->inlen, GATEWAY_BUF - g->inlen);
+    nsyscalls++;
+    if (n <= 0) {
+        return -1;
+    }
+    g->inlen += n;
+    return gatewayframes(g);
+}
+
+/* hand the whole frames in g's buffer to its sessions
+ * returns -1 if g sent one it shouldn't have, 0 otherwise
+ */
+static int gatewayframes(struct gateway *g) {
+    unsigned char *f;
+    unsigned int session;
+    struct client *p;
+    int len, off = 0;
+
+    while (g->inlen - off >= 8) {
+        f = (unsigned char *)g->in + off;
+        session = (unsigned int)f[0] << 24 | f[1] << 16 | f[2] << 8 | f[3];
+        len = f[6] << 8 | f[7];
+        if (len > GATEWAY_BUF - 8) {
+            return -1;
+        }
+        if (g->inlen - off < 8 + len) {
+            break;
+        }
+        off += 8 + len;
+        if (f[4] == GW_OPEN) {
+            opensession(g, session);
+            continue;
+        }
+        if ((p = findsession(g, session)) == NULL) {
+            // Nothing here by that number (any more), the gateway should know
+            if (f[4] != GW_CLOSE) {
+                sendframe(g, session, GW_CLOSE, NULL, 0);
+            }
+            continue;
+        }
+        if (f[4] == GW_CLOSE) {
+            // Whatever it hadn't got round to saying goes with it
+            p->vclosed = 1;
+            dropvin(p);
+            unpauseclient(p);
+        } else if (f[4] == GW_DATA) {
+            takevin(p);
+            // Anything past the staging buffer is dropped, like a long line
+            if (len > GATEWAY_INPUT - p->vinlen) {
+                len = GATEWAY_INPUT - p->vinlen;
+            }
+            memcpy(p->vin + p->vinlen, f + 8, len);
+            p->vinlen += len;
+        }
+        runsession(p);
+    }
+    memmove(g->in, g->in + off, g->inlen - off);
+    g->inlen -= off;
+    return 0;
+}
+
+/* fd came in on the unix socket and sent GATEWAY_MAGIC */
+static struct gateway *addgateway(int fd) {
+    struct gateway *g = malloc(sizeof(struct gateway));
+    if (!g) {
+        perror("malloc");
+        exit(1);
+    }
+    g->fd = fd;
+    g->inlen = 0;
+    g->nsessions = 0;
+    g->stalled = 0;
+    g->out = NULL;
+    g->outlen = g->outsize = 0;
+    g->next = gateways;
+    gateways = g;
+    printf("Gateway on fd %d\n", fd);
+    return g;
+}
+
+/* g's connection closed, every session behind it goes as if its own socket closed */
+static void removegateway(struct gateway *g) {
+    struct gateway **c;
+    struct client *p, *next;
+    printf("Gateway on fd %d gone with %d session(s)\n", g->fd, g->nsessions);
+    for (p = head; p && g->nsessions > 0; p = next) {
+        next = p->next;
+        if (p->gateway == g) {
+            p->vclosed = 1;
+            dropvin(p);
+            unpauseclient(p);
+            runsession(p);
+        }
+    }
+    // Whatever the sessions said on the way out has nowhere to go
+    FD_CLR(g->fd, &writeset);
+    for (c = &gateways; *c != g; c = &(*c)->next)
+        ;
+    *c = g->next;
+    free(g->out);
+    free(g);
+}
+
+/* write as much of the frames of every gateway in ready (every gateway
+ * without ready) as its socket takes without blocking, and cut off the
+ * ones that fell too far behind
+ */
+static void flushgateways(fd_set *ready) {
+    struct gateway *g, *next;
+    int n;
+    for (g = gateways; g; g = next) {
+        next = g->next;
+        if (!g->stalled && g->outlen > 0 && (ready == NULL || FD_ISSET(g->fd, ready))) {
+            n = send(g->fd, g->out, g->outlen, MSG_DONTWAIT);
+            nsyscalls++;
+            nsends++;
+            if (n > 0) {
+                memmove(g->out, g->out + n, g->outlen - n);
+                g->outlen -= n;
+                if (g->outlen == 0) {
+                    FD_CLR(g->fd, &writeset);
+                }
+            }
+        }
+        if (g->stalled) {
+            printf("Gateway on fd %d is too far behind, dropping it\n", g->fd);
+            n = g->fd;
+            FD_CLR(n, &allset);
+            removegateway(g);
+            close(n);
+        }
+    }
+}
+
+/* udp
+ * With -U, bots and simulations that would rather not hold a connection
+ * each play over UDP. Every datagram starts with a UDP_HEADER byte header:
+ * the session number the player picked (4 bytes), the datagram's sequence
+ * number (4), the sequence number the sender expects next from the other
+ * side (4), which acknowledges everything before it, and the type, all in
+ * network order. A session is known by its number and the address it came
+ * from, there is no handshake, so this is for networks we trust.
+ *
+ * Only DATA is numbered and resent. It is taken strictly in order: any
+ * other DATA, and DATA there is no room to stage, is thrown away and the
+ * next number acknowledged again, so the sender goes back to it. A session
+ * is an ordinary client without a socket, like a gateway's: its DATA is
+ * staged in vin for handleclient() and whatever is sent to it goes back as
+ * DATA. Datagrams come in with recvmmsg() and go out with sendmmsg(), up to
+ * UDP_BATCH in one call, at the same flush points as everything else.
+ */
+static struct udppeer *udptable[SESSION_BUCKETS];
+// Peers with DATA that hasn't been acknowledged, which udptimer() looks at,
+// and peers owed an acknowledgement that no DATA has carried yet
+static struct udppeer *udpunacked = NULL;
+static struct udppeer *udpacking = NULL;
+// Datagrams waiting for the next sendmmsg(), each holding a ref on its text
+struct udpslot {
+    struct sockaddr_in addr;
+    unsigned char hdr[UDP_HEADER];
+    struct iovec iov[2];
+    struct spectmsg *msg;
+};
+static struct udpslot udpslots[UDP_BATCH];
+static struct mmsghdr udpout[UDP_BATCH];
+static int nudpout = 0;
+
+static unsigned int get32(const unsigned char *b) {
+    return (unsigned int)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+}
+
+static void put32(unsigned char *b, unsigned int v) {
+    b[0] = v >> 24;
+    b[1] = v >> 16;
+    b[2] = v >> 8;
+    b[3] = v;
+}
+
+static unsigned int udpbucket(const struct sockaddr_in *addr, unsigned int session) {
+    unsigned int h = session ^ addr->sin_addr.s_addr ^ (unsigned int)addr->sin_port << 16;
+    return (h * 2654435761u >> 16) % SESSION_BUCKETS;
+}
+
+static struct udppeer *findudp(const struct sockaddr_in *addr, unsigned int session) {
+    struct udppeer *u;
+    for (u = udptable[udpbucket(addr, session)]; u; u = u->hnext) {
+        if (u->session == session && u->addr.sin_addr.s_addr == addr->sin_addr.s_addr
+            && u->addr.sin_port == addr->sin_port) {
+            return u;
+        }
+    }
+    return NULL;
+}
+
+/* write every datagram queued so far, in as few sendmmsg() calls as it takes */
+static void sendudpbatch(void) {
+    int i, n, off = 0;
+    while (off < nudpout) {
+        n = sendmmsg(udpfd, udpout + off, nudpout - off, MSG_DONTWAIT);
+        nsyscalls++;
+        nsends++;
+        if (n > 0) {
+            off += n;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // No room: the rest is lost like any datagram, DATA gets resent
+            break;
+        } else if (n < 0 && errno != EINTR) {
+            // Only that one is refused, the rest may go
+            off++;
+        }
+    }
+    for (i = 0; i < nudpout; i++) {
+        if (udpslots[i].msg != NULL) {
+            unrefmsg(udpslots[i].msg);
+            udpslots[i].msg = NULL;
+        }
+    }
+    nudpout = 0;
+}
+
+/* queue a datagram of type for session at addr, with seq and ack in its
+ * header and the text of msg (if any) after it. It goes out at the next
+ * flush point, or right away if it fills the batch.
+ */
+static void queueudp(const struct sockaddr_in *addr, unsigned int session, int type,
+                     unsigned int seq, unsigned int ack, struct spectmsg *msg) {
+    struct udpslot *s = &udpslots[nudpout];
+    struct msghdr *h = &udpout[nudpout].msg_hdr;
+    s->addr = *addr;
+    put32(s->hdr, session);
+    put32(s->hdr + 4, seq);
+    put32(s->hdr + 8, ack);
+    s->hdr[12] = type;
+    s->iov[0].iov_base = s->hdr;
+    s->iov[0].iov_len = UDP_HEADER;
+    s->msg = msg;
+    if (msg != NULL) {
+        msg->refs++;
+        s->iov[1].iov_base = msg->data;
+        s->iov[1].iov_len = msg->len;
+    }
+    memset(h, 0, sizeof(*h));
+    h->msg_name = &s->addr;
+    h->msg_namelen = sizeof(s->addr);
+    h->msg_iov = s->iov;
+    h->msg_iovlen = msg != NULL ? 2 : 1;
+    if (++nudpout == UDP_BATCH) {
+        sendudpbatch();
+    }
+}
+
+/* u is to acknowledge what it has got at the next flush point, unless DATA for it does first */
+static void wantack(struct udppeer *u) {
+    u->acking = 1;
+    if (!u->onacks) {
+        u->onacks = 1;
+        u->ack_next = udpacking;
+        udpacking = u;
+    }
+}
+
+static void rtxoff(struct udppeer *u) {
+    if (u->rtx_prev) {
+        u->rtx_prev->rtx_next = u->rtx_next;
+    } else {
+        udpunacked = u->rtx_next;
+    }
+    if (u->rtx_next) {
+        u->rtx_next->rtx_prev = u->rtx_prev;
+    }
+    u->rtx_prev = u->rtx_next = NULL;
+}
+
+/* sendclient() for a UDP session: s in DATA datagrams, each kept until it
+ * is acknowledged
+ * returns -1 if the player is too far behind to take it
+ */
+static int sendudp(struct client *p, const char *s, int len) {
+    struct udppeer *u = p->udp;
+    struct spectmsg *msg;
+    int n, sent;
+    for (sent = 0; sent < len; sent += n) {
+        if (u->nextout - u->acked >= UDP_WINDOW) {
+            // It has stopped acknowledging, udptimer() lets go of it
+            u->stalled = 1;
+            return -1;
+        }
+        n = len - sent > UDP_PAYLOAD ? UDP_PAYLOAD : len - sent;
+        msg = newmsg(s + sent, n);
+        if (u->acked == u->nextout) {
+            // The first since everything was acknowledged, the clock starts now
+            u->sentat = now();
+            u->retries = 0;
+            u->rtx_prev = NULL;
+            u->rtx_next = udpunacked;
+            if (udpunacked) {
+                udpunacked->rtx_prev = u;
+            }
+            udpunacked = u;
+        }
+        u->unacked[u->nextout % UDP_WINDOW] = msg;
+        // (it carries the acknowledgement too)
+        queueudp(&u->addr, u->session, UDP_DATA, u->nextout++, u->nextin, msg);
+        u->acking = 0;
+    }
+    return len;
+}
+
+/* the peer of u expects ack next from us, so it has everything before that */
+static void udpacked(struct udppeer *u, unsigned int ack) {
+    // (an old acknowledgement, or one for DATA that hasn't gone yet, is ignored)
+    if (ack == u->acked || ack - u->acked > u->nextout - u->acked) {
+        return;
+    }
+    while (u->acked != ack) {
+        unrefmsg(u->unacked[u->acked % UDP_WINDOW]);
+        u->unacked[u->acked % UDP_WINDOW] = NULL;
+        u->acked++;
+    }
+    u->retries = 0;
+    u->sentat = now();
+    if (u->acked == u->nextout) {
+        rtxoff(u);
+    }
+}
+
+/* p isn't a UDP session any more: tell the player, in case they are still
+ * there, and forget them
+ */
+static void dropudp(struct client *p) {
+    struct udppeer *u = p->udp, **c;
+    if (u == NULL) {
+        return;
+    }
+    queueudp(&u->addr, u->session, UDP_CLOSE, u->nextout, u->nextin, NULL);
+    for (c = &udptable[udpbucket(&u->addr, u->session)]; *c != u; c = &(*c)->hnext)
+        ;
+    *c = u->hnext;
+    if (u->onacks) {
+        for (c = &udpacking; *c != u; c = &(*c)->ack_next)
+            ;
+        *c = u->ack_next;
+    }
+    if (u->acked != u->nextout) {
+        rtxoff(u);
+    }
+    while (u->acked != u->nextout) {
+        unrefmsg(u->unacked[u->acked++ % UDP_WINDOW]);
+    }
+    free(u);
+    p->udp = NULL;
+    dropvin(p);
+    p->vclosed = 0;
+}
+
+/* the UDP session of new takes over old, which has been waiting for a resume */
+static void moveudp(struct client *old, struct client *new) {
+    dropvin(old);
+    old->binary = 0;
+    old->vin = new->vin;
+    old->vinlen = new->vinlen;
+    new->vin = NULL;
+    new->vinlen = 0;
+    old->udp = new->udp;
+    old->udp->client = old;
+    new->udp = NULL;
+    heard(old);
+}
+
+/* the player behind p is gone, p goes as if its socket had closed */
+static void lostudp(struct client *p) {
+    p->vclosed = 1;
+    dropvin(p);
+    unpauseclient(p);
+    runsession(p);
+}
+
+/* the first datagram of session from addr */
+static void openudp(const struct sockaddr_in *addr, unsigned int session) {
+    struct udppeer *u = calloc(1, sizeof(struct udppeer));
+    unsigned int b = udpbucket(addr, session);
+    struct client *p;
+    if (!u) {
+        perror("calloc");
+        exit(1);
+    }
+    u->addr = *addr;
+    u->session = session;
+    u->hnext = udptable[b];
+    udptable[b] = u;
+    head = addclient(head, -1, addr->sin_addr);
+    p = head;
+    p->udp = u;
+    u->client = p;
+    heard(p);
+    // addclient() couldn't ask without a way to reach p
+    sendclient(p, "What is your name?\n", 19);
+    statedirty = 1;
+}
+
+/* one datagram of len bytes from addr */
+static void takeudp(const struct sockaddr_in *addr, const unsigned char *d, int len) {
+    unsigned int session, seq;
+    struct udppeer *u;
+    struct client *p;
+    int type;
+    if (len < UDP_HEADER) {
+        return;
+    }
+    session = get32(d);
+    seq = get32(d + 4);
+    type = d[12];
+    if ((u = findudp(addr, session)) == NULL) {
+        if (type == UDP_OPEN) {
+            openudp(addr, session);
+        } else if (type != UDP_CLOSE) {
+            // Nothing here by that number (any more), the player should know
+            queueudp(addr, session, UDP_CLOSE, 0, 0, NULL);
+        }
+        return;
+    }
+    p = u->client;
+    udpacked(u, get32(d + 8));
+    heard(p);
+    len -= UDP_HEADER;
+    if (type == UDP_CLOSE) {
+        // Whatever it hadn't got round to saying goes with it
+        p->vclosed = 1;
+        dropvin(p);
+        unpauseclient(p);
+    } else if (type == UDP_DATA) {
+        if (seq == u->nextin && len <= GATEWAY_INPUT - p->vinlen) {
+            if (len > 0) {
+                takevin(p);
+                memcpy(p->vin + p->vinlen, d + UDP_HEADER, len);
+                p->vinlen += len;
+            }
+            u->nextin++;
+        }
+        wantack(u);
+    } else if (type == UDP_PING || type == UDP_OPEN) {
+        // (an OPEN again is the player still waiting to hear from us)
+        wantack(u);
+    }
+    runsession(p);
+}
+
+/* read as many datagrams as one recvmmsg() gets and hand them to their sessions
+ * returns how many there were
+ */
+static int readudp(void) {
+    static unsigned char in[UDP_BATCH][UDP_HEADER + UDP_PAYLOAD];
+    static struct sockaddr_in from[UDP_BATCH];
+    static struct iovec iov[UDP_BATCH];
+    static struct mmsghdr msgs[UDP_BATCH];
+    int i, n;
+    for (i = 0; i < UDP_BATCH; i++) {
+        iov[i].iov_base = in[i];
+        iov[i].iov_len = sizeof(in[i]);
+        memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+        msgs[i].msg_hdr.msg_name = &from[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    n = recvmmsg(udpfd, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+    nsyscalls++;
+    for (i = 0; i < n; i++) {
+        // (one too long for a datagram of ours is cut short, and no use)
+        if (!(msgs[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+            takeudp(&from[i], in[i], msgs[i].msg_len);
+        }
+    }
+    return n > 0 ? n : 0;
+}
+
+/* a flush point for UDP: acknowledge what no DATA has, then send the lot */
+static void flushudp(void) {
+    struct udppeer *u;
+    while ((u = udpacking) != NULL) {
+        udpacking = u->ack_next;
+        u->ack_next = NULL;
+        u->onacks = 0;
+        if (u->acking) {
+            u->acking = 0;
+            queueudp(&u->addr, u->session, UDP_ACK, u->nextout, u->nextin, NULL);
+        }
+    }
+    if (nudpout > 0) {
+        sendudpbatch();
+    }
+}
+
+/* every UDP_TICK_MS, send again whatever has waited too long for an
+ * acknowledgement, and let go of the players who stopped answering
+ */
+static void udptimer(void *arg) {
+    struct udppeer *u, *next;
+    long long t = now();
+    unsigned int seq;
+    addtimer(UDP_TICK_MS, udptimer, NULL);
+    for (u = udpunacked; u; u = next) {
+        next = u->rtx_next;
+        if (!u->stalled && t - u->sentat < (long long)UDP_RTO_MS << u->retries) {
+            continue;
+        }
+        if (u->stalled || u->retries == UDP_RETRIES) {
+            printf("No acknowledgement from %s, dropping them\n",
+                   u->client->named ? u->client->name : inet_ntoa(u->addr.sin_addr));
+            totalreaped++;
+            // (this takes u off the list)
+            lostudp(u->client);
+            statedirty = 1;
+            continue;
+        }
+        // Go back to the oldest one and send the lot again
+        for (seq = u->acked; seq != u->nextout; seq++) {
+            queueudp(&u->addr, u->session, UDP_DATA, seq, u->nextin, u->unacked[seq % UDP_WINDOW]);
+        }
+        u->acking = 0;
+        u->retries++;
+        u->sentat = t;
+    }
+}
+
+/* binary protocol
+ * A client that opens with PROTO_MAGIC talks in battleproto.h frames. Its
+ * frames are turned back into the lines the text protocol would have sent
+ * (a move frame becomes "a2\n") and staged in vin, so handleclient() runs
+ * the game for both protocols. On the way out, turnupdate() and playmove()
+ * stage fixed-layout state and move frames in place of the health lines,
+ * the menu and the move descriptions, and sendclient() sends those with
+ * the rest of the message in a text frame.
+ */
+
+/* put the frame f of len bytes in front of p's next write */
+static void stageframe(struct client *p, const unsigned char *f, int len) {
+    if (p->nframes + len > PROTO_PENDING) {
+        sendbinary(p, NULL, 0);
+    }
+    memcpy(p->frames + p->nframes, f, len);
+    p->nframes += len;
+}
+
+/* turnupdate() for a binary client
+ * returns 0, nothing goes in the text
+ */
+static int stagestate(struct client *p) {
+    unsigned char f[PROTO_HEADER + PROTO_STATE_LEN];
+    struct proto_state st;
+    struct match *m = p->match;
+    int i;
+    st.seat = p->seat;
+    st.turn = m->turn;
+    st.size = m->size;
+    st.mode = m->mode;
+    st.power_moves = p->power_moves;
+    for (i = 0; i < PROTO_SEATS; i++) {
+        st.health[i] = i < m->size && m->players[i] != NULL ? m->players[i]->health : -1;
+    }
+    stageframe(p, f, proto_encode_state(f, &st));
+    return 0;
+}
+
+/* describemove() for a binary client q: p's move on the player in seat target
+ * returns 0, nothing goes in the text
+ */
+static int stagemove(struct client *q, struct client *p, int target, char move, int dmg) {
+    unsigned char f[PROTO_HEADER + PROTO_MOVE_LEN];
+    struct proto_move mv;
+    mv.seat = p->seat;
+    mv.target = target;
+    mv.move = move;
+    mv.damage = dmg;
+    stageframe(q, f, proto_encode_move(f, &mv));
+    return 0;
+}
+
+/* sendclient() for a binary client: the frames staged for p, then s in a
+ * text frame, in one message
+ */
+static int sendbinary(struct client *p, const char *s, int len) {
+    unsigned char hdr[PROTO_HEADER];
+    struct spectmsg *msg;
+    struct iovec iov[3];
+    int n = 0, i, off, total;
+    // Anything too long for one frame goes in pieces
+    while (len > 0xffff) {
+        if (sendbinary(p, s, 0xffff) < 0) {
+            return -1;
+        }
+        s += 0xffff;
+        len -= 0xffff;
+    }
+    if (p->nframes > 0) {
+        iov[n].iov_base = p->frames;
+        iov[n++].iov_len = p->nframes;
+    }
+    if (len > 0) {
+        iov[n].iov_base = hdr;
+        iov[n++].iov_len = proto_header(hdr, PROTO_TEXT, len);
+        iov[n].iov_base = (char *)s;
+        iov[n++].iov_len = len;
+    }
+    for (i = 0, total = 0; i < n; i++) {
+        total += iov[i].iov_len;
+    }
+    if (total == 0) {
+        return 0;
+    }
+    // Queued for the next flush point, as for a text client
+    msg = newmsg(NULL, total);
+    for (i = 0, off = 0; i < n; off += iov[i].iov_len, i++) {
+        memcpy(msg->data + off, iov[i].iov_base, iov[i].iov_len);
+    }
+    msg->framed = 1;
+    queueoutput(p, msg);
+    unrefmsg(msg);
+    p->nframes = 0;
+    return len;
+}
+
+/* read what p's socket has into fin, then decode and run the whole frames
+ * A frame that isn't whole yet waits in fin for the rest, whatever vin has
+ * no room for waits until the session has used up what is there.
+ * returns what handleclient() returned
+ */
+static int readbinary(struct client *p) {
+    int n;
+    takefin(p);
+    nsyscalls++;
+    if ((n = read(p->fd, p->fin + p->finlen, PROTO_MAXIN - p->finlen)) <= 0) {
+        // Gone: handleclient() treats it as gone once vin runs dry
+        p->vclosed = 1;
+    } else {
+        p->finlen += n;
+        p->bytesin.level -= n * 1000LL;
+    }
+    return runbinary(p);
+}
+
+/* decode the whole frames at the front of fin into vin, as many as fit
+ * returns how many there were, pings included
+ */
+static int stageframes(struct client *p) {
+    unsigned char pong[PROTO_HEADER];
+    const unsigned char *f;
+    char line[8];
+    const char *text;
+    int len, type, plen, off = 0, nframes = 0;
+
+    while ((len = proto_frame(p->fin + off, p->finlen - off, PROTO_MAXIN, &type, &plen)) != 0) {
+        f = p->fin + off + PROTO_HEADER;
+        text = (const char *)f;
+        if (len > 0 && (type == PROTO_PING || type == PROTO_PONG) && plen == 0) {
+            // Nothing for the session, a ping just wants its pong
+            if (type == PROTO_PING) {
+                stageframe(p, pong, proto_header(pong, PROTO_PONG, 0));
+                sendbinary(p, NULL, 0);
+            }
+            off += len;
+            nframes++;
+            continue;
+        }
+        if (len < 0 || (type != PROTO_TEXT && type != PROTO_MOVE) || (type == PROTO_MOVE && plen != 2)) {
+            // Talking nonsense, it goes once vin runs dry
+            p->vclosed = 1;
+            break;
+        }
+        if (type == PROTO_MOVE) {
+            // A move is typed as its letter and the seat number to hit
+            plen = f[1] == PROTO_ANY ? sprintf(line, "%c", f[0]) : sprintf(line, "%c%d", f[0], f[1] + 1);
+            text = line;
+        }
+        if (plen + 1 > GATEWAY_INPUT - p->vinlen) {
+            break;
+        }
+        takevin(p);
+        memcpy(p->vin + p->vinlen, text, plen);
+        p->vin[p->vinlen + plen] = '\n';
+        p->vinlen += plen + 1;
+        off += len;
+        nframes++;
+    }
+    if (nframes > 0) {
+        // Only a whole frame says the client is still there
+        heard(p);
+    }
+    memmove(p->fin, p->fin + off, p->finlen - off);
+    p->finlen -= off;
+    if (p->finlen == 0) {
+        dropfin(p);
+    }
+    return nframes;
+}
+
+/* decode p's frames and feed them to handleclient() until they are used
+ * up, p is paused or handleclient() has something for settleclient() to do
+ */
+static int runbinary(struct client *p) {
+    int result = 0;
+    while (result == 0 && !p->paused) {
+        if (p->finlen > 0) {
+            stageframes(p);
+        }
+        if (p->vinlen == 0 && !p->vclosed) {
+            break;
+        }
+        result = handleclient(p, head);
+    }
+    return result;
+}
+
+/* drop every suspended client whose deadline has passed */
+static void expiretimer(void *arg) {
+    struct client *s, *next;
+    long long t_now = now();
+    for (s = suspendedlist; s; s = next) {
+        next = s->suspend_next;
+        if (s->resume_deadline <= t_now) {
+            printf("Gave up on %s\n", s->name);
+            forfeit(s);
+            head = removeclient(head, s);
+            statedirty = 1;
+        }
+    }
+}
+
+/* input rate limits
+ * Every client has a token bucket for bytes and one for commands. A client
+ * that runs out of bytes is taken out of allset, so it costs nothing until a
+ * timer puts it back. Commands over the limit are thrown away on the spot.
+ */
+static struct client *pausedlist = NULL;
+
+/* top the bucket up for the time since it was last looked at, returns the level */
+static long long refill(struct bucket *b, int rate, int burst) {
+    long long t = now();
+    // rate tokens a second is rate thousandths of a token a millisecond
+    b->level += (t - b->last) * rate;
+    if (b->level > burst * 1000LL) {
+        b->level = burst * 1000LL;
+    }
+    b->last = t;
+    return b->level;
+}
+
+static void initlimits(struct client *p) {
+    p->bytesin.level = cfg()->bytes_burst * 1000LL;
+    p->bytesin.last = now();
+    p->commands.level = cfg()->commands_burst * 1000LL;
+    p->commands.last = p->bytesin.last;
+    p->paused = 0;
+    p->paused_next = NULL;
+}
+
+/* returns 1 if p has no bytes left to spend */
+static int overbytes(struct client *p) {
+    return refill(&p->bytesin, cfg()->bytes_per_sec, cfg()->bytes_burst) < 1000;
+}
+
+/* make sure p has staged input, reading what its socket has into vin in
+ * one go if it is a text client, whatever arrives is charged to p's byte
+ * bucket (a big read may leave it in debt, which just pauses p for longer)
+ * returns how much is staged, 0 once p's input is closed, -1 if a socket
+ * turned out to have nothing after all
+ */
+static int stageinput(struct client *p) {
+    int len;
+    if (p->vinlen > 0) {
+        return p->vinlen;
+    }
+    if (p->fd < 0 || p->binary) {
+        // A gateway session or a binary client, 0 once its input has run out
+        // after the gateway or the socket let go of it
+        return 0;
+    }
+    takevin(p);
+    len = recv(p->fd, p->vin, GATEWAY_INPUT, MSG_DONTWAIT);
+    nsyscalls++;
+    if (len <= 0) {
+        dropvin(p);
+        return len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? -1 : 0;
+    }
+    p->vinlen = len;
+    p->bytesin.level -= len * 1000LL;
+    return len;
+}
+
+/* p has used the first len bytes of its staged input */
+static void takeinput(struct client *p, int len) {
+    memmove(p->vin, p->vin + len, p->vinlen - len);
+    p->vinlen -= len;
+    if (p->fd < 0) {
+        // A session pays as its input is used, a socket's was charged as it was read
+        p->bytesin.level -= len * 1000LL;
+    }
+    if (p->vinlen == 0) {
+        dropvin(p);
+    }
+}
+
+/* read up to size bytes of p's input */
+static int readclient(struct client *p, char *buf, int size) {
+    int len;
+    if (p->bot) {
+        // A bot's input is the move botturn() picked
+        if (p->botmove == '\0' || size < 1) {
+            errno = EAGAIN;
+            return -1;
+        }
+        buf[0] = p->botmove;
+        p->botmove = '\0';
+        return 1;
+    }
+    if ((len = stageinput(p)) <= 0) {
+        return len;
+    }
+    len = len < size ? len : size;
+    memcpy(buf, p->vin, len);
+    takeinput(p, len);
+    return len;
+}
+
+/* charge one command to p
+ * returns 1 if p may go ahead, 0 if the command has to be dropped
+ */
+static int takecommand(struct client *p) {
+    char outbuf[128];
+    if (refill(&p->commands, cfg()->commands_per_sec, cfg()->commands_burst) < 1000) {
+        p->ndropped++;
+        totaldropped++;
+        // Only say so once per burst, or the warnings become the spam
+        if ((p->ndropped - 1) % cfg()->commands_burst == 0) {
+            sprintf(outbuf, "Slow down! Some of your input was ignored.\n");
+            sendclient(p, outbuf, strlen(outbuf));
+        }
+        return 0;
+    }
+    p->commands.level -= 1000;
+    return 1;
+}
+
+static void unpausetimer(void *arg);
+
+/* stop watching p's socket until its byte bucket has refilled */
+static void pauseclient(struct client *p) {
+    if (p->paused) {
+        return;
+    }
+    if (p->fd >= 0) {
+        FD_CLR(p->fd, &allset);
+    }
+    p->paused = 1;
+    p->npauses++;
+    totalpauses++;
+    p->paused_next = pausedlist;
+    pausedlist = p;
+    // time until there is a whole byte to spend again
+    addtimer((1000 - p->bytesin.level) / cfg()->bytes_per_sec + 1, unpausetimer, NULL);
+}
+
+static void unpauseclient(struct client *p) {
+    struct client **c;
+    if (!p->paused) {
+        return;
+    }
+    for (c = &pausedlist; *c != p; c = &(*c)->paused_next)
+        ;
+    *c = p->paused_next;
+    p->paused_next = NULL;
+    p->paused = 0;
+    if (p->fd >= 0) {
+        FD_SET(p->fd, &allset);
+    }
+}
+
+/* put back every paused client that can afford to be read again */
+static void unpausetimer(void *arg) {
+    struct client *c, *next;
+    long long wait = -1;
+    for (c = pausedlist; c; c = next) {
+        next = c->paused_next;
+        if (!overbytes(c)) {
+            unpauseclient(c);
+            // A session's input is waiting in vin, no select() will say so
+            if (c->gateway != NULL || c->udp != NULL) {
+                runsession(c);
+            }
+            else if (c->binary && c->fd >= 0) {
+                settleclient(c, runbinary(c));
+            }
+            else if (c->fd >= 0 && c->vinlen > 0) {
+                settleclient(c, readtext(c));
+            }
+        }
+        else if (wait < 0 || (1000 - c->bytesin.level) / cfg()->bytes_per_sec + 1 < wait) {
+            wait = (1000 - c->bytesin.level) / cfg()->bytes_per_sec + 1;
+        }
+    }
+    if (wait >= 0) {
+        addtimer(wait, unpausetimer, NULL);
+    }
+}
+
+/* heartbeats
+ * The kernel's keepalives find TCP peers that went away without a word.
+ * With -p binary clients are pinged as well: each waits on a timing wheel
+ * in the slot for the second it is next due to be looked at, so a tick
+ * only sees the clients due in it, however many there are. Hearing from a
+ * client just moves lastheard, it goes to its new slot when the old one
+ * comes round.
+ */
+static struct client *wheel[BEAT_SLOTS];
+static long long wheelsec = -1; // the last second the wheel was turned to
+static int wheelturning = 0;    // beattimer() is on its way
+
+/* have the kernel probe the TCP socket fd when it has been quiet */
+static void setkeepalive(int fd) {
+    const struct config *c = cfg();
+    int yes = 1, timeout;
+    if (c->keepidle <= 0) {
+        return;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes)) < 0
+        || setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &c->keepidle, sizeof(int)) < 0
+        || setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &c->keepintvl, sizeof(int)) < 0
+        || setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &c->keepcnt, sizeof(int)) < 0) {
+        perror("setsockopt keepalive");
+    }
+#ifdef TCP_USER_TIMEOUT
+    // There are no keepalives while output is unacknowledged, give that as long
+    timeout = (c->keepidle + c->keepintvl * c->keepcnt) * 1000;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(int)) < 0) {
+        perror("setsockopt TCP_USER_TIMEOUT");
+    }
+#else
+    (void)timeout;
+#endif
+}
+
+/* put p on the wheel to be looked at in the second of due (ms on the now()
+ * clock), or in the next one if that has gone by
+ */
+static void wheelput(struct client *p, long long due) {
+    long long sec = due / 1000;
+    if (wheelsec >= 0 && sec <= wheelsec) {
+        sec = wheelsec + 1;
+    }
+    p->beatslot = sec % BEAT_SLOTS;
+    p->beat_prev = NULL;
+    p->beat_next = wheel[p->beatslot];
+    if (p->beat_next) {
+        p->beat_next->beat_prev = p;
+    }
+    wheel[p->beatslot] = p;
+    p->beating = 1;
+}
+
+static void wheeloff(struct client *p) {
+    if (!p->beating) {
+        return;
+    }
+    if (p->beat_prev) {
+        p->beat_prev->beat_next = p->beat_next;
+    } else {
+        wheel[p->beatslot] = p->beat_next;
+    }
+    if (p->beat_next) {
+        p->beat_next->beat_prev = p->beat_prev;
+    }
+    p->beat_prev = p->beat_next = NULL;
+    p->beating = 0;
+}
+
+/* something came from p, or p just started speaking the binary protocol
+ * (or over UDP)
+ */
+static void heard(struct client *p) {
+    p->lastheard = now();
+    p->pinged = 0;
+    if (cfg()->heartbeat > 0 && !p->beating && ((p->binary && p->fd >= 0) || p->udp != NULL)) {
+        wheelput(p, p->lastheard + cfg()->heartbeat * 1000LL);
+    }
+}
+
+/* p's slot came round: wait some more, ping it, or give up on it */
+static void beatcheck(struct client *p) {
+    unsigned char f[PROTO_HEADER];
+    int heartbeat = cfg()->heartbeat;
+    long long due;
+    if ((p->udp == NULL && (p->fd < 0 || !p->binary)) || heartbeat == 0) {
+        // Lost its socket (a resume puts it back), or the heartbeat is off
+        return;
+    }
+    due = p->lastheard + heartbeat * 1000LL * (p->pinged ? 2 : 1);
+    if (due / 1000 > wheelsec) {
+        wheelput(p, due);
+    } else if (!p->pinged) {
+        p->pinged = 1;
+        if (p->udp != NULL) {
+            queueudp(&p->udp->addr, p->udp->session, UDP_PING, p->udp->nextout, p->udp->nextin, NULL);
+        } else {
+            stageframe(p, f, proto_header(f, PROTO_PING, 0));
+            sendbinary(p, NULL, 0);
+        }
+        wheelput(p, p->lastheard + heartbeat * 2000LL);
+    } else {
+        // Gone as far as we are concerned, the way a closed socket would be
+        printf("No word from %s in %d seconds, dropping them\n",
+               p->named ? p->name : inet_ntoa(p->ipaddr), heartbeat * 2);
+        totalreaped++;
+        if (p->udp != NULL) {
+            lostudp(p);
+        } else {
+            p->vclosed = 1;
+            settleclient(p, runbinary(p));
+        }
+        statedirty = 1;
+    }
+}
+
+/* every second, turn the wheel on to now and look at everyone due */
+static void beattimer(void *arg) {
+    struct client *p, *next;
+    long long t = now(), sec = t / 1000;
+    int slot;
+    if (cfg()->heartbeat == 0) {
+        // Turned off by a reload, whoever is on the wheel just stays there
+        wheelturning = 0;
+        return;
+    }
+    addtimer(1000 - t % 1000, beattimer, NULL);
+    // (a long stall is one full turn, every slot once)
+    if (wheelsec < 0 || sec - wheelsec > BEAT_SLOTS) {
+        wheelsec = sec - (wheelsec < 0 ? 1 : BEAT_SLOTS);
+    }
+    while (wheelsec < sec) {
+        wheelsec++;
+        slot = wheelsec % BEAT_SLOTS;
+        p = wheel[slot];
+        wheel[slot] = NULL;
+        for (; p != NULL; p = next) {
+            next = p->beat_next;
+            p->beat_prev = p->beat_next = NULL;
+            p->beating = 0;
+            beatcheck(p);
+        }
+    }
+}
+
+/* start turning the wheel if the configuration asks for a heartbeat */
+static void startbeats(void) {
+    if (cfg()->heartbeat > 0 && !wheelturning) {
+        wheelturning = 1;
+        addtimer(1000, beattimer, NULL);
+    }
+}
+
+/* bots
+ * Whoever has been at the front of a room's queue for BOT_WAIT_SECONDS gets
+ * a bot to play. A bot is a client without a socket: its moves are fed to
+ * handleclient() from a timer and anything sent to it is dropped before it
+ * reaches a syscall, so a bot match costs a struct and a few timers rather
+ * than a connection. Bots leave after their match and the structs are kept
+ * for the next ones, which also means a timer can always look at its bot.
+ */
+static struct client *botpool = NULL;  // bots ready for reuse, linked through next
+static struct client *retiring = NULL; // bots done with their match, linked through bot_next
+static int nbots = 0;
+static int botserial = 0;
+
+static void botturn(void *arg);
+static void retiretimer(void *arg);
+
+/* make up a bot for the same kind of match as p, waiting in room r */
+static void spawnbot(struct room *r, struct client *p) {
+    char name[32];
+    struct client *b;
+    int pending = 0;
+    if (botpool) {
+        b = botpool;
+        botpool = b->next;
+        // a timer from its last match may still be on its way
+        pending = b->botpending;
+    } else if ((b = malloc(sizeof(struct client))) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memset(b, 0, sizeof(struct client));
+    b->name = noname;
+    addref(b);
+    b->fd = -1;
+    b->seat = -1;
+    b->mode = p->mode;
+    b->nseats = p->nseats;
+    b->bot = 1;
+    b->botpending = pending;
+    // Players can call themselves Bot-something too
+    do {
+        sprintf(name, "Bot-%d", ++botserial);
+    } while (findname(name) != NULL);
+    setname(b, name);
+    addname(b);
+    initlimits(b);
+    b->next = head;
+    if (head) {
+        head->prev = b;
+    }
+    head = b;
+    nbots++;
+    joinroom(b, r);
+    b->state = LOOKING_FOR_MATCH;
+    printf("Spawned %s in %s (%d bots)\n", b->name, r->name, nbots);
+    // Bigger matches take a few bots, the ones before the last just wait
+    enqueue(b);
+    findmatch(b);
+}
+
+/* get a move out of p in bot_think_ms */
+static void schedulebot(struct client *p) {
+    if (p->botpending) {
+        return;
+    }
+    p->botpending = 1;
+    addtimer(cfg()->bot_think_ms, botturn, p);
+}
+
+static void botturn(void *arg) {
+    struct client *b = arg;
+    b->botpending = 0;
+    if (b->botretiring || b->state != IN_MATCH_ATTACK) {
+        return;
+    }
+    if (matchheld(b->match) != NULL) {
+        // Wait for them to come back, it isn't fair otherwise
+        schedulebot(b);
+        return;
+    }
+    // The target is left to handleclient(), the next enemy in turn order
+    b->botmove = (b->power_moves > 0 && gamerand() % 2) ? 'p' : 'a';
+    handleclient(b, head);
+    statedirty = 1;
+}
+
+/* b is back in the lobby, take it away once whoever is using it is done */
+static void retirebot(struct client *b) {
+    if (b->botretiring) {
+        return;
+    }
+    b->botretiring = 1;
+    b->bot_next = retiring;
+    retiring = b;
+    addtimer(0, retiretimer, NULL);
+}
+
+static void retiretimer(void *arg) {
+    struct client *b;
+    while ((b = retiring) != NULL) {
+        retiring = b->bot_next;
+        leaveroom(b);
+        dropname(b);
+        setname(b, "");
+        b->inputLength = 0;
+        dropline(b);
+        head = unlinkclient(head, b);
+        // Whoever it played shouldn't take the next bot for it
+        dropref(b);
+        b->next = botpool;
+        botpool = b;
+        nbots--;
+    }
+}
+
+/* once a second, find anyone who has waited too long */
+static void bottimer(void *arg) {
+    struct room *r;
+    struct client *q;
+    long long t_now = now();
+    int i, n;
+    addtimer(1000, bottimer, NULL);
+    for (i = 0; i < ROOM_BUCKETS; i++) {
+        for (r = roomtable[i]; r; r = r->hnext) {
+            // the longest waiting player who is actually there
+            for (q = r->queue_head; q && (q->suspended || q->bot); q = q->queue_next)
+                ;
+            if (q == NULL || t_now - q->queued_at < cfg()->bot_wait_seconds * 1000LL) {
+                continue;
+            }
+            // as many bots as it takes to fill their match
+            for (n = 1; n < q->nseats && q->queued; n++) {
+                spawnbot(r, q);
+            }
+        }
+    }
+}
+
+/* client records
+ * The client list is flattened into an array of records for hot upgrades
+ * and snapshots. Pointers between clients become indexes into the array.
+ */
+struct handoff_header {
+    int magic;
+    int recsize;    // sizeof(struct handoff_record), records from another build are refused
+    int nclients;
+    unsigned int rngstate;
+};
+
+struct handoff_record {
+    struct in_addr ipaddr;
+    int connected;  // 1 if the client's socket travels with the record
+    int binary;     // ... and speaks the binary protocol
+    int bot;
+    int lastplayed; // index of the last opponent's record, -1 if they are gone
+    int mode;       // the kind of match the client is looking for
+    int nseats;
+    int seat;       // seat in its match, -1 if not in a match
+    int matchmode;  // the match itself, the same in every player's record
+    int matchsize;
+    int turn;
+    int matchmoves;
+    unsigned int matchleft;
+    int players[MATCH_MAX]; // index of the record in each seat, -1 for an empty one
+    char seatname[MATCH_MAX][256]; // who sat where, for the history
+    int queuepos;   // place in the room queues, -1 if not queued
+    int state;
+    int game_state;
+    int health;
+    int power_moves;
+    int on_mute;
+    int inputLength;
+    long long resume_deadline;
+    char token[TOKEN_LEN + 1];
+    char name[LINE_LEN];
+    char inputBuffer[LINE_LEN];
+    char room[ROOM_NAME_MAX];
+    int vinlen;     // input read off the socket that wasn't acted on yet
+    char vin[GATEWAY_INPUT];
+    int finlen;     // ... and what a binary client's socket delivered that wasn't decoded
+    unsigned char fin[PROTO_MAXIN];
+};
+
+/* slot of c in a pointer hash table of size mask + 1 (linear probing) */
+static int ptrslot(struct client **keys, int mask, struct client *c) {
+    int i = (int)(((unsigned long)c >> 4) * 2654435761u) & mask;
+    while (keys[i] != NULL && keys[i] != c) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/* fill in rec for p, except for what points at other clients: its match's
+ * seats and lastplayed are left empty and it isn't queued
+ */
+static void packrecord(struct handoff_record *rec, struct client *p) {
+    int j;
+    memset(rec, 0, sizeof(*rec));
+    rec->ipaddr = p->ipaddr;
+    rec->connected = p->fd >= 0;
+    rec->binary = p->binary && p->fd >= 0;
+    rec->bot = p->bot;
+    rec->mode = p->mode;
+    rec->nseats = p->nseats;
+    rec->seat = p->seat;
+    for (j = 0; j < MATCH_MAX; j++) {
+        rec->players[j] = -1;
+    }
+    rec->lastplayed = -1;
+    rec->queuepos = -1;
+    rec->state = p->state;
+    rec->game_state = p->game_state;
+    rec->health = p->health;
+    rec->power_moves = p->power_moves;
+    rec->on_mute = p->on_mute;
+    rec->inputLength = p->inputLength;
+    rec->resume_deadline = p->resume_deadline;
+    if (p->gateway != NULL || p->udp != NULL) {
+        // Gateways and UDP peers don't come along, their sessions wait to be resumed
+        rec->resume_deadline = now() + cfg()->resume_seconds * 1000LL;
+    }
+    memcpy(rec->token, p->token, sizeof(rec->token));
+    strcpy(rec->name, p->name);
+    if (p->inputBuffer != NULL) {
+        memcpy(rec->inputBuffer, p->inputBuffer, sizeof(rec->inputBuffer));
+    }
+    if (p->room) {
+        strcpy(rec->room, p->room->name);
+    }
+    if (rec->connected && p->vinlen > 0) {
+        rec->vinlen = p->vinlen;
+        memcpy(rec->vin, p->vin, p->vinlen);
+    }
+    if (rec->binary && p->finlen > 0) {
+        rec->finlen = p->finlen;
+        memcpy(rec->fin, p->fin, p->finlen);
+    }
+}
+
+/* flatten the client list into records, in list order
+ * returns the records, sets *count and *list to the matching clients
+ */
+static struct handoff_record *packclients(struct client *top, int *count, struct client ***list) {
+    struct handoff_record *recs;
+    struct client **clients, **keys;
+    struct client *p, *q;
+    struct room *r;
+    int *vals;
+    int n = 0, mask = 1, qpos = 0;
+    int i, j;
+
+    for (p = top; p; p = p->next) {
+        n++;
+    }
+    while (mask < 2 * n) {
+        mask <<= 1;
+    }
+    recs = calloc(n + 1, sizeof(struct handoff_record));
+    clients = malloc((n + 1) * sizeof(struct client *));
+    keys = calloc(mask, sizeof(struct client *));
+    vals = malloc(mask * sizeof(int));
+    if (!recs || !clients || !keys || !vals) {
+        perror("malloc");
+        exit(1);
+    }
+    mask--;
+
+    // Number the clients so pointers can be sent as indexes
+    for (i = 0, p = top; p; p = p->next, i++) {
+        int slot = ptrslot(keys, mask, p);
+        keys[slot] = p;
+        vals[slot] = i;
+        clients[i] = p;
+        recs[i].queuepos = -1;
+    }
+    // Queue positions are numbered across all rooms, oldest first
+    for (i = 0; i < ROOM_BUCKETS; i++) {
+        for (r = roomtable[i]; r; r = r->hnext) {
+            for (p = r->queue_head; p; p = p->queue_next) {
+                recs[vals[ptrslot(keys, mask, p)]].queuepos = qpos++;
+            }
+        }
+    }
+    for (i = 0; i < n; i++) {
+        struct handoff_record *rec = &recs[i];
+        int slot, queuepos = rec->queuepos;
+        p = clients[i];
+        packrecord(rec, p);
+        rec->queuepos = queuepos;
+        if (p->match) {
+            rec->matchmode = p->match->mode;
+            rec->matchsize = p->match->size;
+            rec->turn = p->match->turn;
+            rec->matchmoves = p->match->moves;
+            rec->matchleft = p->match->left;
+            // (players who left are only remembered here)
+            memcpy(rec->seatname, p->match->seatname, sizeof(rec->seatname));
+            for (j = 0; j < MATCH_MAX; j++) {
+                q = j < p->match->size ? p->match->players[j] : NULL;
+                rec->players[j] = q ? vals[ptrslot(keys, mask, q)] : -1;
+            }
+        }
+        if ((q = deref(p->lastplayed)) != NULL) {
+            slot = ptrslot(keys, mask, q);
+            rec->lastplayed = keys[slot] ? vals[slot] : -1;
+        }
+    }
+    free(keys);
+    free(vals);
+    *count = n;
+    *list = clients;
+    return recs;
+}
+
+/* rebuild a client list from n records
+ * fds holds the sockets of the connected records in order, or is NULL when
+ * there are no sockets (a snapshot) and every client comes back suspended
+ * returns the new list
+ */
+static struct client *unpackclients(struct handoff_record *recs, int n, int *fds) {
+    struct client **clients;
+    struct client *list = NULL;
+    struct match *m;
+    int *order;
+    int i, j, nfd = 0, nqueued = 0;
+
+    clients = malloc((n + 1) * sizeof(struct client *));
+    order = malloc((n + 1) * sizeof(int));
+    if (!clients || !order) {
+        perror("malloc");
+        exit(1);
+    }
+    for (i = 0; i < n; i++) {
+        struct client *p = calloc(1, sizeof(struct client));
+        if (!p) {
+            perror("calloc");
+            exit(1);
+        }
+        p->seat = -1;
+        addref(p);
+        clients[i] = p;
+    }
+    for (i = 0; i < n; i++) {
+        struct handoff_record *rec = &recs[i];
+        struct client *p = clients[i];
+        p->fd = -1;
+        if (fds != NULL && rec->connected) {
+            p->fd = fds[nfd++];
+        }
+        if (p->fd >= 0 && rec->binary) {
+            // The start of a frame that was read comes along, the rest is in the socket
+            p->binary = 1;
+            heard(p);
+            if (rec->finlen > 0 && rec->finlen <= PROTO_MAXIN) {
+                takefin(p);
+                memcpy(p->fin, rec->fin, rec->finlen);
+                p->finlen = rec->finlen;
+            }
+        }
+        if (p->fd >= 0 && rec->vinlen > 0 && rec->vinlen <= GATEWAY_INPUT) {
+            takevin(p);
+            memcpy(p->vin, rec->vin, rec->vinlen);
+            p->vinlen = rec->vinlen;
+        }
+        p->ipaddr = rec->ipaddr;
+        p->mode = rec->mode;
+        p->nseats = rec->nseats;
+        // The first of a match's players to come through sets the match up for all of them
+        if (rec->seat >= 0 && p->match == NULL && rec->matchsize > 0 && rec->matchsize <= MATCH_MAX) {
+            m = newmatch();
+            m->mode = rec->matchmode;
+            m->size = rec->matchsize;
+            m->turn = rec->turn;
+            m->moves = rec->matchmoves;
+            m->left = rec->matchleft;
+            for (j = 0; j < m->size; j++) {
+                memcpy(m->seatname[j], rec->seatname[j], sizeof(m->seatname[j]));
+                m->seatname[j][sizeof(m->seatname[j]) - 1] = '\0';
+                if (rec->players[j] >= 0 && rec->players[j] < n) {
+                    m->players[j] = clients[rec->players[j]];
+                    m->players[j]->match = m;
+                    m->players[j]->seat = j;
+                }
+            }
+        }
+        p->lastplayed = rec->lastplayed >= 0 && rec->lastplayed < n ? clients[rec->lastplayed]->ref : 0;
+        p->state = rec->state;
+        p->game_state = rec->game_state;
+        p->health = rec->health;
+        p->power_moves = rec->power_moves;
+        p->on_mute = rec->on_mute;
+        p->inputLength = rec->inputLength < LINE_LEN ? rec->inputLength : 0;
+        rec->name[sizeof(rec->name) - 1] = '\0';
+        setname(p, rec->name);
+        if (p->inputLength > 0) {
+            takeline(p);
+            memcpy(p->inputBuffer, rec->inputBuffer, LINE_LEN);
+        }
+        memcpy(p->token, rec->token, sizeof(p->token));
+        p->token[TOKEN_LEN] = '\0';
+        initlimits(p);
+        if (p->token[0] != '\0') {
+            addtoken(p);
+        }
+        if (p->state != AWAITING_NAME) {
+            addname(p);
+        }
+        if (rec->room[0] != '\0') {
+            joinroom(p, findroom(rec->room, 1));
+        }
+        if (rec->queuepos >= 0 && rec->queuepos < n) {
+            order[rec->queuepos] = i;
+            nqueued++;
+        }
+        if (rec->bot) {
+            p->bot = 1;
+            nbots++;
+        }
+        else if (p->fd < 0) {
+            // Snapshot clients get a fresh grace period, the clock restarted with us
+            suspend(p, fds != NULL ? rec->resume_deadline : now() + cfg()->resume_seconds * 1000LL);
+        }
+    }
+    // Build the list in the same order it was packed
+    for (i = n - 1; i >= 0; i--) {
+        clients[i]->next = list;
+        if (list) {
+            list->prev = clients[i];
+        }
+        list = clients[i];
+    }
+    // Bots pick up where they were: thinking about a move or on their way out
+    for (i = 0; i < n; i++) {
+        if (clients[i]->bot && clients[i]->state == IN_MATCH_ATTACK) {
+            schedulebot(clients[i]);
+        }
+        else if (clients[i]->bot && clients[i]->state == LOOKING_FOR_MATCH && recs[i].queuepos < 0) {
+            retirebot(clients[i]);
+        }
+    }
+    // Queue positions are dense, so this restores every room's queue order
+    for (i = 0; i < nqueued; i++) {
+        enqueue(clients[order[i]]);
+    }
+    // Spectators don't come back watching, they go to the back of the queue
+    for (i = 0; i < n; i++) {
+        if (clients[i]->state == LOOKING_FOR_MATCH && !clients[i]->bot) {
+            enqueue(clients[i]);
+        }
+    }
+    free(clients);
+    free(order);
+    return list;
+}
+
+/* hot upgrade
+ * On SIGUSR2 the running server re-executes progpath with one end of a
+ * socketpair and sends it the listening socket and every client. The client
+ * sockets ride along as SCM_RIGHTS next to their records.
+ */
+
+/* send len bytes of data along with nfds file descriptors in one message */
+static int sendfds(int sock, void *data, int len, int *fds, int nfds) {
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+        struct cmsghdr align;
+    } control;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = data;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (nfds > 0) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+    if (sendmsg(sock, &msg, 0) != len) {
+        perror("sendmsg");
+        return -1;
+    }
+    return 0;
+}
+
+/* receive one message of exactly len bytes
+ * returns the number of descriptors that came with it, -1 on error
+ */
+static int recvfds(int sock, void *data, int len, int *fds) {
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+        struct cmsghdr align;
+    } control;
+    int nfds;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = data;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if (recvmsg(sock, &msg, 0) != len || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        return -1;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL) {
+        return 0;
+    }
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * nfds);
+    return nfds;
+}
+
+/* hand every client over to a new copy of the binary
+ * returns 0 once the new process has taken over, -1 if we should carry on
+ */
+static int handoff(struct client *top, int listenfd) {
+    struct timeval start, end;
+    struct handoff_header hdr;
+    struct handoff_record *recs;
+    struct client **clients;
+    int fds[HANDOFF_BATCH];
+    int sv[2];
+    int n, i, j, cnt, nfds;
+    int nargs = 0;
+    char *args[64];
+    char fdarg[16];
+    char ack;
+    pid_t pid;
+
+    gettimeofday(&start, NULL);
+    // The new process reads the ladder when it starts, so it has to be current
+    if (ladderpath != NULL) {
+        if (ladderchild > 0) {
+            waitpid(ladderchild, NULL, 0);
+            ladderchild = 0;
+        }
+        if (ladderdirty && saveladder() < 0) {
+            fprintf(stderr, "upgrade failed, still serving\n");
+            return -1;
+        }
+        ladderdirty = 0;
+    }
+    // and scans the history, which has to be all in the files
+    historyflush();
+    // Nobody else may take our players while they move, the new process
+    // puts them back in the cluster's queue
+    clusterleave();
+    recs = packclients(top, &n, &clients);
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+        perror("socketpair");
+        goto fail;
+    }
+    fflush(stdout);
+    if ((pid = fork()) < 0) {
+        perror("fork");
+        close(sv[0]);
+        close(sv[1]);
+        goto fail;
+    }
+    if (pid == 0) {
+        // The new process only gets the sockets we send it
+        closesockets();
+        close(listenfd);
+        if (unixfd >= 0) {
+            close(unixfd);
+        }
+        if (udpfd >= 0) {
+            close(udpfd);
+        }
+        close(sv[0]);
+        // Same arguments as we were started with, plus the handoff socket
+        sprintf(fdarg, "%d", sv[1]);
+        args[nargs++] = progpath;
+        args[nargs++] = "-r";
+        args[nargs++] = fdarg;
+        for (i = 1; i < progargc && nargs < (int)(sizeof(args) / sizeof(args[0])) - 1; i++) {
+            if (strcmp(progargv[i], "-r") == 0) {
+                i++;
+                continue;
+            }
+            args[nargs++] = progargv[i];
+        }
+        args[nargs] = NULL;
+        execv(progpath, args);
+        perror("execv");
+        _exit(1);
+    }
+    close(sv[1]);
+
+    hdr.magic = HANDOFF_MAGIC;
+    hdr.recsize = sizeof(struct handoff_record);
+    hdr.nclients = n;
+    hdr.rngstate = rngstate;
+    // The listening sockets come first, gateways and their sessions (and
+    // UDP sessions) don't make it across: the sessions wait to be resumed
+    // like any lost socket
+    nfds = 0;
+    fds[nfds++] = listenfd;
+    if (unixfd >= 0) {
+        fds[nfds++] = unixfd;
+    }
+    if (udpfd >= 0) {
+        fds[nfds++] = udpfd;
+    }
+    if (sendfds(sv[0], &hdr, sizeof(hdr), fds, nfds) < 0) {
+        goto killchild;
+    }
+    for (i = 0; i < n; i += cnt) {
+        cnt = n - i < HANDOFF_BATCH ? n - i : HANDOFF_BATCH;
+        nfds = 0;
+        for (j = 0; j < cnt; j++) {
+            if (clients[i + j]->fd >= 0) {
+                fds[nfds++] = clients[i + j]->fd;
+            }
+        }
+        if (sendfds(sv[0], &recs[i], cnt * sizeof(struct handoff_record), fds, nfds) < 0) {
+            goto killchild;
+        }
+    }
+    // Wait for the new process to say it has everything
+    if (read(sv[0], &ack, 1) != 1) {
+        fprintf(stderr, "upgrade: new process did not take over\n");
+        goto killchild;
+    }
+    close(sv[0]);
+    gettimeofday(&end, NULL);
+    printf("Handed %d clients to pid %d in %ld us\n", n, (int)pid,
+           (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec));
+    free(recs);
+    free(clients);
+    return 0;
+
+killchild:
+    // Never leave two servers reading the same sockets
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(sv[0]);
+fail:
+    fprintf(stderr, "upgrade failed, still serving\n");
+    free(recs);
+    free(clients);
+    return -1;
+}
+
+/* rebuild the client list sent by handoff() on sock
+ * returns the new list and sets *listenfd (and unixfd and udpfd), exits if
+ * the handoff is broken
+ */
+static struct client *takeover(int sock, int *listenfd) {
+    struct handoff_header hdr;
+    struct handoff_record *recs;
+    struct client *list;
+    int lfds[HANDOFF_BATCH];
+    int *fds;
+    int i, cnt, n, got, type, nfds = 0;
+    socklen_t len;
+
+    if ((got = recvfds(sock, &hdr, sizeof(hdr), lfds)) < 1 || hdr.magic != HANDOFF_MAGIC
+        || hdr.recsize != sizeof(struct handoff_record)) {
+        fprintf(stderr, "takeover: bad handoff header\n");
+        exit(1);
+    }
+    *listenfd = lfds[0];
+    // then whichever of the unix and UDP sockets the old process had
+    for (i = 1; i < got; i++) {
+        len = sizeof(type);
+        if (getsockopt(lfds[i], SOL_SOCKET, SO_TYPE, &type, &len) == 0 && type == SOCK_DGRAM) {
+            udpfd = lfds[i];
+        } else {
+            unixfd = lfds[i];
+        }
+    }
+    n = hdr.nclients;
+    rngstate = hdr.rngstate;
+    recs = malloc((n + 1) * sizeof(struct handoff_record));
+    fds = malloc((n + HANDOFF_BATCH) * sizeof(int));
+    if (!recs || !fds) {
+        perror("malloc");
+        exit(1);
+    }
+    for (i = 0; i < n; i += cnt) {
+        cnt = n - i < HANDOFF_BATCH ? n - i : HANDOFF_BATCH;
+        if ((got = recvfds(sock, &recs[i], cnt * sizeof(struct handoff_record), &fds[nfds])) < 0) {
+            fprintf(stderr, "takeover: lost the handoff after %d clients\n", i);
+            exit(1);
+        }
+        nfds += got;
+    }
+    list = unpackclients(recs, n, fds);
+
+    if (write(sock, "k", 1) != 1) {
+        perror("write");
+    }
+    close(sock);
+    printf("Took over %d clients\n", n);
+    free(recs);
+    free(fds);
+    return list;
+}
+
+/* cluster
+ * Servers on one host started with the same -c name share a matchmaking
+ * queue in shared memory. Every CLUSTER_MS each server puts its waiting
+ * players in it and looks for players on other servers who would make a
+ * match with one of its own. When it finds one it asks that player's
+ * server for them, and the player's record and socket come over the
+ * server's cluster socket the way a hot upgrade hands them over. Then
+ * findmatch() pairs them like any local players.
+ *
+ * Each slot of the queue is a 64 bit word that only changes by
+ * compare-and-swap: the slot's state, the pid that claimed it and a
+ * sequence number that goes up every time the slot is reused, so a stale
+ * look at a slot can never claim its next player. The rest of the slot is
+ * written while the slot is BUSY and read only under a word that says
+ * WAITING. A server only pulls from servers with a higher pid, so two of
+ * them never pull each other's players at the same time.
+ */
+enum slot_state {
+    SLOT_FREE,
+    SLOT_BUSY,    // being filled in by its server
+    SLOT_WAITING, // a player that can be pulled
+    SLOT_CLAIMED  // being pulled by the server in the word
+};
+
+struct clusterslot {
+    int pid;  // the server the player is on
+    int mode;
+    int nseats;
+    char token[TOKEN_LEN + 1];
+    char room[ROOM_NAME_MAX];
+    char name[LINE_LEN];
+};
+
+struct cluster {
+    _Atomic unsigned int magic;
+    int nslots;
+    _Atomic unsigned long long word[CLUSTER_SLOTS];
+    struct clusterslot slot[CLUSTER_SLOTS];
+};
+
+// A player asked for, and what came back
+struct cluster_request {
+    int pid;
+    int slot;
+    unsigned int seq;
+    char token[TOKEN_LEN + 1];
+};
+
+struct cluster_reply {
+    int ok; // 0 if the player isn't there to take any more
+    struct handoff_record rec;
+};
+
+static struct cluster *cluster = NULL;
+static pid_t mypid;
+
+static unsigned long long slotword(unsigned int seq, int pid, int state) {
+    return (unsigned long long)seq << 32 | (unsigned int)pid << 2 | state;
+}
+
+static int slotstate(unsigned long long w) {
+    return w & 3;
+}
+
+static unsigned int slotseq(unsigned long long w) {
+    return w >> 32;
+}
+
+static pid_t slotpid(unsigned long long w) {
+    return (w >> 2) & 0x3fffffff;
+}
+
+static int casword(int i, unsigned long long old, unsigned long long new) {
+    return atomic_compare_exchange_strong(&cluster->word[i], &old, new);
+}
+
+/* the address of pid's cluster socket */
+static void clusteraddr(char *path, pid_t pid) {
+    sprintf(path, "@battle-%s-%d", clustername, (int)pid);
+}
+
+/* map the queue of the cluster called clustername and open our socket */
+static void clusterjoin(void) {
+    char path[128];
+    struct stat st;
+    int fd;
+    unsigned int magic = 0;
+    sprintf(path, "/battle-%s", clustername);
+    if ((fd = shm_open(path, O_RDWR | O_CREAT, 0600)) < 0) {
+        perror(path);
+        exit(1);
+    }
+    // The first server in makes it, zeros are an empty queue
+    if (fstat(fd, &st) < 0 || (st.st_size == 0 && ftruncate(fd, sizeof(struct cluster)) < 0)) {
+        perror(path);
+        exit(1);
+    }
+    if (st.st_size != 0 && st.st_size != sizeof(struct cluster)) {
+        fprintf(stderr, "%s: made by a different build\n", path);
+        exit(1);
+    }
+    cluster = mmap(NULL, sizeof(struct cluster), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (cluster == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    close(fd);
+    if (!atomic_compare_exchange_strong(&cluster->magic, &magic, CLUSTER_MAGIC) && magic != CLUSTER_MAGIC) {
+        fprintf(stderr, "%s: not a cluster queue\n", path);
+        exit(1);
+    }
+    mypid = getpid();
+    clusteraddr(path, mypid);
+    clusterfd = bindunix(path);
+    printf("Joined cluster %s\n", clustername);
+    addtimer(CLUSTER_MS, clustertimer, NULL);
+}
+
+/* put p in the queue for the other servers to see */
+static void publish(struct client *p) {
+    struct clusterslot *s;
+    unsigned long long w;
+    unsigned int seq;
+    int i;
+    for (i = 0; i < CLUSTER_SLOTS; i++) {
+        w = atomic_load(&cluster->word[i]);
+        seq = slotseq(w) + 1;
+        if (slotstate(w) != SLOT_FREE || !casword(i, w, slotword(seq, 0, SLOT_BUSY))) {
+            continue;
+        }
+        s = &cluster->slot[i];
+        s->pid = mypid;
+        s->mode = p->mode;
+        s->nseats = p->nseats;
+        strcpy(s->token, p->token);
+        strcpy(s->room, p->room->name);
+        strcpy(s->name, p->name);
+        atomic_store(&cluster->word[i], slotword(seq, 0, SLOT_WAITING));
+        p->clusterslot = i + 1;
+        p->clusterseq = seq;
+        return;
+    }
+}
+
+/* take p out of the queue, unless another server is pulling it: that
+ * server's request finds p gone and gives the slot back
+ */
+static void retract(struct client *p) {
+    int i = p->clusterslot - 1;
+    if (cluster == NULL || i < 0) {
+        return;
+    }
+    if (!casword(i, slotword(p->clusterseq, 0, SLOT_WAITING), slotword(p->clusterseq, 0, SLOT_FREE))) {
+        // Held by one of our own pulls, which will find its claim gone
+        casword(i, slotword(p->clusterseq, mypid, SLOT_CLAIMED), slotword(p->clusterseq, 0, SLOT_FREE));
+    }
+    p->clusterslot = 0;
+}
+
+/* a local player who would make a match with the one in slot s */
+static struct client *partner(struct clusterslot *s) {
+    struct room *r = findroom(s->room, 0);
+    struct client *q;
+    unsigned long long w;
+    if (r == NULL || findname(s->name) != NULL) {
+        // Names are unique here, a second one can't come over
+        return NULL;
+    }
+    for (q = r->queue_head; q; q = q->queue_next) {
+        if (q->clusterslot == 0 || q->mode != s->mode || q->nseats != s->nseats) {
+            continue;
+        }
+        w = atomic_load(&cluster->word[q->clusterslot - 1]);
+        if (w == slotword(q->clusterseq, 0, SLOT_WAITING)) {
+            return q;
+        }
+    }
+    return NULL;
+}
+
+/* connect to pid's cluster socket
+ * returns the socket, -1 if pid isn't there
+ */
+static int clusterconnect(pid_t pid) {
+    struct sockaddr_un u;
+    char path[128];
+    int fd;
+    clusteraddr(path, pid);
+    memset(&u, 0, sizeof(u));
+    u.sun_family = AF_UNIX;
+    strcpy(u.sun_path, path);
+    u.sun_path[0] = '\0';
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&u, offsetof(struct sockaddr_un, sun_path) + strlen(path)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* ask the server of the player s in slot i (as of word w) for them, to play q */
+static void startpull(int i, unsigned long long w, struct clusterslot *s, struct client *q) {
+    struct cluster_request req;
+    struct pull *pl;
+    int mine = q->clusterslot - 1;
+
+    memset(&req, 0, sizeof(req));
+    req.pid = s->pid;
+    strcpy(req.token, s->token);
+    // Hold our player first, then theirs, and let go of ours if theirs is taken
+    if (!casword(mine, slotword(q->clusterseq, 0, SLOT_WAITING), slotword(q->clusterseq, mypid, SLOT_CLAIMED))) {
+        return;
+    }
+    if (!casword(i, w, slotword(slotseq(w), mypid, SLOT_CLAIMED))) {
+        casword(mine, slotword(q->clusterseq, mypid, SLOT_CLAIMED), slotword(q->clusterseq, 0, SLOT_WAITING));
+        return;
+    }
+    if ((pl = malloc(sizeof(struct pull))) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    pl->slot = i;
+    pl->seq = slotseq(w);
+    pl->mine = mine;
+    pl->mineseq = q->clusterseq;
+    req.slot = i;
+    req.seq = pl->seq;
+    pl->fd = clusterconnect(req.pid);
+    req.pid = mypid;
+    if (pl->fd < 0 || write(pl->fd, &req, sizeof(req)) != sizeof(req)) {
+        // Its server is gone, and the player with it
+        if (pl->fd >= 0) {
+            close(pl->fd);
+        }
+        pl->fd = -1;
+        endpull(pl, 1);
+        return;
+    }
+    FD_SET(pl->fd, &allset);
+    if (pl->fd > clusterhigh) {
+        clusterhigh = pl->fd;
+    }
+    pl->next = pulls;
+    pulls = pl;
+}
+
+/* let go of everything pl claimed, the other player's slot too if drop */
+static void endpull(struct pull *pl, int drop) {
+    struct pull **c;
+    casword(pl->mine, slotword(pl->mineseq, mypid, SLOT_CLAIMED), slotword(pl->mineseq, 0, SLOT_WAITING));
+    casword(pl->slot, slotword(pl->seq, mypid, SLOT_CLAIMED),
+            drop ? slotword(pl->seq, 0, SLOT_FREE) : slotword(pl->seq, 0, SLOT_WAITING));
+    if (pl->fd >= 0) {
+        FD_CLR(pl->fd, &allset);
+        close(pl->fd);
+    }
+    for (c = &pulls; *c != NULL && *c != pl; c = &(*c)->next)
+        ;
+    if (*c == pl) {
+        *c = pl->next;
+    }
+    free(pl);
+}
+
+static void clustertimer(void *arg) {
+    struct clusterslot s;
+    struct give *gv, *next;
+    struct room *r;
+    struct client *p, *q;
+    unsigned long long w;
+    int i;
+
+    addtimer(CLUSTER_MS, clustertimer, NULL);
+    // A server writes its request as soon as it connects, anyone slower goes
+    for (gv = gives; gv; gv = next) {
+        next = gv->next;
+        if (now() - gv->since > CLUSTER_ASK_MS) {
+            close(gv->fd);
+            endgive(gv);
+        }
+    }
+    // Our waiting players go in the queue, again if their slot was lost
+    for (i = 0; i < ROOM_BUCKETS; i++) {
+        for (r = roomtable[i]; r; r = r->hnext) {
+            for (p = r->queue_head; p; p = p->queue_next) {
+                if (p->clusterslot != 0) {
+                    w = atomic_load(&cluster->word[p->clusterslot - 1]);
+                    if (slotseq(w) == p->clusterseq && slotstate(w) >= SLOT_WAITING) {
+                        continue;
+                    }
+                    p->clusterslot = 0;
+                }
+                if (!p->bot && !p->suspended && p->fd >= 0 && p->gateway == NULL) {
+                    publish(p);
+                }
+            }
+        }
+    }
+    for (i = 0; i < CLUSTER_SLOTS; i++) {
+        w = atomic_load(&cluster->word[i]);
+        if (slotstate(w) < SLOT_WAITING) {
+            continue;
+        }
+        // A copy, which is only good if the word didn't change while we took it
+        s = cluster->slot[i];
+        if (atomic_load(&cluster->word[i]) != w) {
+            continue;
+        }
+        s.token[TOKEN_LEN] = '\0';
+        s.room[ROOM_NAME_MAX - 1] = '\0';
+        s.name[sizeof(s.name) - 1] = '\0';
+        if (slotstate(w) == SLOT_CLAIMED && s.pid == mypid && kill(slotpid(w), 0) < 0 && errno == ESRCH) {
+            // Whoever was pulling our player died doing it
+            casword(i, w, slotword(slotseq(w), 0, SLOT_WAITING));
+        }
+        if (slotstate(w) != SLOT_WAITING || s.pid <= mypid) {
+            continue;
+        }
+        if (kill(s.pid, 0) < 0 && errno == ESRCH) {
+            // Left behind by a server that died
+            casword(i, w, slotword(slotseq(w), 0, SLOT_FREE));
+            continue;
+        }
+        if ((q = partner(&s)) != NULL) {
+            startpull(i, w, &s, q);
+        }
+    }
+}
+
+/* another server connected on fd, which doesn't block, to ask for one of
+ * our players, givepull() answers once the request is there to read
+ */
+static void waitgive(int fd) {
+    struct give *gv;
+    if ((gv = malloc(sizeof(struct give))) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    gv->fd = fd;
+    gv->since = now();
+    gv->next = gives;
+    gives = gv;
+    FD_SET(fd, &allset);
+    if (fd > clusterhigh) {
+        clusterhigh = fd;
+    }
+}
+
+/* forget gv, its socket is closed or about to be */
+static void endgive(struct give *gv) {
+    struct give **c;
+    FD_CLR(gv->fd, &allset);
+    for (c = &gives; *c != NULL && *c != gv; c = &(*c)->next)
+        ;
+    if (*c == gv) {
+        *c = gv->next;
+    }
+    free(gv);
+}
+
+/* the request of the server on gv came in, answer it and free gv */
+static void givepull(struct give *gv) {
+    struct cluster_request req;
+    struct cluster_reply reply;
+    struct client *p = NULL;
+    unsigned long long claimed;
+    int sent, fd = gv->fd;
+
+    // It is written in one go, so whatever isn't all there never will be
+    endgive(gv);
+    if (recv(fd, &req, sizeof(req), MSG_DONTWAIT) != sizeof(req) || req.slot < 0 || req.slot >= CLUSTER_SLOTS) {
+        close(fd);
+        return;
+    }
+    req.token[TOKEN_LEN] = '\0';
+    claimed = slotword(req.seq, req.pid, SLOT_CLAIMED);
+    memset(&reply, 0, sizeof(reply));
+    if (atomic_load(&cluster->word[req.slot]) == claimed && (p = findtoken(req.token)) != NULL
+        && p->clusterslot == req.slot + 1 && p->clusterseq == req.seq && p->state == LOOKING_FOR_MATCH
+        && p->fd >= 0 && p->gateway == NULL && !p->suspended) {
+        packrecord(&reply.rec, p);
+        reply.ok = 1;
+    }
+    sent = sendfds(fd, &reply, sizeof(reply), reply.ok ? &p->fd : NULL, reply.ok);
+    close(fd);
+    // The slot is done with either way
+    casword(req.slot, claimed, slotword(req.seq, 0, SLOT_FREE));
+    if (!reply.ok || sent < 0) {
+        return;
+    }
+    printf("Sent %s to pid %d\n", p->name, req.pid);
+    p->clusterslot = 0;
+    dropoutput(p);
+    FD_CLR(p->fd, &allset);
+    close(p->fd);
+    p->fd = -1;
+    head = removeclient(head, p);
+    statedirty = 1;
+}
+
+/* the answer to pl came in, with the player if we are lucky */
+static void finishpull(struct pull *pl) {
+    struct cluster_reply reply;
+    struct client *p;
+    int fds[HANDOFF_BATCH];
+    int n = recvfds(pl->fd, &reply, sizeof(reply), fds);
+    endpull(pl, 0);
+    if (n != 1 || !reply.ok) {
+        while (n-- > 0) {
+            close(fds[n]);
+        }
+        return;
+    }
+    p = unpackclients(&reply.rec, 1, fds);
+    p->next = head;
+    if (head) {
+        head->prev = p;
+    }
+    head = p;
+    FD_SET(p->fd, &allset);
+    if (p->fd > clusterhigh) {
+        clusterhigh = p->fd;
+    }
+    statedirty = 1;
+    printf("Pulled %s over from another server\n", p->name);
+    findmatch(p);
+}
+
+/* give up our places in the queue, before a handoff */
+static void clusterleave(void) {
+    struct client *p;
+    while (pulls != NULL) {
+        endpull(pulls, 0);
+    }
+    while (gives != NULL) {
+        close(gives->fd);
+        endgive(gives);
+    }
+    for (p = head; p; p = p->next) {
+        retract(p);
+    }
+}
+
+/* close every client's and gateway's socket, for children that have no business with them */
+static void closesockets(void) {
+    struct client *p;
+    struct gateway *g;
+    struct pull *pl;
+    struct give *gv;
+    for (p = head; p; p = p->next) {
+        if (p->fd >= 0) {
+            close(p->fd);
+        }
+    }
+    for (g = gateways; g; g = g->next) {
+        close(g->fd);
+    }
+    for (pl = pulls; pl; pl = pl->next) {
+        close(pl->fd);
+    }
+    for (gv = gives; gv; gv = gv->next) {
+        close(gv->fd);
+    }
+    if (clusterfd >= 0) {
+        close(clusterfd);
+    }
+}
+
+/* snapshots
+ * Every SNAPSHOT_SECONDS, if anything has happened, we fork and let the child
+ * write the client records out. The child sees a copy-on-write image of the
+ * list, so the event loop only pays for the fork. The file is written next
+ * to the real one and renamed over it, so a crash leaves the last good one.
+ */
+static void writesnapshot(struct client *top) {
+    struct handoff_header hdr;
+    struct handoff_record *recs;
+    struct client **clients;
+    char tmppath[PATH_MAX];
+    FILE *f;
+    int n;
+
+    recs = packclients(top, &n, &clients);
+    hdr.magic = SNAPSHOT_MAGIC;
+    hdr.recsize = sizeof(struct handoff_record);
+    hdr.nclients = n;
+    hdr.rngstate = rngstate;
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", snappath);
+    if ((f = fopen(tmppath, "w")) == NULL) {
+        perror(tmppath);
+        _exit(1);
+    }
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1
+        || fwrite(recs, sizeof(struct handoff_record), n, f) != (size_t)n
+        || fflush(f) != 0 || fsync(fileno(f)) != 0) {
+        perror(tmppath);
+        _exit(1);
+    }
+    fclose(f);
+    if (rename(tmppath, snappath) < 0) {
+        perror(snappath);
+        _exit(1);
+    }
+    _exit(0);
+}
+
+static void snapshottimer(void *arg) {
+    int status;
+
+    addtimer(SNAPSHOT_SECONDS * 1000LL, snapshottimer, arg);
+    if (snapchild > 0) {
+        if (waitpid(snapchild, &status, WNOHANG) == 0) {
+            // The last one is still being written, try again next time
+            return;
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "snapshot to %s failed\n", snappath);
+        }
+        snapchild = 0;
+    }
+    if (!statedirty) {
+        return;
+    }
+    fflush(stdout);
+    if ((snapchild = fork()) < 0) {
+        perror("fork");
+        snapchild = 0;
+        return;
+    }
+    if (snapchild == 0) {
+        // Don't hold sockets open behind the server's back while writing
+        closesockets();
+        writesnapshot(head);
+    }
+    statedirty = 0;
+}
+
+/* load the snapshot at snappath, every client in it comes back suspended
+ * returns the new list, NULL if there is no usable snapshot
+ */
+static struct client *loadsnapshot(void) {
+    struct handoff_header hdr;
+    struct handoff_record *recs;
+    struct client *list;
+    FILE *f;
+
+    if ((f = fopen(snappath, "r")) == NULL) {
+        return NULL;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != SNAPSHOT_MAGIC
+        || hdr.recsize != sizeof(struct handoff_record) || hdr.nclients < 0) {
+        fprintf(stderr, "%s is not a snapshot, ignoring it\n", snappath);
+        fclose(f);
+        return NULL;
+    }
+    recs = malloc((hdr.nclients + 1) * sizeof(struct handoff_record));
+    if (!recs) {
+        perror("malloc");
+        exit(1);
+    }
+    if (fread(recs, sizeof(struct handoff_record), hdr.nclients, f) != (size_t)hdr.nclients) {
+        fprintf(stderr, "%s is truncated, ignoring it\n", snappath);
+        free(recs);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    rngstate = hdr.rngstate;
+    list = unpackclients(recs, hdr.nclients, NULL);
+    printf("Loaded %d clients from %s\n", hdr.nclients, snappath);
+    free(recs);
+    return list;
+}
+
+/* ladder file
+ * One line per standing, best first: rating, wins, losses and the name.
+ * Like snapshots it is written by a forked child every LADDER_SECONDS if
+ * anything changed, to a temporary file that is renamed over the old one.
+ */
+static void writestandings(FILE *f, struct standing *t) {
+    if (t == NULL) {
+        return;
+    }
+    writestandings(f, t->left);
+    fprintf(f, "%d %d %d %s\n", t->rating, t->wins, t->losses, t->name);
+    writestandings(f, t->right);
+}
+
+/* returns 0 once the ladder is in ladderpath, -1 if it couldn't be written */
+static int saveladder(void) {
+    char tmppath[PATH_MAX];
+    FILE *f;
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", ladderpath);
+    if ((f = fopen(tmppath, "w")) == NULL) {
+        perror(tmppath);
+        return -1;
+    }
+    writestandings(f, ladder);
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0) {
+        perror(tmppath);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    if (rename(tmppath, ladderpath) < 0) {
+        perror(ladderpath);
+        return -1;
+    }
+    return 0;
+}
+
+static void laddertimer(void *arg) {
+    int status;
+
+    addtimer(LADDER_SECONDS * 1000LL, laddertimer, arg);
+    if (ladderchild > 0) {
+        if (waitpid(ladderchild, &status, WNOHANG) == 0) {
+            return;
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "saving the ladder to %s failed\n", ladderpath);
+        }
+        ladderchild = 0;
+    }
+    if (!ladderdirty) {
+        return;
+    }
+    fflush(stdout);
+    if ((ladderchild = fork()) < 0) {
+        perror("fork");
+        ladderchild = 0;
+        return;
+    }
+    if (ladderchild == 0) {
+        closesockets();
+        _exit(saveladder() < 0);
+    }
+    ladderdirty = 0;
+}
+
+/* put the standings in ladderpath on the ladder */
+static void loadladder(void) {
+    char line[512];
+    struct standing *s;
+    FILE *f;
+    int rating, wins, losses, off, n = 0;
+
+    if ((f = fopen(ladderpath, "r")) == NULL) {
+        return;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (sscanf(line, "%d %d %d %n", &rating, &wins, &losses, &off) != 3 || line[off] == '\0'
+            || findstanding(line + off, 0) != NULL) {
+            continue;
+        }
+        s = newstanding(line + off, rating);
+        s->wins = wins;
+        s->losses = losses;
+        n++;
+    }
+    fclose(f);
+    ladderdirty = 0;
+    printf("Loaded %d standings from %s\n", n, ladderpath);
+}
+
+/* match history
+ * Every finished match becomes one record appended to numbered segment
+ * files in histdir, each about HISTORY_SEGMENT bytes. The event loop only
+ * decides where a record goes and queues it. The writer thread does the
+ * writes, several records per call, and deletes segments nothing needs.
+ *
+ * Every player keeps the places of their last HISTORY_KEEP records in an
+ * index, so /history reads just those records and never scans a file.
+ * Records still waiting for the writer are read from its queue instead.
+ * A record the writer fails to write is lost, and its segment is sealed
+ * early so nothing goes after it.
+ * A sealed segment whose records mostly fell out of every index gets its
+ * live records copied to the end of the log by compacttimer(), and then it
+ * is deleted.
+ */
+
+// A record on disk, followed by the players' names in seat order, each
+// ending in a NUL (empty if the name was lost in a restart), and padded
+// with NULs to a multiple of 8 bytes
+struct histrec {
+    int len;  // the whole record, names included
+    int id;   // the match's id, only unique while the server runs
+    long long when; // time() when it ended
+    int moves;
+    unsigned char mode;
+    unsigned char size;
+    unsigned char won;  // bit per seat on the winning side
+    unsigned char left; // bit per seat that left instead of being knocked out
+};
+// The longest record there is, every seat with a 255 character name
+# define HISTORY_RECORD_MAX (int)(sizeof(struct histrec) + MATCH_MAX * 256)
+
+// Where a record is
+struct histref {
+    int seg;
+    int off;
+};
+
+// A player's last records, refs[next] is the oldest once all are in use
+struct histplayer {
+    int count;
+    int next;
+    struct histref refs[HISTORY_KEEP];
+    struct histplayer *hnext;
+    char name[];
+};
+
+struct histseg {
+    int fd;    // open for reading, -1 until needed
+    int size;
+    int refs;  // index entries that ever pointed into the segment
+    int live;  // ... and still do
+    int checked; // live when compacttimer last looked (0: refs), it looks again once half of that is gone
+    int gone;
+    int lost;  // records from here on never made it to the file, -1: none
+    struct histref copied; // the end of the copies compactsegment() made
+};
+
+// Work for the writer thread: len bytes for seg at off, len 0 deletes seg
+struct histjob {
+    struct histjob *next;
+    int seg;
+    int off;
+    int len;
+    int pooled; // from jobpool, otherwise malloc()ed
+    int failed; // the writer couldn't write it
+    char data[];
+};
+
+// Jobs big enough for any record recordmatch() makes, shared with the
+// writer, which puts them back, so only touched under histlock
+static struct pool jobpool = { sizeof(struct histjob) + HISTORY_RECORD_MAX, NULL };
+
+static struct histplayer *histtable[HISTORY_BUCKETS];
+static struct histseg *segs = NULL;
+static int nsegs = 0;      // entries in segs
+static int firstseg = 0;   // segments before it are gone
+static int curseg = 0;     // the segment records are going to
+static int curoff = 0;
+// Shared with the writer thread, under histlock
+static pthread_mutex_t histlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t histwork = PTHREAD_COND_INITIALIZER; // there are jobs
+static pthread_cond_t histidle = PTHREAD_COND_INITIALIZER; // a batch is done
+static struct histjob *jobs = NULL;
+static struct histjob *jobtail = NULL;
+static struct histjob *inflight = NULL; // the batch being written
+static struct histjob *lostjobs = NULL; // failed ones, for takelost()
+static int writtenseg = 0; // everything before here is in the files
+static int writtenoff = 0;
+
+static void segpath(char *buf, int seg) {
+    snprintf(buf, PATH_MAX, "%s/%08d.seg", histdir, seg);
+}
+
+static struct histseg *getseg(int seg) {
+    int n;
+    if (seg >= nsegs) {
+        n = nsegs ? nsegs * 2 : 64;
+        while (n <= seg) {
+            n *= 2;
+        }
+        if ((segs = realloc(segs, n * sizeof(struct histseg))) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        memset(segs + nsegs, 0, (n - nsegs) * sizeof(struct histseg));
+        for (; nsegs < n; nsegs++) {
+            segs[nsegs].fd = -1;
+            segs[nsegs].lost = -1;
+        }
+    }
+    return &segs[seg];
+}
+
+/* a job with room for len bytes */
+static struct histjob *newjob(int len) {
+    struct histjob *j;
+    if (len <= HISTORY_RECORD_MAX) {
+        pthread_mutex_lock(&histlock);
+        j = poolget(&jobpool);
+        pthread_mutex_unlock(&histlock);
+        j->pooled = 1;
+        j->failed = 0;
+        return j;
+    }
+    if ((j = malloc(sizeof(struct histjob) + len)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    j->pooled = 0;
+    j->failed = 0;
+    return j;
+}
+
+/* give back a job, under histlock */
+static void putjob(struct histjob *j) {
+    if (j->pooled) {
+        poolput(&jobpool, j);
+    } else {
+        free(j);
+    }
+}
+
+static void queuejob(struct histjob *j) {
+    j->next = NULL;
+    pthread_mutex_lock(&histlock);
+    if (jobtail) {
+        jobtail->next = j;
+    } else {
+        jobs = j;
+    }
+    jobtail = j;
+    pthread_cond_signal(&histwork);
+    pthread_mutex_unlock(&histlock);
+}
+
+/* write all of the n buffers in iov to fd, however many calls it takes
+ * returns 0, or -1 if the file wouldn't take them
+ */
+static int writeall(int fd, struct iovec *iov, int n) {
+    ssize_t done;
+    while (n > 0) {
+        if ((done = writev(fd, iov, n)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        // Skip what made it, a short write leaves the rest for the next call
+        for (; n > 0 && done >= (ssize_t)iov->iov_len; iov++, n--) {
+            done -= iov->iov_len;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return 0;
+}
+
+/* write one batch of jobs, the ones for the same segment in one call
+ * Once a write to a segment fails the rest of it would land at the wrong
+ * offsets, so its fd stays -1 and its jobs are marked failed from then on.
+ */
+static void writejobs(struct histjob *batch, int *fd, int *fdseg) {
+    char path[PATH_MAX];
+    struct iovec iov[64];
+    struct histjob *j, *end;
+    int n;
+    for (j = batch; j; j = end) {
+        if (j->len == 0) {
+            // Whatever was copied out of it goes to disk first
+            if (*fd >= 0) {
+                fdatasync(*fd);
+            }
+            segpath(path, j->seg);
+            if (unlink(path) < 0) {
+                perror(path);
+            }
+            end = j->next;
+            continue;
+        }
+        if (*fdseg != j->seg) {
+            if (*fd >= 0) {
+                fdatasync(*fd);
+                close(*fd);
+            }
+            segpath(path, j->seg);
+            if ((*fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+                perror(path);
+            }
+            *fdseg = j->seg;
+        }
+        for (n = 0, end = j; end && end->len > 0 && end->seg == j->seg && n < 64; end = end->next) {
+            iov[n].iov_base = end->data;
+            iov[n++].iov_len = end->len;
+        }
+        if (*fd >= 0 && writeall(*fd, iov, n) < 0) {
+            perror("history");
+            close(*fd);
+            *fd = -1;
+        }
+        if (*fd < 0) {
+            for (; j != end; j = j->next) {
+                j->failed = 1;
+            }
+        }
+    }
+    if (*fd >= 0) {
+        fdatasync(*fd);
+    }
+}
+
+static void *historywriter(void *arg) {
+    struct histjob *batch, *j;
+    int fd = -1, fdseg = -1;
+    pinworker();
+    pthread_mutex_lock(&histlock);
+    while (1) {
+        while (jobs == NULL) {
+            pthread_cond_wait(&histwork, &histlock);
+        }
+        batch = inflight = jobs;
+        jobs = jobtail = NULL;
+        pthread_mutex_unlock(&histlock);
+
+        writejobs(batch, &fd, &fdseg);
+
+        pthread_mutex_lock(&histlock);
+        inflight = NULL;
+        while (batch) {
+            j = batch;
+            batch = j->next;
+            if (j->failed) {
+                // Not in the file, takelost() lets the event loop know
+                j->next = lostjobs;
+                lostjobs = j;
+                continue;
+            }
+            if (j->len > 0) {
+                writtenseg = j->seg;
+                writtenoff = j->off + j->len;
+            }
+            putjob(j);
+        }
+        pthread_cond_broadcast(&histidle);
+    }
+    return NULL;
+}
+
+/* wait until the writer has everything in the files */
+static void historyflush(void) {
+    if (histdir == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&histlock);
+    while (jobs != NULL || inflight != NULL) {
+        pthread_cond_wait(&histidle, &histlock);
+    }
+    pthread_mutex_unlock(&histlock);
+}
+
+/* note where the writer lost records, and seal the segment they were
+ * going to so nothing ends up after them, under histlock
+ */
+static void takelost(void) {
+    struct histjob *j;
+    struct histseg *g;
+    while ((j = lostjobs) != NULL) {
+        lostjobs = j->next;
+        g = getseg(j->seg);
+        if (g->lost < 0 || j->off < g->lost) {
+            g->lost = g->size = j->off;
+        }
+        if (j->seg == curseg) {
+            printf("History segment %d couldn't be written, sealed it\n", curseg);
+            curseg++;
+            curoff = 0;
+        }
+        putjob(j);
+    }
+}
+
+/* whether everything before off in seg is in the files, under histlock */
+static int written(int seg, int off) {
+    struct histseg *g = getseg(seg);
+    if (g->lost >= 0 && off > g->lost) {
+        return 0;
+    }
+    return seg < writtenseg || (seg == writtenseg && off <= writtenoff);
+}
+
+/* queue len bytes of record for the end of the log, *at is where they go */
+static void appendrecord(const char *rec, int len, struct histref *at) {
+    struct histjob *j;
+    pthread_mutex_lock(&histlock);
+    takelost();
+    pthread_mutex_unlock(&histlock);
+    if (curoff > 0 && curoff + len > HISTORY_SEGMENT) {
+        // The segment is full, seal it
+        curseg++;
+        curoff = 0;
+    }
+    at->seg = curseg;
+    at->off = curoff;
+    getseg(curseg)->size = curoff += len;
+    j = newjob(len);
+    j->seg = at->seg;
+    j->off = at->off;
+    j->len = len;
+    memcpy(j->data, rec, len);
+    queuejob(j);
+}
+
+static struct histplayer *findplayer(const char *name, int create) {
+    unsigned int b = hashname(name) % HISTORY_BUCKETS;
+    struct histplayer *h;
+    for (h = histtable[b]; h; h = h->hnext) {
+        if (strcmp(h->name, name) == 0) {
+            return h;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    if ((h = calloc(1, sizeof(struct histplayer) + strlen(name) + 1)) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    strcpy(h->name, name);
+    h->hnext = histtable[b];
+    histtable[b] = h;
+    return h;
+}
+
+static const char *firstname(const struct histrec *r) {
+    return (const char *)(r + 1);
+}
+
+/* returns 1 if the len bytes at r hold a whole record */
+static int validrecord(const struct histrec *r, int len) {
+    const char *name, *end;
+    int i;
+    if (len < (int)sizeof(*r) || r->len < (int)sizeof(*r) || r->len > len || r->size > MATCH_MAX) {
+        return 0;
+    }
+    end = (const char *)r + r->len;
+    for (i = 0, name = firstname(r); i < r->size; i++, name += strlen(name) + 1) {
+        if (name >= end || memchr(name, '\0', end - name) == NULL) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* add the record at at to the index of everyone in it */
+static void indexrecord(const struct histrec *r, struct histref at) {
+    struct histplayer *h;
+    struct histref *old;
+    const char *name;
+    int i;
+    for (i = 0, name = firstname(r); i < r->size; i++, name += strlen(name) + 1) {
+        if (*name == '\0') {
+            continue;
+        }
+        h = findplayer(name, 1);
+        if (h->count == HISTORY_KEEP) {
+            // The oldest one falls out
+            old = &h->refs[h->next];
+            getseg(old->seg)->live--;
+        } else {
+            h->count++;
+        }
+        h->refs[h->next] = at;
+        h->next = (h->next + 1) % HISTORY_KEEP;
+        getseg(at.seg)->refs++;
+        getseg(at.seg)->live++;
+    }
+}
+
+/* the match is over, put it in the history (m->players has the winners) */
+static void recordmatch(struct match *m) {
+    char buf[HISTORY_RECORD_MAX];
+    struct histrec *r = (struct histrec *)buf;
+    struct histref at;
+    const char *name;
+    int i;
+    if (histdir == NULL) {
+        return;
+    }
+    memset(buf, 0, sizeof(buf));
+    r->len = sizeof(*r);
+    r->id = m->id;
+    r->when = time(NULL);
+    r->moves = m->moves;
+    r->mode = m->mode;
+    r->size = m->size;
+    r->left = m->left;
+    for (i = 0; i < m->size; i++) {
+        if (m->players[i] != NULL) {
+            r->won |= 1u << i;
+        }
+        // (a seat handed over without its name still knows who is in it)
+        name = m->seatname[i][0] ? m->seatname[i] : m->players[i] ? m->players[i]->name : "";
+        r->len += sprintf(buf + r->len, "%.255s", name) + 1;
+    }
+    r->len = (r->len + 7) & ~7;
+    appendrecord(buf, r->len, &at);
+    indexrecord(r, at);
+}
+
+/* returns a descriptor for reading segment seg, -1 if it can't be opened */
+static int openseg(int seg) {
+    char path[PATH_MAX];
+    struct histseg *g = getseg(seg);
+    if (g->fd < 0) {
+        segpath(path, seg);
+        if ((g->fd = open(path, O_RDONLY)) < 0) {
+            perror(path);
+        }
+    }
+    return g->fd;
+}
+
+/* read the record at at into buf, which has room for size bytes
+ * returns its length, 0 if it couldn't be read
+ */
+static int readrecord(struct histref at, char *buf, int size) {
+    struct histrec *r = (struct histrec *)buf;
+    struct histjob *j;
+    int fd, ondisk, len = 0;
+
+    pthread_mutex_lock(&histlock);
+    takelost();
+    ondisk = written(at.seg, at.off + 1);
+    if (!ondisk) {
+        // Still on its way, one of these has it, unless the writer lost it
+        for (j = jobs; j && !(j->seg == at.seg && j->off == at.off); j = j->next)
+            ;
+        if (j == NULL) {
+            for (j = inflight; j && !(j->seg == at.seg && j->off == at.off); j = j->next)
+                ;
+        }
+        if (j && j->len <= size) {
+            memcpy(buf, j->data, len = j->len);
+        }
+    }
+    pthread_mutex_unlock(&histlock);
+    if (!ondisk) {
+        return len;
+    }
+    if ((fd = openseg(at.seg)) < 0 || pread(fd, buf, sizeof(*r), at.off) != sizeof(*r)
+        || r->len < (int)sizeof(*r) || r->len > size
+        || pread(fd, buf + sizeof(*r), r->len - sizeof(*r), at.off + sizeof(*r)) != r->len - (int)sizeof(*r)) {
+        return 0;
+    }
+    return r->len;
+}
+
+/* write how the match in r went for the player in seat into buf
+ * returns the length
+ */
+static int describerecord(char *buf, const struct histrec *r, int seat) {
+    static const char *modes[] = {"duel", "2v2", "free-for-all"};
+    const char *name;
+    struct tm tm;
+    time_t when = r->when;
+    int team = r->mode == MODE_TEAMS ? seat % 2 : seat;
+    int i, len, allies, n;
+
+    localtime_r(&when, &tm);
+    len = strftime(buf, 32, "  %m-%d %H:%M  ", &tm);
+    len += sprintf(buf + len, "%s", r->mode <= MODE_FFA ? modes[r->mode] : "match");
+    for (allies = 1; allies >= 0; allies--) {
+        n = 0;
+        for (i = 0, name = firstname(r); i < r->size; i++, name += strlen(name) + 1) {
+            if (i == seat || ((r->mode == MODE_TEAMS ? i % 2 : i) == team) != allies) {
+                continue;
+            }
+            len += sprintf(buf + len, "%s%.32s", n++ ? ", " : allies ? " with " : " vs ",
+                           *name ? name : "?");
+        }
+    }
+    len += sprintf(buf + len, ": %s in %d moves\n",
+                   r->won & (1u << seat) ? "won" : r->left & (1u << seat) ? "left" : "lost", r->moves);
+    return len;
+}
+
+/* send p the last n matches of name */
+static void showhistory(struct client *p, const char *name, int n) {
+    char outbuf[4096];
+    char rec[sizeof(struct histrec) + MATCH_MAX * 256];
+    struct histrec *r = (struct histrec *)rec;
+    struct histplayer *h;
+    const char *seatname;
+    int i, seat, len;
+
+    if (histdir == NULL || (h = findplayer(name, 0)) == NULL || h->count == 0) {
+        sprintf(outbuf, "%.255s has no matches on record.\n", name);
+        sendclient(p, outbuf, strlen(outbuf));
+        return;
+    }
+    if (n > h->count) {
+        n = h->count;
+    }
+    len = sprintf(outbuf, "\nLast %d match(es) of %.255s:\n", n, h->name);
+    for (i = 1; i <= n; i++) {
+        if (readrecord(h->refs[(h->next - i + HISTORY_KEEP) % HISTORY_KEEP], rec, sizeof(rec)) == 0) {
+            continue;
+        }
+        for (seat = 0, seatname = firstname(r); seat < r->size && strcmp(seatname, h->name) != 0;
+             seat++, seatname += strlen(seatname) + 1)
+            ;
+        if (seat == r->size) {
+            continue;
+        }
+        if (len > (int)sizeof(outbuf) - 512) {
+            sendclient(p, outbuf, len);
+            len = 0;
+        }
+        len += describerecord(outbuf + len, r, seat);
+    }
+    sendclient(p, outbuf, len);
+}
+
+/* point every index entry that points at from at to instead, to.seg < 0
+ * just counts them
+ * returns how many there are
+ */
+static int moverefs(const struct histrec *r, struct histref from, struct histref to) {
+    struct histplayer *h;
+    const char *name;
+    int i, j, n = 0;
+    for (i = 0, name = firstname(r); i < r->size; i++, name += strlen(name) + 1) {
+        if (*name == '\0' || (h = findplayer(name, 0)) == NULL) {
+            continue;
+        }
+        for (j = 0; j < h->count; j++) {
+            if (h->refs[j].seg == from.seg && h->refs[j].off == from.off) {
+                if (to.seg >= 0) {
+                    h->refs[j] = to;
+                }
+                n++;
+            }
+        }
+    }
+    return n;
+}
+
+/* copy the live records of the sealed segment seg to the end of the log,
+ * if they take up less than half of it
+ */
+static void compactsegment(int seg) {
+    struct histrec *r;
+    struct histref from, to, count = {-1, 0};
+    char *data;
+    int size = getseg(seg)->size;
+    int fd, off, n, live = 0;
+
+    if ((data = malloc(size)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    if ((fd = openseg(seg)) < 0 || pread(fd, data, size, 0) != size) {
+        free(data);
+        segs[seg].checked = segs[seg].live;
+        return;
+    }
+    from.seg = seg;
+    for (off = 0; off < size; off += r->len) {
+        r = (struct histrec *)(data + off);
+        from.off = off;
+        if (moverefs(r, from, count) > 0) {
+            live += r->len;
+        }
+    }
+    if (live * 2 >= size) {
+        segs[seg].checked = segs[seg].live;
+        free(data);
+        return;
+    }
+    for (off = 0; off < size; off += r->len) {
+        r = (struct histrec *)(data + off);
+        from.off = off;
+        if (moverefs(r, from, count) == 0) {
+            continue;
+        }
+        // appendrecord() can grow segs, so no pointers into it are kept
+        appendrecord((char *)r, r->len, &to);
+        n = moverefs(r, from, to);
+        segs[seg].live -= n;
+        segs[to.seg].live += n;
+        segs[to.seg].refs += n;
+    }
+    segs[seg].copied.seg = curseg;
+    segs[seg].copied.off = curoff;
+    printf("Compacted history segment %d, %d of %d bytes were live\n", seg, live, size);
+    free(data);
+}
+
+/* let the writer delete the sealed segment seg, nothing points into it */
+static void dropsegment(int seg) {
+    struct histseg *g = getseg(seg);
+    struct histjob *j;
+    if (g->fd >= 0) {
+        close(g->fd);
+        g->fd = -1;
+    }
+    g->gone = 1;
+    j = newjob(0);
+    j->seg = seg;
+    j->off = 0;
+    j->len = 0;
+    queuejob(j);
+}
+
+/* drop the sealed segments nobody needs, and compact one that is mostly dead
+ * A compacted segment only goes on a later call, once the writer has its
+ * copies in the files, and never if they were lost.
+ */
+static void compacttimer(void *arg) {
+    int seg, copied, compacted = 0;
+    addtimer(HISTORY_COMPACT_SECONDS * 1000LL, compacttimer, arg);
+    for (seg = firstseg; seg < curseg; seg++) {
+        if (segs[seg].gone) {
+            if (seg == firstseg) {
+                firstseg++;
+            }
+            continue;
+        }
+        if (segs[seg].live > 0 && !compacted
+            && segs[seg].live * 2 < (segs[seg].checked ? segs[seg].checked : segs[seg].refs)) {
+            pthread_mutex_lock(&histlock);
+            // Only once all of it is in the file
+            compacted = seg < writtenseg;
+            pthread_mutex_unlock(&histlock);
+            if (compacted) {
+                compactsegment(seg);
+            }
+        }
+        if (segs[seg].live == 0) {
+            pthread_mutex_lock(&histlock);
+            copied = written(segs[seg].copied.seg, segs[seg].copied.off);
+            pthread_mutex_unlock(&histlock);
+            if (copied) {
+                dropsegment(seg);
+            }
+        }
+    }
+}
+
+// A record loadhistory() has seen, to spot the copies compactsegment()
+// made of it
+struct histseen {
+    int id;
+    long long when;
+    struct histref at;
+    struct histseen *next;
+};
+
+/* index the record r loaded from at, unless it is a copy of one in seen
+ * (a crash after compacting a segment, before deleting it, leaves both),
+ * then the index moves to the copy and the old segment is left to go
+ * returns 1 if r is new
+ */
+static int loadrecord(struct histseen **seen, const struct histrec *r, struct histref at) {
+    unsigned int b = ((unsigned int)r->id ^ (unsigned int)r->when) % HISTORY_BUCKETS;
+    struct histseen *s;
+    int n;
+    for (s = seen[b]; s; s = s->next) {
+        if (s->id == r->id && s->when == r->when) {
+            n = moverefs(r, s->at, at);
+            segs[s->at.seg].live -= n;
+            segs[at.seg].live += n;
+            segs[at.seg].refs += n;
+            s->at = at;
+            return 0;
+        }
+    }
+    if ((s = malloc(sizeof(struct histseen))) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    s->id = r->id;
+    s->when = r->when;
+    s->at = at;
+    s->next = seen[b];
+    seen[b] = s;
+    indexrecord(r, at);
+    return 1;
+}
+
+static int segfilter(const struct dirent *d) {
+    return strlen(d->d_name) == 12 && strcmp(d->d_name + 8, ".seg") == 0;
+}
+
+/* read the segments in histdir back into the index, and start the writer */
+static void loadhistory(void) {
+    char path[PATH_MAX];
+    struct dirent **names;
+    struct histseen **seen, *s, *next;
+    struct histrec *r;
+    struct histref at;
+    pthread_t tid;
+    char *data;
+    int i, n, seg, size, nrecs = 0;
+    FILE *f;
+
+    if (mkdir(histdir, 0755) < 0 && errno != EEXIST) {
+        perror(histdir);
+        exit(1);
+    }
+    if ((n = scandir(histdir, &names, segfilter, alphasort)) < 0) {
+        perror(histdir);
+        exit(1);
+    }
+    if ((seen = calloc(HISTORY_BUCKETS, sizeof(struct histseen *))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    // Numbers missing from the directory are segments deleted already
+    for (seg = n > 0 ? atoi(names[n - 1]->d_name) : -1; seg >= 0; seg--) {
+        getseg(seg)->gone = 1;
+    }
+    for (i = 0; i < n; i++) {
+        seg = atoi(names[i]->d_name);
+        segpath(path, seg);
+        free(names[i]);
+        if ((f = fopen(path, "r")) == NULL) {
+            perror(path);
+            continue;
+        }
+        fseek(f, 0, SEEK_END);
+        size = ftell(f);
+        rewind(f);
+        if ((data = malloc(size + 1)) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        size = fread(data, 1, size, f);
+        fclose(f);
+        getseg(seg)->gone = 0;
+        at.seg = seg;
+        // A record cut short by a crash ends the segment, new ones go in the next
+        for (at.off = 0; validrecord((struct histrec *)(data + at.off), size - at.off); at.off += r->len) {
+            r = (struct histrec *)(data + at.off);
+            nrecs += loadrecord(seen, r, at);
+        }
+        segs[seg].size = at.off;
+        curseg = seg + 1;
+        free(data);
+    }
+    free(names);
+    for (i = 0; i < HISTORY_BUCKETS; i++) {
+        for (s = seen[i]; s; s = next) {
+            next = s->next;
+            free(s);
+        }
+    }
+    free(seen);
+    writtenseg = curseg;
+    writtenoff = 0;
+    if (pthread_create(&tid, NULL, historywriter, NULL) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+    pthread_detach(tid);
+    addtimer(HISTORY_COMPACT_SECONDS * 1000LL, compacttimer, NULL);
+    printf("Loaded %d matches from %d history segment(s) in %s\n", nrecs, n, histdir);
+}
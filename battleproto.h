@@ -0,0 +1,153 @@
+/*
+ * The binary protocol, shared by the server (battle.c) and its benchmark
+ * (protobench.c).
+ *
+ * The text protocol is the default. A client that sends PROTO_MAGIC as its
+ * very first byte (after the plain text greeting) speaks this one instead:
+ * everything both ways is then a frame of a type byte, the length of the
+ * payload (2 bytes, network order) and the payload.
+ *
+ *   PROTO_TEXT   client: a line of the text protocol without its newline,
+ *                a name, chat or a / command
+ *                server: a message, as the text protocol would send it
+ *   PROTO_MOVE   client: the move ('a' or 'p') and the seat to hit
+ *                (PROTO_ANY for the next enemy), 2 bytes
+ *                server: what happened, see struct proto_move, 4 bytes
+ *   PROTO_STATE  server: the receiver's match, see struct proto_state
+ *   PROTO_PING   either side: still there? No payload, answered with a
+ *                PROTO_PONG. A server started with -p pings clients it
+ *                hasn't heard from and drops the ones that don't answer.
+ *   PROTO_PONG   either side: the answer to a PROTO_PING, no payload
+ *
+ * The state and move frames replace the health lines, the move menu and
+ * the descriptions of moves in a match, everything else stays text.
+ *
+ * Like battlerules.h, everything in here is pure: the caller owns the
+ * buffers.
+ */
+#ifndef BATTLEPROTO_H
+#define BATTLEPROTO_H
+
+#define PROTO_MAGIC 0xfd
+#define PROTO_HEADER 3
+#define PROTO_SEATS 8
+#define PROTO_ANY 0xff
+// The longest frame a client may send
+#define PROTO_MAXIN 1024
+
+enum proto_type {
+    PROTO_TEXT = 1,
+    PROTO_MOVE,
+    PROTO_STATE,
+    PROTO_PING,
+    PROTO_PONG
+};
+
+// Someone's move, as the server reports it
+struct proto_move {
+    int seat;    // who moved
+    int target;  // who they hit
+    int move;    // 'a', 'p', or 'x' for a power move they didn't have
+    int damage;  // 0 for a miss
+};
+
+// A match as one of its players sees it, sent instead of the health lines
+// and the move menu
+struct proto_state {
+    int seat;         // the receiver's seat
+    int turn;         // the seat whose move it is
+    int size;         // seats in the match
+    int mode;
+    int power_moves;  // the receiver's
+    int health[PROTO_SEATS]; // -1 for an empty seat
+};
+
+#define PROTO_MOVE_LEN 4
+#define PROTO_STATE_LEN (5 + 2 * PROTO_SEATS)
+
+static inline int proto_header(unsigned char *buf, int type, int len) {
+    buf[0] = type;
+    buf[1] = len >> 8;
+    buf[2] = len;
+    return PROTO_HEADER;
+}
+
+/* look at the frame at the start of buf (len bytes of it)
+ * returns the length of the whole frame and sets *type and *plen, 0 if it
+ * isn't all there yet, -1 if it is longer than max
+ */
+static inline int proto_frame(const unsigned char *buf, int len, int max, int *type, int *plen) {
+    if (len < PROTO_HEADER) {
+        return 0;
+    }
+    *type = buf[0];
+    *plen = buf[1] << 8 | buf[2];
+    if (PROTO_HEADER + *plen > max) {
+        return -1;
+    }
+    return len < PROTO_HEADER + *plen ? 0 : PROTO_HEADER + *plen;
+}
+
+/* write a PROTO_MOVE frame for m into buf
+ * returns its length
+ */
+static inline int proto_encode_move(unsigned char *buf, const struct proto_move *m) {
+    unsigned char *p = buf + proto_header(buf, PROTO_MOVE, PROTO_MOVE_LEN);
+    p[0] = m->seat;
+    p[1] = m->target;
+    p[2] = m->move;
+    p[3] = m->damage;
+    return PROTO_HEADER + PROTO_MOVE_LEN;
+}
+
+/* returns 0, -1 if the payload isn't a move */
+static inline int proto_decode_move(const unsigned char *p, int len, struct proto_move *m) {
+    if (len != PROTO_MOVE_LEN) {
+        return -1;
+    }
+    m->seat = p[0];
+    m->target = p[1];
+    m->move = p[2];
+    m->damage = p[3];
+    return 0;
+}
+
+/* write a PROTO_STATE frame for s into buf, health is sent as 2 bytes
+ * with 0xffff for an empty seat
+ * returns its length
+ */
+static inline int proto_encode_state(unsigned char *buf, const struct proto_state *s) {
+    unsigned char *p = buf + proto_header(buf, PROTO_STATE, PROTO_STATE_LEN);
+    int i, h;
+    p[0] = s->seat;
+    p[1] = s->turn;
+    p[2] = s->size;
+    p[3] = s->mode;
+    p[4] = s->power_moves;
+    for (i = 0; i < PROTO_SEATS; i++) {
+        h = i < s->size && s->health[i] >= 0 ? (s->health[i] < 0xffff ? s->health[i] : 0xfffe) : 0xffff;
+        p[5 + 2 * i] = h >> 8;
+        p[6 + 2 * i] = h;
+    }
+    return PROTO_HEADER + PROTO_STATE_LEN;
+}
+
+/* returns 0, -1 if the payload isn't a state */
+static inline int proto_decode_state(const unsigned char *p, int len, struct proto_state *s) {
+    int i, h;
+    if (len != PROTO_STATE_LEN || p[2] > PROTO_SEATS) {
+        return -1;
+    }
+    s->seat = p[0];
+    s->turn = p[1];
+    s->size = p[2];
+    s->mode = p[3];
+    s->power_moves = p[4];
+    for (i = 0; i < PROTO_SEATS; i++) {
+        h = p[5 + 2 * i] << 8 | p[6 + 2 * i];
+        s->health[i] = h == 0xffff ? -1 : h;
+    }
+    return 0;
+}
+
+#endif
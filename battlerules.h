@@ -0,0 +1,61 @@
+/*
+ * The combat rules, shared by the server (battle.c) and the balance
+ * simulator (battlesim.c).
+ *
+ * Everything in here is pure: no I/O, no allocation and no hidden state.
+ * The caller owns the random number state and passes it in, so the same
+ * rules can drive one match on the server or millions in the simulator.
+ */
+#ifndef BATTLERULES_H
+#define BATTLERULES_H
+
+struct battle_rules {
+    int health_min;      // starting health is health_min + (0..health_range-1)
+    int health_range;
+    int powermoves_min;  // power moves per match, the same way
+    int powermoves_range;
+    int damage_min;      // damage of an attack, the same way
+    int damage_range;
+    int powermove_hit;   // percent chance a power move lands
+    int powermove_mult;  // a power move that lands does this many attacks' damage
+};
+
+// Health 20-30, 1-3 power moves, attacks 1-6, power moves 50% for 3x
+#define BATTLE_RULES_DEFAULT { 20, 11, 1, 3, 1, 6, 50, 3 }
+
+/* xorshift32, *state must never be 0
+ * returns a non-negative int
+ */
+static inline int rules_rand(unsigned int *state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return (int)(x >> 1);
+}
+
+static inline int rules_health(const struct battle_rules *r, unsigned int *rng) {
+    return r->health_min + rules_rand(rng) % r->health_range;
+}
+
+static inline int rules_powermoves(const struct battle_rules *r, unsigned int *rng) {
+    return r->powermoves_min + rules_rand(rng) % r->powermoves_range;
+}
+
+/* damage done by an attack */
+static inline int rules_attack(const struct battle_rules *r, unsigned int *rng) {
+    return r->damage_min + rules_rand(rng) % r->damage_range;
+}
+
+/* damage done by a power move, 0 if it missed
+ * (the damage is rolled either way, so every call uses the same amount of
+ * randomness and there is no branch for the simulator to trip over)
+ */
+static inline int rules_powermove(const struct battle_rules *r, unsigned int *rng) {
+    int hit = rules_rand(rng) % 100 < r->powermove_hit;
+    int dmg = rules_attack(r, rng) * r->powermove_mult;
+    return hit ? dmg : 0;
+}
+
+#endif
@@ -0,0 +1,237 @@
+/*
+ * battlesim: plays a huge number of matches with the server's combat rules
+ * (battlerules.h), no sockets involved, and reports who wins and how long
+ * matches last. Used for balance tuning.
+ *
+ * Usage: battlesim [-n matches] [-t threads] [-p percent] [-s seed]
+ *   -p: chance a player with power moves left uses one on their turn
+ *
+ * Every thread plays LANES matches side by side. The match state is kept as
+ * one array per field (structure of arrays) and each lane has its own random
+ * state, so a turn is the same straight-line code for every lane and the
+ * compiler can vectorize it. Finished lanes are scored and restarted with a
+ * fresh match in a separate pass.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "battlerules.h"
+
+# define LANES 256
+// Match lengths (in turns) are counted up to this, anything longer goes in the last bin
+# define MAXTURNS 128
+
+struct results {
+    long long matches;
+    long long firstwins;   // the player who attacks first won
+    long long healthier;   // matches where one player started with more health
+    long long healthwins;  // ... and that player won
+    long long stronger;    // matches where one player started with more power moves
+    long long strongwins;  // ... and that player won
+    long long turns[MAXTURNS];
+};
+
+struct worker {
+    pthread_t tid;
+    long long quota;
+    unsigned int seed;
+    int policy;
+    struct results res;
+};
+
+static const struct battle_rules rules = BATTLE_RULES_DEFAULT;
+
+/* splitmix32, spreads the thread seed over the lanes */
+static unsigned int mixseed(unsigned int x) {
+    x += 0x9e3779b9u;
+    x = (x ^ (x >> 16)) * 0x85ebca6bu;
+    x = (x ^ (x >> 13)) * 0xc2b2ae35u;
+    x ^= x >> 16;
+    return x ? x : 1;
+}
+
+static void *play(void *arg) {
+    struct worker *w = arg;
+    struct results *res = &w->res;
+    // Lane state: the attacker's and defender's health and power moves, swapped
+    // every turn, and which of them moved first
+    int hp_att[LANES], hp_def[LANES];
+    int pm_att[LANES], pm_def[LANES];
+    int firstatt[LANES];   // 1 if the attacker is the player who moved first
+    int turns[LANES];
+    int hpadv[LANES];      // sign of (first mover's health - other's health) at the start
+    int pmadv[LANES];      // the same for power moves
+    unsigned int rng[LANES];
+    long long done = 0;
+    int i;
+
+    memset(res, 0, sizeof(*res));
+    for (i = 0; i < LANES; i++) {
+        rng[i] = mixseed(w->seed * LANES + i);
+        turns[i] = -1; // start a match in the first pass below
+        hp_att[i] = 0;
+    }
+
+    while (done < w->quota) {
+        // Score finished lanes and deal them a new match
+        for (i = 0; i < LANES; i++) {
+            if (hp_att[i] > 0) {
+                continue;
+            }
+            if (turns[i] >= 0 && done < w->quota) {
+                // The attacker is the one who just got knocked out
+                int firstwon = !firstatt[i];
+                res->matches++;
+                res->firstwins += firstwon;
+                res->turns[turns[i] < MAXTURNS ? turns[i] : MAXTURNS - 1]++;
+                if (hpadv[i] != 0) {
+                    res->healthier++;
+                    res->healthwins += (hpadv[i] > 0) == firstwon;
+                }
+                if (pmadv[i] != 0) {
+                    res->stronger++;
+                    res->strongwins += (pmadv[i] > 0) == firstwon;
+                }
+                done++;
+            }
+            hp_att[i] = rules_health(&rules, &rng[i]);
+            pm_att[i] = rules_powermoves(&rules, &rng[i]);
+            hp_def[i] = rules_health(&rules, &rng[i]);
+            pm_def[i] = rules_powermoves(&rules, &rng[i]);
+            hpadv[i] = (hp_att[i] > hp_def[i]) - (hp_att[i] < hp_def[i]);
+            pmadv[i] = (pm_att[i] > pm_def[i]) - (pm_att[i] < pm_def[i]);
+            firstatt[i] = 1;
+            turns[i] = 0;
+        }
+        // One turn in every lane, no branches
+        for (i = 0; i < LANES; i++) {
+            unsigned int x = rng[i];
+            int usepm = (pm_att[i] > 0) & (rules_rand(&x) % 100 < w->policy);
+            int atk = rules_attack(&rules, &x);
+            int pmd = rules_powermove(&rules, &x);
+            int dmg = usepm ? pmd : atk;
+            int t;
+            pm_att[i] -= usepm;
+            hp_def[i] -= dmg;
+            turns[i]++;
+            rng[i] = x;
+            // The defender attacks next
+            t = hp_att[i]; hp_att[i] = hp_def[i]; hp_def[i] = t;
+            t = pm_att[i]; pm_att[i] = pm_def[i]; pm_def[i] = t;
+            firstatt[i] ^= 1;
+        }
+    }
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n matches] [-t threads] [-p percent] [-s seed]\n", prog);
+    exit(1);
+}
+
+/* the turn count below which pct of the matches finished */
+static int percentile(const struct results *res, double pct) {
+    long long seen = 0;
+    int t;
+    for (t = 0; t < MAXTURNS; t++) {
+        seen += res->turns[t];
+        if (seen >= res->matches * pct) {
+            return t;
+        }
+    }
+    return MAXTURNS - 1;
+}
+
+int main(int argc, char **argv) {
+    long long nmatches = 10000000;
+    int nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int policy = 50;
+    unsigned int seed = (unsigned int)time(NULL);
+    struct worker *workers;
+    struct results total;
+    struct timespec start, end;
+    double secs, mean = 0;
+    int i, t, opt, maxturn = 0;
+
+    while ((opt = getopt(argc, argv, "n:t:p:s:")) != -1) {
+        if (opt == 'n') {
+            nmatches = atoll(optarg);
+        } else if (opt == 't') {
+            nthreads = atoi(optarg);
+        } else if (opt == 'p') {
+            policy = atoi(optarg);
+        } else if (opt == 's') {
+            seed = (unsigned int)strtoul(optarg, NULL, 0);
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (nmatches <= 0 || nthreads <= 0 || policy < 0 || policy > 100) {
+        usage(argv[0]);
+    }
+
+    workers = calloc(nthreads, sizeof(struct worker));
+    if (!workers) {
+        perror("calloc");
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < nthreads; i++) {
+        workers[i].quota = nmatches / nthreads + (i < nmatches % nthreads);
+        workers[i].seed = mixseed(seed + i);
+        workers[i].policy = policy;
+        if (pthread_create(&workers[i].tid, NULL, play, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].tid, NULL);
+        total.matches += workers[i].res.matches;
+        total.firstwins += workers[i].res.firstwins;
+        total.healthier += workers[i].res.healthier;
+        total.healthwins += workers[i].res.healthwins;
+        total.stronger += workers[i].res.stronger;
+        total.strongwins += workers[i].res.strongwins;
+        for (t = 0; t < MAXTURNS; t++) {
+            total.turns[t] += workers[i].res.turns[t];
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    for (t = 0; t < MAXTURNS; t++) {
+        mean += (double)t * total.turns[t];
+        if (total.turns[t]) {
+            maxturn = t;
+        }
+    }
+    mean /= total.matches;
+
+    printf("%lld matches on %d threads in %.2f s (%.1fM matches/s), power move use %d%%\n",
+           total.matches, nthreads, secs, total.matches / secs / 1e6, policy);
+    printf("first attacker wins:   %6.2f%%\n", 100.0 * total.firstwins / total.matches);
+    printf("more health wins:      %6.2f%% (of %.1f%% of matches)\n",
+           100.0 * total.healthwins / (total.healthier ? total.healthier : 1),
+           100.0 * total.healthier / total.matches);
+    printf("more powermoves wins:  %6.2f%% (of %.1f%% of matches)\n",
+           100.0 * total.strongwins / (total.stronger ? total.stronger : 1),
+           100.0 * total.stronger / total.matches);
+    printf("turns per match:       mean %.2f, p50 %d, p90 %d, p99 %d, max %d%s\n",
+           mean, percentile(&total, 0.5), percentile(&total, 0.9), percentile(&total, 0.99),
+           maxturn, maxturn == MAXTURNS - 1 ? "+" : "");
+    printf("\nturns      matches   share\n");
+    for (t = 0; t <= maxturn; t++) {
+        if (total.turns[t]) {
+            printf("%5d %12lld  %5.2f%%\n", t, total.turns[t], 100.0 * total.turns[t] / total.matches);
+        }
+    }
+    free(workers);
+    return 0;
+}
@@ -0,0 +1,241 @@
+/*
+ * Fibers, see fiber.h.
+ *
+ * Stacks are mapped FIBER_CHUNK at a time and never unmapped, a free one
+ * waits on the pool for the next fiber. Each is FIBER_STACK bytes with a
+ * canary word and then the struct fiber at the very top, where the stack
+ * starts, so a fiber that is waiting in a shallow call costs a single page.
+ *
+ * There are no guard pages: one per stack would be two mappings per fiber,
+ * and a process only gets about 65536 of those. Instead every stack sits
+ * right on top of the canary of the one under it (the first in a chunk on
+ * a spare stack's worth of address space), the first thing an overflow
+ * writes. fiber_resume() checks it every time the fiber switches back, so
+ * an overflow anywhere in a deep call stops the server before the
+ * neighbour runs again. A fiber that is within FIBER_RED bytes of the
+ * bottom when it switches out stops it too. Only a frame that skips the
+ * canary without writing it gets past both.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "fiber.h"
+
+#define FIBER_CHUNK 64
+#define FIBER_RED (16 * 1024)
+#define FIBER_CANARY 0x5a17c0ded5a17c0dULL
+
+#if defined(__x86_64__)
+# define FIBER_ASM 1
+#else
+# define FIBER_ASM 0
+# include <ucontext.h>
+#endif
+
+// AddressSanitizer has to be told which stack it is on
+#if defined(__SANITIZE_ADDRESS__)
+# define FIBER_ASAN 1
+#elif defined(__has_feature)
+# if __has_feature(address_sanitizer)
+#  define FIBER_ASAN 1
+# endif
+#endif
+#ifdef FIBER_ASAN
+# include <sanitizer/common_interface_defs.h>
+#endif
+
+struct fiber {
+#if FIBER_ASM
+    void *sp;     // the fiber's saved stack pointer while it isn't running
+    void *back;   // and its resumer's while it is
+#else
+    ucontext_t ctx;
+    ucontext_t back;
+#endif
+    char *stack;  // the bottom of the stack
+    int (*fn)(void *);
+    void *arg;
+    int value;    // what the last yield or the return passed out
+    int done;
+    struct fiber *next_free;
+#ifdef FIBER_ASAN
+    void *fake;
+    const void *backbase;
+    size_t backsize;
+#endif
+};
+
+static struct fiber *freefibers = NULL;
+static struct fiber *current = NULL; // the fiber running now, NULL outside any
+
+#ifdef FIBER_ASAN
+# define SWITCHING(fake, base, size) __sanitizer_start_switch_fiber(fake, base, size)
+# define SWITCHED(fake, base, size) __sanitizer_finish_switch_fiber(fake, base, size)
+#else
+# define SWITCHING(fake, base, size)
+# define SWITCHED(fake, base, size)
+#endif
+
+/* the stack below f, as AddressSanitizer wants to hear about it */
+#define STACKBASE(f) ((f)->stack)
+#define STACKSIZE(f) ((size_t)((char *)(f) - (f)->stack))
+
+/* the canary under f's stack */
+#define CANARY(f) ((uint64_t *)(f)->stack - 1)
+
+/* give up if f, which is running, has come close to the bottom of its stack */
+static void checkstack(struct fiber *f) {
+    char here;
+    if (&here < f->stack + FIBER_RED) {
+        fprintf(stderr, "fiber is about to overflow its stack\n");
+        abort();
+    }
+}
+
+#if FIBER_ASM
+/* push the callee-saved registers, leave the stack pointer in *from, pick
+ * up to's and pop its registers. The return lands wherever to last called
+ * this, or in fiber_start() for a new fiber.
+ */
+__attribute__((naked, noinline)) static void fiber_switch(void **from, void *to) {
+    __asm__ volatile(
+        "pushq %rbp\n\t"
+        "pushq %rbx\n\t"
+        "pushq %r12\n\t"
+        "pushq %r13\n\t"
+        "pushq %r14\n\t"
+        "pushq %r15\n\t"
+        "movq %rsp, (%rdi)\n\t"
+        "movq %rsi, %rsp\n\t"
+        "popq %r15\n\t"
+        "popq %r14\n\t"
+        "popq %r13\n\t"
+        "popq %r12\n\t"
+        "popq %rbx\n\t"
+        "popq %rbp\n\t"
+        "ret\n\t");
+}
+#endif
+
+/* where every fiber begins, on its own stack */
+static void fiber_start(void) {
+    struct fiber *f = current;
+    SWITCHED(NULL, &f->backbase, &f->backsize);
+    f->value = f->fn(f->arg);
+    f->done = 1;
+    checkstack(f);
+    // The stack is finished with, nothing comes back to it
+    SWITCHING(NULL, f->backbase, f->backsize);
+#if FIBER_ASM
+    fiber_switch(&f->sp, f->back);
+#else
+    setcontext(&f->back);
+#endif
+    abort();
+}
+
+struct fiber *fiber_new(int (*fn)(void *), void *arg) {
+    struct fiber *f;
+    char *map, *stack;
+    int i;
+#if FIBER_ASM
+    void **sp;
+#endif
+    if (freefibers == NULL) {
+        // Untouched pages cost nothing, so a chunk is cheap until it is used,
+        // the spare stack under the first one only holds its canary
+        map = mmap(NULL, (size_t)(FIBER_CHUNK + 1) * FIBER_STACK, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        for (i = FIBER_CHUNK - 1; i >= 0; i--) {
+            // The stack grows down from just under the struct, which is
+            // under the canary for the stack above
+            stack = map + (size_t)(i + 1) * FIBER_STACK;
+            f = (struct fiber *)(((uintptr_t)(stack + FIBER_STACK) - sizeof(uint64_t) - sizeof(struct fiber))
+                                 & ~(uintptr_t)63);
+            f->stack = stack;
+            *CANARY(f) = FIBER_CANARY;
+            f->next_free = freefibers;
+            freefibers = f;
+        }
+    }
+    f = freefibers;
+    freefibers = f->next_free;
+    stack = f->stack;
+    memset(f, 0, sizeof(*f));
+    f->stack = stack;
+    f->fn = fn;
+    f->arg = arg;
+#if FIBER_ASM
+    // A frame for fiber_switch() to pop: six registers, then fiber_start()
+    // to return to, entered with the stack aligned as if it had been called
+    sp = (void **)((uintptr_t)f & ~(uintptr_t)15);
+    *--sp = NULL;
+    *--sp = (void *)fiber_start;
+    for (i = 0; i < 6; i++) {
+        *--sp = NULL;
+    }
+    f->sp = sp;
+#else
+    if (getcontext(&f->ctx) < 0) {
+        perror("getcontext");
+        exit(1);
+    }
+    f->ctx.uc_stack.ss_sp = STACKBASE(f);
+    f->ctx.uc_stack.ss_size = STACKSIZE(f);
+    f->ctx.uc_link = NULL;
+    makecontext(&f->ctx, fiber_start, 0);
+#endif
+    return f;
+}
+
+int fiber_resume(struct fiber *f) {
+    struct fiber *prev = current;
+#ifdef FIBER_ASAN
+    void *fake = NULL;
+#endif
+    current = f;
+    SWITCHING(&fake, STACKBASE(f), STACKSIZE(f));
+#if FIBER_ASM
+    fiber_switch(&f->back, f->sp);
+#else
+    swapcontext(&f->back, &f->ctx);
+#endif
+    SWITCHED(fake, NULL, NULL);
+    current = prev;
+    if (*CANARY(f) != FIBER_CANARY) {
+        fprintf(stderr, "fiber overflowed its stack\n");
+        abort();
+    }
+    return f->value;
+}
+
+void fiber_yield(int value) {
+    struct fiber *f = current;
+    f->value = value;
+    checkstack(f);
+    SWITCHING(&f->fake, f->backbase, f->backsize);
+#if FIBER_ASM
+    fiber_switch(&f->sp, f->back);
+#else
+    swapcontext(&f->ctx, &f->back);
+#endif
+    // Whoever resumes us next may be on another stack
+    SWITCHED(f->fake, &f->backbase, &f->backsize);
+}
+
+int fiber_done(struct fiber *f) {
+    return f->done;
+}
+
+void fiber_free(struct fiber *f) {
+    f->next_free = freefibers;
+    freefibers = f;
+}
@@ -0,0 +1,44 @@
+/*
+ * Fibers: stackful coroutines for the server (battle.c) and their
+ * benchmark (fiberbench.c).
+ *
+ * A fiber runs fn(arg) on a stack of its own. fiber_resume() runs it until
+ * it calls fiber_yield() or returns, and hands back the value it passed
+ * out. Nothing is scheduled behind the caller's back: the event loop
+ * resumes a fiber when there is something for it, which is all it takes
+ * to write a conversation with a client as straight-line code.
+ *
+ * Stacks are FIBER_STACK bytes of address space, only what a fiber
+ * actually touches costs memory, and they go back to a pool when the fiber
+ * is freed, so starting one is usually just a few stores.
+ * On x86-64 a switch saves and restores the callee-saved registers by hand,
+ * elsewhere it falls back to ucontext.
+ */
+#ifndef FIBER_H
+#define FIBER_H
+
+// Address space per fiber
+#define FIBER_STACK (64 * 1024)
+
+struct fiber;
+
+/* a fiber that will run fn(arg) once it is resumed, exits on error */
+struct fiber *fiber_new(int (*fn)(void *), void *arg);
+
+/* run f until it yields or returns
+ * returns the value it yielded or returned
+ */
+int fiber_resume(struct fiber *f);
+
+/* from inside a fiber: go back to whoever resumed it, with value */
+void fiber_yield(int value);
+
+/* returns 1 once f's function has returned */
+int fiber_done(struct fiber *f);
+
+/* let go of f, which must not be running. A fiber that hasn't returned is
+ * just dropped: whatever was on its stack is gone.
+ */
+void fiber_free(struct fiber *f);
+
+#endif
@@ -0,0 +1,140 @@
+/*
+ * fiberbench: what the fibers in fiber.h cost, in time to start one, time
+ * to switch to one and back, and memory for a lot of them waiting at once
+ * the way connections wait for their next line.
+ *
+ * Usage: fiberbench [-n fibers] [-r rounds]
+ *
+ * Every fiber yields in a loop. Each round resumes all of them once, so
+ * a round is two switches per fiber, spread over n stacks like the
+ * server's connections. The same switches on one warm fiber are timed
+ * too, which is what a switch costs once the caches are out of it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "fiber.h"
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n fibers] [-r rounds]\n", prog);
+    exit(1);
+}
+
+static double elapsed(struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* resident memory in bytes, from /proc */
+static long resident(void) {
+    long pages = 0, rss = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == NULL) {
+        return 0;
+    }
+    if (fscanf(f, "%ld %ld", &pages, &rss) != 2) {
+        rss = 0;
+    }
+    fclose(f);
+    return rss * sysconf(_SC_PAGESIZE);
+}
+
+/* counts its resumes into *arg until it is told to stop */
+static int counter(void *arg) {
+    long *n = arg;
+    while (*n >= 0) {
+        (*n)++;
+        fiber_yield(0);
+    }
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    long nfibers = 100000, rounds = 20, i, r, total = 0;
+    struct fiber **fibers;
+    struct timespec start;
+    long *counts;
+    long before, parked;
+    double create, run, restart, warm;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+        if (opt == 'n') {
+            nfibers = atol(optarg);
+        } else if (opt == 'r') {
+            rounds = atol(optarg);
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (nfibers <= 0 || rounds <= 0) {
+        usage(argv[0]);
+    }
+    fibers = malloc(nfibers * sizeof(struct fiber *));
+    counts = calloc(nfibers, sizeof(long));
+    if (fibers == NULL || counts == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    before = resident();
+
+    // Starting: a fresh stack and the first run up to the first yield
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < nfibers; i++) {
+        fibers[i] = fiber_new(counter, &counts[i]);
+        fiber_resume(fibers[i]);
+    }
+    create = elapsed(&start);
+    parked = resident() - before;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < nfibers; i++) {
+            fiber_resume(fibers[i]);
+        }
+    }
+    run = elapsed(&start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (r = 0; r < nfibers * rounds; r++) {
+        fiber_resume(fibers[0]);
+    }
+    warm = elapsed(&start);
+    counts[0] -= nfibers * rounds;
+
+    // Finishing them all, and starting them again on stacks from the pool
+    for (i = 0; i < nfibers; i++) {
+        counts[i] = -1;
+        fiber_resume(fibers[i]);
+        if (!fiber_done(fibers[i])) {
+            fprintf(stderr, "fiber %ld didn't finish\n", i);
+            return 1;
+        }
+        fiber_free(fibers[i]);
+        counts[i] = 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < nfibers; i++) {
+        fibers[i] = fiber_new(counter, &counts[i]);
+        fiber_resume(fibers[i]);
+    }
+    restart = elapsed(&start);
+    for (i = 0; i < nfibers; i++) {
+        total += counts[i];
+        fiber_free(fibers[i]);
+    }
+
+    printf("%ld fibers, %ld rounds\n", nfibers, rounds);
+    printf("start, new stack      %8.1f ns\n", create * 1e9 / nfibers);
+    printf("start, pooled stack   %8.1f ns\n", restart * 1e9 / nfibers);
+    printf("resume + yield        %8.1f ns\n", run * 1e9 / (nfibers * rounds));
+    printf("  on one warm fiber   %8.1f ns\n", warm * 1e9 / (nfibers * rounds));
+    printf("resident per fiber    %8.1f bytes (%ld MB for all of them)\n",
+           (double)parked / nfibers, parked >> 20);
+    free(fibers);
+    free(counts);
+    return total == nfibers ? 0 : 1;
+}
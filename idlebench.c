@@ -0,0 +1,246 @@
+/*
+ * idlebench: what an idle connection costs the server (battle.c) in
+ * resident memory.
+ *
+ * Usage: idlebench [-s server] [-n count[,count...]]
+ *
+ * Starts the server with a unix socket of its own, connects to it as a
+ * gateway and opens sessions that never say anything, the way most of a
+ * lobby sits there. At each count (100000 and 1000000 unless told
+ * otherwise) it waits until the server has greeted every session and
+ * reads the server's resident size from /proc, so a session is charged
+ * for everything the server keeps for it: its client, its handle, its
+ * place in the session table and whatever buffers it holds on to.
+ * Sessions go through one gateway so a million of them don't need a
+ * million sockets, the server keeps the same struct client for either.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+// The gateway side of the protocol, as battle.c speaks it
+#define GATEWAY_MAGIC 0xfe
+#define GW_OPEN 1
+#define GW_HEADER 8
+
+#define MAX_COUNTS 16
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-s server] [-n count[,count...]]\n", prog);
+    exit(1);
+}
+
+static double elapsed(struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* resident memory of pid in bytes, from /proc */
+static long resident(pid_t pid) {
+    char path[64];
+    long pages = 0, rss = 0;
+    FILE *f;
+    sprintf(path, "/proc/%d/statm", (int)pid);
+    if ((f = fopen(path, "r")) == NULL) {
+        return 0;
+    }
+    if (fscanf(f, "%ld %ld", &pages, &rss) != 2) {
+        rss = 0;
+    }
+    fclose(f);
+    return rss * sysconf(_SC_PAGESIZE);
+}
+
+/* run server on the unix socket path, with its log thrown away */
+static pid_t startserver(const char *server, const char *path) {
+    pid_t pid = fork();
+    int null;
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        // It logs every session it adds
+        if ((null = open("/dev/null", O_WRONLY)) >= 0) {
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        execl(server, server, "-u", path, (char *)NULL);
+        _exit(127);
+    }
+    return pid;
+}
+
+/* connect to path once the server is listening on it, exits if it dies first */
+static int connectserver(pid_t pid, const char *path) {
+    struct sockaddr_un u;
+    int fd, i, status;
+    memset(&u, 0, sizeof(u));
+    u.sun_family = AF_UNIX;
+    strcpy(u.sun_path, path);
+    for (i = 0; i < 500; i++) {
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+            perror("socket");
+            exit(1);
+        }
+        if (connect(fd, (struct sockaddr *)&u, sizeof(u)) == 0) {
+            return fd;
+        }
+        close(fd);
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            fprintf(stderr, "the server exited (is another one on its port?)\n");
+            exit(1);
+        }
+        usleep(10000);
+    }
+    fprintf(stderr, "the server never started listening on %s\n", path);
+    exit(1);
+}
+
+/* read the server's greeting and turn the connection into a gateway */
+static void becomegateway(int fd) {
+    unsigned char magic = GATEWAY_MAGIC;
+    char c;
+    do {
+        if (read(fd, &c, 1) != 1) {
+            fprintf(stderr, "the server hung up\n");
+            exit(1);
+        }
+    } while (c != '\n');
+    if (write(fd, &magic, 1) != 1) {
+        perror("write");
+        exit(1);
+    }
+}
+
+/* open sessions up to total on the gateway fd, counting the frames that
+ * come back in *frames, until every session has been greeted
+ */
+static void opensessions(int fd, unsigned int *opened, unsigned int total, long *frames) {
+    static unsigned char in[65536];
+    static int inlen = 0;
+    unsigned char out[GW_HEADER * 1024];
+    struct pollfd pfd;
+    unsigned int s;
+    int n, len, off, outlen = 0, outoff = 0;
+
+    while (*frames < (long)total) {
+        // Whatever hasn't gone out yet first, then the next batch of opens
+        if (outoff == outlen && *opened < total) {
+            outlen = outoff = 0;
+            while (outlen < (int)sizeof(out) && *opened < total) {
+                s = ++*opened;
+                memset(out + outlen, 0, GW_HEADER);
+                out[outlen] = s >> 24;
+                out[outlen + 1] = s >> 16;
+                out[outlen + 2] = s >> 8;
+                out[outlen + 3] = s;
+                out[outlen + 4] = GW_OPEN;
+                outlen += GW_HEADER;
+            }
+        }
+        pfd.fd = fd;
+        pfd.events = POLLIN | (outoff < outlen ? POLLOUT : 0);
+        if (poll(&pfd, 1, 10000) <= 0) {
+            fprintf(stderr, "the server stopped answering at %ld sessions\n", *frames);
+            exit(1);
+        }
+        if (pfd.revents & POLLOUT) {
+            n = send(fd, out + outoff, outlen - outoff, MSG_DONTWAIT);
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                perror("send");
+                exit(1);
+            }
+            outoff += n > 0 ? n : 0;
+        }
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            // Keep up with the greetings or the server cuts the gateway off
+            if ((n = read(fd, in + inlen, sizeof(in) - inlen)) <= 0) {
+                fprintf(stderr, "the server hung up at %ld sessions\n", *frames);
+                exit(1);
+            }
+            inlen += n;
+            for (off = 0; inlen - off >= GW_HEADER; off += GW_HEADER + len) {
+                len = in[off + 6] << 8 | in[off + 7];
+                if (inlen - off < GW_HEADER + len) {
+                    break;
+                }
+                (*frames)++;
+            }
+            memmove(in, in + off, inlen - off);
+            inlen -= off;
+        }
+    }
+}
+
+static int bycount(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv) {
+    const char *server = "./battle";
+    unsigned int counts[MAX_COUNTS] = { 100000, 1000000 };
+    int ncounts = 2, i, fd, opt;
+    unsigned int opened = 0;
+    long frames = 0, before, rss;
+    char path[64], *s, *end;
+    struct timespec start;
+    pid_t pid;
+
+    while ((opt = getopt(argc, argv, "s:n:")) != -1) {
+        if (opt == 's') {
+            server = optarg;
+        } else if (opt == 'n') {
+            for (ncounts = 0, s = optarg; *s && ncounts < MAX_COUNTS; s = *end ? end + 1 : end) {
+                counts[ncounts] = (unsigned int)strtoul(s, &end, 10);
+                if (end == s || counts[ncounts] == 0) {
+                    usage(argv[0]);
+                }
+                ncounts++;
+            }
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (ncounts == 0) {
+        usage(argv[0]);
+    }
+    qsort(counts, ncounts, sizeof(counts[0]), bycount);
+
+    snprintf(path, sizeof(path), "/tmp/idlebench.%d.sock", (int)getpid());
+    unlink(path);
+    pid = startserver(server, path);
+    fd = connectserver(pid, path);
+    becomegateway(fd);
+    // Give the server a moment to settle before its baseline
+    usleep(200000);
+    before = resident(pid);
+
+    printf("%10s %12s %12s %10s\n", "sessions", "resident MB", "bytes each", "open us");
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < ncounts; i++) {
+        opensessions(fd, &opened, counts[i], &frames);
+        rss = resident(pid);
+        printf("%10u %12.1f %12.1f %10.2f\n", counts[i], rss / 1048576.0,
+               (double)(rss - before) / counts[i], elapsed(&start) * 1e6 / counts[i]);
+        fflush(stdout);
+    }
+
+    close(fd);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,431 @@
+/*
+ * loadgen: plays the server (battle.c) with a crowd of clients, some of
+ * them misbehaving, and reports how long the well-behaved ones wait for
+ * their moves to be answered.
+ *
+ * Usage: loadgen [-s server] [-n players] [-d seconds] [-f slow,trickle,flood,drop]
+ *
+ * Every run starts the server with a unix socket of its own. Good players
+ * play duel after duel as fast as the rate limits let them, and a turn's
+ * latency is the time from sending the move to the first bytes of the
+ * answer. -f gives each kind of bad player as a percentage of the players
+ * (10,10,5,10 unless told otherwise):
+ *   slow     reads SLOW_READ bytes a second and keeps asking for /matches
+ *   trickle  sends its name and then commands one byte a second
+ *   flood    sends its name and then a line that never ends
+ *   drop     plays, but now and then hangs up when it is its turn and
+ *            comes back as someone new
+ * The good players play once on their own and once among the bad ones,
+ * so head-of-line blocking shows up as the difference between the two.
+ * A server that ends the run itself with 0, like battle-alloccheck once
+ * its turns were clean, ends loadgen with 0 as well (make check-alloc).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+// The server watches its sockets with select(), which stops at 1024
+#define MAX_PLAYERS 900
+#define PLAYER_BUF 4096
+// Seconds between commands, under the server's 5 a second
+#define COMMAND_GAP 0.21
+#define SLOW_READ 64
+#define FLOOD_CHUNK 4096
+// A drop player hangs up on one turn in DROP_ODDS
+#define DROP_ODDS 4
+
+enum kind { GOOD, SLOW, TRICKLE, FLOOD, DROP, NKINDS };
+
+static const char *kindnames[NKINDS] = { "good", "slow", "trickle", "flood", "drop" };
+
+struct player {
+    int fd;
+    enum kind kind;
+    char buf[PLAYER_BUF]; // what came in since the last thing we acted on
+    int buflen;
+    char next[16];        // what to send at due, nothing while due is 0
+    double due;
+    int move;             // next is a move, time its answer
+    double sent;          // when the move went, 0 if no answer is awaited
+    double lastsend;
+    double lastread;      // slow players only read once a second
+    int lobby;            // last heard of waiting for an opponent
+    char script[64];      // what a trickle player has left to send
+    int scriptoff;
+};
+
+// What one run saw
+struct results {
+    int players;
+    long nlat;
+    long maxlat;
+    double *lat;          // turn latencies in seconds
+    long hangups;
+};
+
+static char sockpath[64];
+static int serial = 0;
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-s server] [-n players] [-d seconds] [-f slow,trickle,flood,drop]\n", prog);
+    exit(1);
+}
+
+/* seconds on the monotonic clock */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* run server on the unix socket path, with its log thrown away */
+static pid_t startserver(const char *server, const char *path) {
+    pid_t pid = fork();
+    int null;
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        if ((null = open("/dev/null", O_WRONLY)) >= 0) {
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        execl(server, server, "-u", path, (char *)NULL);
+        _exit(127);
+    }
+    return pid;
+}
+
+/* connect to path, waiting for the server pid to start listening on it,
+ * exits if it is gone: with 0 if it ended the run itself with 0 (as
+ * battle-alloccheck does once it has seen enough turns), 1 otherwise
+ */
+static int connectserver(pid_t pid, const char *path) {
+    struct sockaddr_un u;
+    int fd, i, status;
+    memset(&u, 0, sizeof(u));
+    u.sun_family = AF_UNIX;
+    strcpy(u.sun_path, path);
+    for (i = 0; i < 500; i++) {
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+            perror("socket");
+            exit(1);
+        }
+        if (connect(fd, (struct sockaddr *)&u, sizeof(u)) == 0) {
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            return fd;
+        }
+        close(fd);
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            unlink(path);
+            if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+                printf("the server finished on its own\n");
+                exit(0);
+            }
+            if (WIFSIGNALED(status)) {
+                fprintf(stderr, "the server was killed by signal %d\n", WTERMSIG(status));
+            } else {
+                fprintf(stderr, "the server exited with %d (is another one on its port?)\n", WEXITSTATUS(status));
+            }
+            exit(1);
+        }
+        usleep(10000);
+    }
+    fprintf(stderr, "the server never started listening on %s\n", path);
+    exit(1);
+}
+
+/* send what p has ready, whatever doesn't fit is lost like a client that
+ * gave up on it would lose it
+ */
+static void say(struct player *p, const char *s) {
+    if (send(p->fd, s, strlen(s), MSG_DONTWAIT) < 0 && errno != EAGAIN) {
+        // Reading will find out it is gone
+        return;
+    }
+    p->lastsend = now();
+}
+
+/* have p send s as soon as the rate limit allows */
+static void plan(struct player *p, const char *s, int move) {
+    double t = now();
+    strcpy(p->next, s);
+    p->move = move;
+    p->due = p->lastsend + COMMAND_GAP > t ? p->lastsend + COMMAND_GAP : t;
+}
+
+/* connect a new player of kind k to the server pid in slot p */
+static void join(struct player *p, enum kind k, pid_t pid) {
+    char name[32];
+    memset(p, 0, sizeof(*p));
+    p->kind = k;
+    p->fd = connectserver(pid, sockpath);
+    sprintf(name, "%c%d\n", kindnames[k][0], ++serial);
+    if (k == TRICKLE) {
+        // The name too, one byte at a time
+        snprintf(p->script, sizeof(p->script), "%s/rooms\n", name);
+        p->due = now() + 1;
+    } else {
+        say(p, name);
+    }
+}
+
+static void record(struct results *r, double lat) {
+    if (r->nlat == r->maxlat) {
+        r->maxlat = r->maxlat ? r->maxlat * 2 : 4096;
+        if ((r->lat = realloc(r->lat, r->maxlat * sizeof(double))) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    r->lat[r->nlat++] = lat;
+}
+
+/* read what has come for p and act on it
+ * returns 0 once the server has hung up on p
+ */
+static int hear(struct player *p, struct results *r, pid_t pid) {
+    char junk[PLAYER_BUF];
+    int n, room = PLAYER_BUF - 1 - p->buflen;
+    double t = now();
+    if (p->kind == SLOW && room > SLOW_READ) {
+        room = SLOW_READ;
+    }
+    if (p->kind == FLOOD || p->kind == TRICKLE) {
+        // Only what it is sending matters to it
+        n = read(p->fd, junk, sizeof(junk));
+        return n != 0 && (n > 0 || errno == EAGAIN);
+    }
+    n = read(p->fd, p->buf + p->buflen, room);
+    if (n == 0 || (n < 0 && errno != EAGAIN)) {
+        return 0;
+    }
+    if (n < 0) {
+        return 1;
+    }
+    p->lastread = t;
+    if (p->sent > 0) {
+        record(r, t - p->sent);
+        p->sent = 0;
+    }
+    p->buflen += n;
+    p->buf[p->buflen] = '\0';
+    if (strstr(p->buf, "(m)mute opponent") != NULL) {
+        // Our turn
+        p->buflen = 0;
+        p->lobby = 0;
+        if (p->kind == DROP && rand() % DROP_ODDS == 0) {
+            close(p->fd);
+            r->hangups++;
+            join(p, DROP, pid);
+            return 1;
+        }
+        plan(p, "a\n", p->kind == GOOD);
+    } else if (strstr(p->buf, "Awaiting opponent") != NULL) {
+        // In the lobby, a line is another go at matchmaking, a slow reader
+        // would rather have the server write it a lot
+        p->buflen = 0;
+        p->lobby = 1;
+        plan(p, p->kind == SLOW ? "/matches\n" : "a\n", 0);
+    } else if (p->buflen > PLAYER_BUF / 2) {
+        // Keep enough of the end for a marker that is split across reads
+        memmove(p->buf, p->buf + p->buflen - 32, 32);
+        p->buflen = 32;
+        p->buf[p->buflen] = '\0';
+    }
+    return 1;
+}
+
+/* whatever p is due to send now */
+static void act(struct player *p) {
+    static char flood[FLOOD_CHUNK];
+    char c[2];
+    double t = now();
+    if (p->kind == FLOOD) {
+        if (flood[0] == '\0') {
+            memset(flood, 'x', sizeof(flood));
+        }
+        send(p->fd, flood, sizeof(flood), MSG_DONTWAIT);
+        return;
+    }
+    if (p->kind == SLOW && p->lobby && p->due == 0) {
+        // and keeps asking for more of it
+        plan(p, "/matches\n", 0);
+    }
+    if (p->due == 0 || p->due > t) {
+        return;
+    }
+    if (p->kind == TRICKLE) {
+        c[0] = p->script[p->scriptoff++];
+        c[1] = '\0';
+        say(p, c);
+        if (p->script[p->scriptoff] == '\0') {
+            // From the name on to /rooms, over and over
+            p->scriptoff = strchr(p->script, '\n') + 1 - p->script;
+        }
+        p->due = t + 1;
+        return;
+    }
+    say(p, p->next);
+    p->due = 0;
+    if (p->move) {
+        p->sent = now();
+    }
+}
+
+/* play the players in counts (by kind) against a fresh server for seconds */
+static void run(const char *server, int *counts, double seconds, struct results *r) {
+    struct player *players;
+    struct pollfd *pfds;
+    int i, j, k, n = 0;
+    double end;
+    pid_t pid;
+
+    memset(r, 0, sizeof(*r));
+    for (k = 0; k < NKINDS; k++) {
+        n += counts[k];
+    }
+    r->players = n;
+    players = calloc(n, sizeof(struct player));
+    pfds = calloc(n, sizeof(struct pollfd));
+    if (players == NULL || pfds == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    snprintf(sockpath, sizeof(sockpath), "/tmp/loadgen.%d.sock", (int)getpid());
+    unlink(sockpath);
+    pid = startserver(server, sockpath);
+    // Bad players first, so they are already at it when the good ones arrive
+    for (k = NKINDS - 1, i = 0; k >= 0; k--) {
+        for (j = 0; j < counts[k]; j++) {
+            join(&players[i++], k, pid);
+        }
+    }
+
+    end = now() + seconds;
+    while (now() < end) {
+        for (i = 0; i < n; i++) {
+            pfds[i].fd = players[i].fd;
+            pfds[i].events = POLLIN;
+            // A slow reader looks at its socket once a second
+            if (players[i].kind == SLOW && now() - players[i].lastread < 1) {
+                pfds[i].events = 0;
+            }
+            if (players[i].kind == FLOOD) {
+                pfds[i].events |= POLLOUT;
+            }
+        }
+        if (poll(pfds, n, 10) < 0 && errno != EINTR) {
+            perror("poll");
+            exit(1);
+        }
+        for (i = 0; i < n; i++) {
+            if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                if (!hear(&players[i], r, pid)) {
+                    // The server gave up on it, somebody else takes its place
+                    close(players[i].fd);
+                    join(&players[i], players[i].kind, pid);
+                    continue;
+                }
+            }
+            if (players[i].kind != FLOOD || (pfds[i].revents & POLLOUT)) {
+                act(&players[i]);
+            }
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        close(players[i].fd);
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    unlink(sockpath);
+    free(players);
+    free(pfds);
+}
+
+static int bylatency(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *label, struct results *r, double seconds) {
+    double p50 = 0, p99 = 0, max = 0;
+    if (r->nlat > 0) {
+        qsort(r->lat, r->nlat, sizeof(double), bylatency);
+        p50 = r->lat[r->nlat / 2];
+        p99 = r->lat[r->nlat * 99 / 100];
+        max = r->lat[r->nlat - 1];
+    }
+    printf("%-18s %8d %10.1f %10.3f %10.3f %10.3f\n", label, r->players,
+           r->nlat / seconds, p50 * 1e3, p99 * 1e3, max * 1e3);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    const char *server = "./battle";
+    int percent[NKINDS] = { 0, 10, 10, 5, 10 };
+    int counts[NKINDS], alone[NKINDS] = { 0 };
+    int nplayers = 200, opt, k;
+    double seconds = 20;
+    struct results clean, faulty;
+    char *s, *end;
+
+    while ((opt = getopt(argc, argv, "s:n:d:f:")) != -1) {
+        if (opt == 's') {
+            server = optarg;
+        } else if (opt == 'n') {
+            nplayers = atoi(optarg);
+        } else if (opt == 'd') {
+            seconds = atof(optarg);
+        } else if (opt == 'f') {
+            for (k = SLOW, s = optarg; k < NKINDS; k++, s = *end ? end + 1 : end) {
+                percent[k] = (int)strtol(s, &end, 10);
+                if (end == s || percent[k] < 0 || (*end != ',' && *end != '\0')) {
+                    usage(argv[0]);
+                }
+            }
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (nplayers < 2 || nplayers > MAX_PLAYERS || seconds <= 0) {
+        usage(argv[0]);
+    }
+    counts[GOOD] = nplayers;
+    for (k = SLOW; k < NKINDS; k++) {
+        counts[k] = nplayers * percent[k] / 100;
+        counts[GOOD] -= counts[k];
+    }
+    if (counts[GOOD] < 2) {
+        fprintf(stderr, "that leaves nobody to measure, keep the bad players under 100%%\n");
+        exit(1);
+    }
+    alone[GOOD] = counts[GOOD];
+    // A write to a player the server has hung up on should just fail
+    signal(SIGPIPE, SIG_IGN);
+    srand(getpid());
+
+    printf("%d good players, %d slow, %d trickle, %d flood, %d drop, %.0f seconds a run\n",
+           counts[GOOD], counts[SLOW], counts[TRICKLE], counts[FLOOD], counts[DROP], seconds);
+    printf("%-18s %8s %10s %10s %10s %10s\n", "", "players", "turns/s", "p50 ms", "p99 ms", "max ms");
+    run(server, alone, seconds, &clean);
+    report("alone", &clean, seconds);
+    run(server, counts, seconds, &faulty);
+    report("among bad players", &faulty, seconds);
+    printf("drop players hung up %ld times\n", faulty.hangups);
+    free(clean.lat);
+    free(faulty.lat);
+    return 0;
+}
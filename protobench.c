@@ -0,0 +1,249 @@
+/*
+ * protobench: compares what a turn of a duel costs in the text protocol and
+ * in the binary one (battleproto.h), in bytes on the wire and in CPU time
+ * to build the messages and to read them back the way a client would.
+ *
+ * Usage: protobench [-n turns] [-s seed]
+ *
+ * Matches are played with the server's rules (battlerules.h). The text
+ * path formats the same lines battle.c sends both players after a move
+ * (describemove() and turnupdate()) and the client side digs the numbers
+ * back out of them. The binary path builds and decodes the move and state
+ * frames that replace those lines.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "battlerules.h"
+#include "battleproto.h"
+
+static const struct battle_rules rules = BATTLE_RULES_DEFAULT;
+static const char menu[] = "\n(a)ttack\n(p)owermove\n(s)peak something\n(m)mute opponent\n\n";
+static const char *names[2] = { "alice", "bob" };
+
+// One turn: who moved, with what, for how much, and where the match stands after it
+struct turn {
+    int seat;
+    char move;
+    int dmg;
+    int health[2];
+    int power_moves[2];
+    int next; // whose turn it is now
+};
+
+// What a client needs to know after a turn
+struct view {
+    int health;
+    int power_moves;
+    int other;
+    int myturn;
+};
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n turns] [-s seed]\n", prog);
+    exit(1);
+}
+
+static double elapsed(struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* play n turns worth of matches into turns */
+static void playturns(struct turn *turns, long n, unsigned int seed) {
+    int health[2] = { 0, 0 }, pm[2] = { 0, 0 }, seat = 0;
+    long i;
+    for (i = 0; i < n; i++) {
+        struct turn *t = &turns[i];
+        if (health[0] <= 0 || health[1] <= 0) {
+            health[0] = rules_health(&rules, &seed);
+            health[1] = rules_health(&rules, &seed);
+            pm[0] = rules_powermoves(&rules, &seed);
+            pm[1] = rules_powermoves(&rules, &seed);
+            seat = 0;
+        }
+        t->seat = seat;
+        t->move = rules_rand(&seed) % 2 ? 'p' : 'a';
+        if (t->move == 'p' && pm[seat] <= 0) {
+            t->move = 'x';
+            t->dmg = 0;
+        } else if (t->move == 'p') {
+            pm[seat]--;
+            t->dmg = rules_powermove(&rules, &seed);
+        } else {
+            t->dmg = rules_attack(&rules, &seed);
+        }
+        health[1 - seat] -= t->dmg;
+        seat = 1 - seat;
+        // The server never shows a player below 0
+        t->health[0] = health[0] > 0 ? health[0] : 0;
+        t->health[1] = health[1] > 0 ? health[1] : 0;
+        t->power_moves[0] = pm[0];
+        t->power_moves[1] = pm[1];
+        t->next = seat;
+    }
+}
+
+/* the text q gets after turn t, as battle.c writes it
+ * returns the length
+ */
+static int textturn(char *buf, const struct turn *t, int q) {
+    const char *how = t->move == 'p' ? " with a power move" : "";
+    const char *other = names[1 - q];
+    int len = 0;
+    if (t->move == 'x') {
+        len = q == t->seat ? sprintf(buf, "You are out of power moves!\n") : 0;
+    } else if (t->dmg == 0) {
+        len = q == t->seat ? sprintf(buf, "Unlucky! You missed %s!\n", other)
+                           : sprintf(buf, "%s missed you! How Lucky!\n", other);
+    } else {
+        len = q == t->seat ? sprintf(buf, "You hit %s for %d damage%s!\n", other, t->dmg, how)
+                           : sprintf(buf, "%s hits you for %d damage%s!\n", other, t->dmg, how);
+    }
+    len += sprintf(buf + len, "\nYour health:%d\nYour powermoves: %d\n", t->health[q], t->power_moves[q]);
+    len += sprintf(buf + len, "%s's health:%d\n", other, t->health[1 - q]);
+    if (t->next == q) {
+        len += sprintf(buf + len, "%s", menu);
+    } else {
+        len += sprintf(buf + len, "Waiting for %s to strike...\n", other);
+    }
+    return len;
+}
+
+/* read a view back out of the text of a turn */
+static void textview(const char *buf, struct view *v) {
+    const char *s;
+    v->health = (s = strstr(buf, "Your health:")) ? atoi(s + 12) : -1;
+    v->power_moves = (s = strstr(buf, "Your powermoves: ")) ? atoi(s + 17) : -1;
+    v->other = (s = strstr(buf, "'s health:")) ? atoi(s + 10) : -1;
+    v->myturn = strstr(buf, "(a)ttack") != NULL;
+}
+
+/* the frames q gets after turn t
+ * returns the length
+ */
+static int binaryturn(unsigned char *buf, const struct turn *t, int q) {
+    struct proto_move mv;
+    struct proto_state st;
+    int i, len;
+    mv.seat = t->seat;
+    mv.target = 1 - t->seat;
+    mv.move = t->move;
+    mv.damage = t->dmg;
+    len = proto_encode_move(buf, &mv);
+    st.seat = q;
+    st.turn = t->next;
+    st.size = 2;
+    st.mode = 0;
+    st.power_moves = t->power_moves[q];
+    for (i = 0; i < PROTO_SEATS; i++) {
+        st.health[i] = i < 2 ? t->health[i] : -1;
+    }
+    return len + proto_encode_state(buf + len, &st);
+}
+
+/* read a view back out of the frames of a turn */
+static void binaryview(const unsigned char *buf, int len, struct view *v) {
+    struct proto_move mv;
+    struct proto_state st;
+    int off = 0, n, type, plen;
+    while ((n = proto_frame(buf + off, len - off, len, &type, &plen)) > 0) {
+        if (type == PROTO_MOVE) {
+            proto_decode_move(buf + off + PROTO_HEADER, plen, &mv);
+        } else if (type == PROTO_STATE && proto_decode_state(buf + off + PROTO_HEADER, plen, &st) == 0) {
+            v->health = st.health[st.seat];
+            v->power_moves = st.power_moves;
+            v->other = st.health[1 - st.seat];
+            v->myturn = st.turn == st.seat;
+        }
+        off += n;
+    }
+}
+
+int main(int argc, char **argv) {
+    long nturns = 2000000;
+    unsigned int seed = (unsigned int)time(NULL) | 1;
+    struct turn *turns;
+    struct view v;
+    struct timespec start;
+    char text[1024];
+    unsigned char frames[PROTO_HEADER * 2 + PROTO_MOVE_LEN + PROTO_STATE_LEN];
+    long long textbytes = 0, binbytes = 0, check = 0;
+    double textenc, textdec, binenc, bindec;
+    long i;
+    int q, len, opt;
+
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        if (opt == 'n') {
+            nturns = atol(optarg);
+        } else if (opt == 's') {
+            seed = (unsigned int)strtoul(optarg, NULL, 0) | 1;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (nturns <= 0) {
+        usage(argv[0]);
+    }
+    if ((turns = malloc(nturns * sizeof(struct turn))) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    playturns(turns, nturns, seed);
+
+    // Each path is timed building, then reading, what both players get for every turn
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < nturns; i++) {
+        for (q = 0; q < 2; q++) {
+            textbytes += textturn(text, &turns[i], q);
+        }
+    }
+    textenc = elapsed(&start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < nturns; i++) {
+        for (q = 0; q < 2; q++) {
+            textturn(text, &turns[i], q);
+            textview(text, &v);
+            check += v.health + v.other + v.power_moves + v.myturn;
+        }
+    }
+    // Reading is what the round trip costs over just building
+    textdec = elapsed(&start) - textenc;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < nturns; i++) {
+        for (q = 0; q < 2; q++) {
+            binbytes += binaryturn(frames, &turns[i], q);
+        }
+    }
+    binenc = elapsed(&start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < nturns; i++) {
+        for (q = 0; q < 2; q++) {
+            len = binaryturn(frames, &turns[i], q);
+            binaryview(frames, len, &v);
+            check -= v.health + v.other + v.power_moves + v.myturn;
+        }
+    }
+    bindec = elapsed(&start) - binenc;
+
+    printf("%ld turns, both players' messages per turn\n", nturns);
+    printf("          bytes/turn   build ns/turn   read ns/turn\n");
+    printf("text      %10.1f   %13.1f   %12.1f\n", (double)textbytes / nturns,
+           textenc * 1e9 / nturns, textdec * 1e9 / nturns);
+    printf("binary    %10.1f   %13.1f   %12.1f\n", (double)binbytes / nturns,
+           binenc * 1e9 / nturns, bindec * 1e9 / nturns);
+    if (check != 0) {
+        // The two paths must tell the clients the same thing
+        fprintf(stderr, "text and binary disagree\n");
+        free(turns);
+        return 1;
+    }
+    free(turns);
+    return 0;
+}